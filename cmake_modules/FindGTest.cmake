@@ -0,0 +1,32 @@
+# - Find gtest (gtest/gtest.h, libgtest.a)
+# This module defines
+#  GTEST_INCLUDE_DIR, directory containing headers
+#  GTEST_LIBRARY, path to libgtest.a
+#  GTEST_FOUND, whether gtest has been found
+# GTEST_ROOT, set from the Impala toolchain, is searched first.
+
+find_path(GTEST_INCLUDE_DIR NAMES gtest/gtest.h
+  HINTS ${GTEST_ROOT}/include)
+
+find_library(GTEST_LIBRARY NAMES libgtest.a gtest
+  HINTS ${GTEST_ROOT}/lib)
+
+if (GTEST_LIBRARY AND GTEST_INCLUDE_DIR)
+  set(GTEST_FOUND TRUE)
+else ()
+  set(GTEST_FOUND FALSE)
+endif ()
+
+if (GTEST_FOUND)
+  if (NOT GTEST_FIND_QUIETLY)
+    message(STATUS "GTest Library ${GTEST_LIBRARY}")
+    message(STATUS "GTest Include Found in ${GTEST_INCLUDE_DIR}")
+  endif ()
+else ()
+  message(STATUS "GTest includes and libraries NOT found. ")
+endif ()
+
+mark_as_advanced(
+  GTEST_INCLUDE_DIR
+  GTEST_LIBRARY
+)
@@ -23,15 +23,34 @@
 
 #include <hdfs.h>
 #include <dlfcn.h>
+#include <string.h>
+#include <cmath>
 #include <boost/algorithm/string.hpp>
 
+#include "lzo-block-cache.h"
+#include "lzo-buffer-pool.h"
+#include "lzo-checksum.h"
+#include "lzo-decompressor.h"
+#include "lzo-format.h"
+#include "lzo-header-cache.h"
+#include "lzo-index-cache.h"
+#include "lzo-index-reader.h"
+#include "lzo-thread-pool.h"
+#include "lzo-zone-map.h"
 #include "exec/hdfs-scan-node-base.h"
 #include "exec/scanner-context.inline.h"
+#include "exprs/scalar-expr.h"
+#include "exprs/scalar-expr-evaluator.h"
+#include "exprs/slot-ref.h"
+#include "runtime/descriptors.h"
+#include "runtime/mem-tracker.h"
 #include "runtime/runtime-state.h"
+#include "runtime/string-value.h"
 #include "runtime/hdfs-fs-cache.h"
 #include "util/debug-util.h"
 #include "util/error-util.h"
 #include "util/hdfs-util.h"
+#include "util/stopwatch.h"
 
 #include "gen-cpp/Descriptors_types.h"
 
@@ -51,10 +70,42 @@ using ScanRange = DiskIoMgr::ScanRange;
 
 DEFINE_bool(disable_lzo_checksums, true,
     "Disable internal checksum checking for Lzo compressed files, defaults true");
-
-// The magic byte sequence at the beginning of an LZOP file.
-static const uint8_t LZOP_MAGIC[9] =
-    { 0x89, 0x4c, 0x5a, 0x4f, 0x00, 0x0d, 0x0a, 0x1a, 0x0a };
+DEFINE_int32(lzo_decompress_readahead_blocks, 0,
+    "Number of compressed blocks each lzo scanner reads ahead of the block it is "
+    "parsing and decompresses on the daemon-wide decompression pool. If 0, blocks are "
+    "decompressed one at a time on the scanner thread.");
+DEFINE_bool(lzo_fast_decompressor, false,
+    "If true, lzo blocks are decompressed with the scanner's own LZO1X decoder, which "
+    "copies data in wide chunks, instead of liblzo's lzo1x_decompress_safe(). Both "
+    "produce the same output and reject corrupt blocks.");
+DEFINE_int32(lzo_decompress_chunk_size, 0,
+    "If > 0 and --lzo_fast_decompressor is set, lzo blocks decompressed on the scanner "
+    "thread are decompressed and parsed in chunks of about this many bytes, so each "
+    "chunk is parsed while it is still in the CPU cache. Not used if blocks are read "
+    "ahead or decompressed checksums are verified. About half the L2 cache size works "
+    "well.");
+DEFINE_bool(lzo_zone_maps, false,
+    "If true, lzo scanners read the zone map sidecar written by lzo-zonemap-writer next "
+    "to each file, if any, and skip blocks in which no row can satisfy the query's "
+    "comparisons of columns with constants.");
+DEFINE_bool(lzo_balance_splits, true,
+    "If true, the scan ranges of indexed lzo files each cover about the same share of "
+    "the file's uncompressed data as their split has of its compressed bytes, going by "
+    "the block lengths in a version 2 index, or else by the number of blocks, which is "
+    "only approximate for files whose blocks vary in length, instead of the blocks that "
+    "start in the split.");
+DEFINE_bool(lzo_count_rows_only, true,
+    "If true, lzo scans that materialize no columns and have no predicates, such as "
+    "COUNT(*), count line delimiters in the decompressed blocks instead of parsing "
+    "rows. Blocks with line counts in a version 2 index are not read at all.");
+DEFINE_int64(lzo_lazy_index_min_bytes, 0,
+    "If > 0, hadoop-lzo indexes of at least this many bytes are not read while the "
+    "file's header is parsed. Each scanner instead reads the entries of its own range, "
+    "with positioned reads, and ranges follow the file's splits. Version 2 indexes are "
+    "always read whole. If 0, all indexes are read with the header.");
+DEFINE_bool(lzo_resync_non_indexed_files, false,
+    "If true, lzo files without an index are split and each scanner searches for the "
+    "first block in its range. If false, such files are read by a single scanner.");
 
 extern "C" HdfsLzoTextScanner* CreateLzoTextScanner(
     HdfsScanNodeBase* scan_node, RuntimeState* state) {
@@ -81,31 +132,84 @@ HdfsLzoTextScanner::~HdfsLzoTextScanner() {
 }
 
 void HdfsLzoTextScanner::Close(RowBatch* row_batch) {
+  DrainReadAheadQueue();
+  // Nothing returned references the recycled buffers.
+  recycled_buffer_.Reset();
+  current_block_buffer_.Reset();
+  chunk_compressed_buffer_.Reset();
+  if (buffer_pool_idle_bytes_counter_ != nullptr) {
+    buffer_pool_idle_bytes_counter_->Set(LzoBufferPool::GetStats().idle_bytes);
+  }
+  if (block_cache_bytes_counter_ != nullptr && LzoBlockCache::IsEnabled()) {
+    LzoBlockCache::Stats stats = LzoBlockCache::GetStats();
+    block_cache_bytes_counter_->Set(stats.bytes);
+    block_cache_evictions_counter_->Set(stats.evictions);
+  }
+  if (record_offsets_ && read_eof_) PersistRecordedOffsets();
   if (row_batch != nullptr) {
     row_batch->tuple_data_pool()->AcquireData(block_buffer_pool_.get(), false);
+    if (current_block_pool_ != nullptr) {
+      row_batch->tuple_data_pool()->AcquireData(current_block_pool_.get(), false);
+    }
   } else {
     block_buffer_pool_->FreeAll();
+    if (current_block_pool_ != nullptr) current_block_pool_->FreeAll();
   }
   HdfsTextScanner::Close(row_batch);
 }
 
 Status HdfsLzoTextScanner::Open(ScannerContext* context) {
   RETURN_IF_ERROR(HdfsTextScanner::Open(context));
-  stream_->set_read_past_size_cb(&HdfsLzoTextScanner::MaxBlockCompressedSize);
+  AddCounters();
+  stream_->set_read_past_size_cb(
+      [this](int64_t file_offset) { return ReadPastSize(file_offset); });
+  count_rows_only_ = FLAGS_lzo_count_rows_only && LzoFormat::CanCountRowsByLines(
+      scan_node_->materialized_slots().size(), scan_node_->conjuncts().size(),
+      context->partition_descriptor()->escape_char(),
+      scan_node_->skip_header_line_count());
   header_ = reinterpret_cast<LzoFileHeader*>(
       static_cast<HdfsScanNodeBase*>(scan_node_)->GetFileMetadata(
           context->partition_descriptor()->id(), stream_->filename()));
   if (header_ == nullptr) {
-    only_parsing_header_ = true;
-    return Status::OK();
+    HdfsFileDesc* file_desc = scan_node_->GetFileDesc(
+        context->partition_descriptor()->id(), stream_->filename());
+    if (!IsWholeFileSplit(file_desc)) {
+      only_parsing_header_ = true;
+      return Status::OK();
+    }
+    // A file that is a single split is read by one range covering the whole file,
+    // which starts with the header. See LzoIssueInitialRangesImpl().
+    DCHECK_EQ(stream_->scan_range()->offset(), 0);
+    RETURN_IF_ERROR(ReadInlineHeader());
   }
 
   DCHECK_EQ(only_parsing_header_, false);
+  InitZoneMap();
+  if (FLAGS_lzo_decompress_readahead_blocks > 0 && !count_rows_only_) {
+    RETURN_IF_ERROR(LzoThreadPool::GetDecompressionPool(&decompression_pool_));
+    read_ahead_ = true;
+  }
+
   Status status;
   if (stream_->scan_range()->offset() == 0) {
     RETURN_IF_FALSE(stream_->SkipBytes(header_->header_size_, &status));
+    // Later ranges read their slice of a lazily read index to find their first block.
+    // The first range needs it too, to size its read past the range's end.
+    if (header_->lazy_index_len > 0 && !range_offsets_read_) {
+      range_offsets_read_ = true;
+      status = ReadRangeOffsets();
+    }
+    // Build an index while reading a whole file that has none, if the file is large
+    // enough to be split and the index would be used, see ReadIndexFile().
+    if (header_->offsets.empty() && LzoIndexCache::IsEnabled()) {
+      HdfsFileDesc* file_desc = scan_node_->GetFileDesc(
+          context->partition_descriptor()->id(), stream_->filename());
+      record_offsets_ = stream_->scan_range()->len() == file_desc->file_length
+          && file_desc->splits.size() > 1 && OwnsAllSplits(file_desc);
+    }
   } else {
-    DCHECK(!header_->offsets.empty());
+    DCHECK(!header_->offsets.empty() || header_->lazy_index_len > 0
+        || FLAGS_lzo_resync_non_indexed_files);
     bool found_block;
     status = FindFirstBlock(&found_block);
     if (!found_block) eos_ = true;
@@ -114,41 +218,228 @@ Status HdfsLzoTextScanner::Open(ScannerContext* context) {
   return Status::OK();
 }
 
+void HdfsLzoTextScanner::AddCounters() {
+  RuntimeProfile* profile = scan_node_->runtime_profile();
+  blocks_decompressed_counter_ =
+      ADD_COUNTER(profile, "LzoBlocksDecompressed", TUnit::UNIT);
+  compressed_bytes_counter_ =
+      ADD_COUNTER(profile, "LzoCompressedBytesDecompressed", TUnit::BYTES);
+  uncompressed_bytes_counter_ =
+      ADD_COUNTER(profile, "LzoUncompressedBytesDecompressed", TUnit::BYTES);
+  stored_blocks_counter_ = ADD_COUNTER(profile, "LzoStoredBlocks", TUnit::UNIT);
+  block_decompress_time_ = ADD_SUMMARY_STATS_TIMER(profile, "LzoBlockDecompressTime");
+  checksum_timer_ = ADD_TIMER(profile, "LzoChecksumTime");
+  header_parse_timer_ = ADD_TIMER(profile, "LzoHeaderParseTime");
+  index_load_timer_ = ADD_TIMER(profile, "LzoIndexLoadTime");
+  index_entries_counter_ = ADD_COUNTER(profile, "LzoIndexEntriesLoaded", TUnit::UNIT);
+  read_past_bytes_counter_ = ADD_COUNTER(profile, "LzoBytesReadPastRange", TUnit::BYTES);
+  skipped_to_block_counter_ =
+      ADD_COUNTER(profile, "LzoBytesSkippedToBlock", TUnit::BYTES);
+  recoveries_counter_ = ADD_COUNTER(profile, "LzoCorruptBlockRecoveries", TUnit::UNIT);
+  peak_block_buffer_counter_ =
+      profile->AddHighWaterMarkCounter("LzoPeakBlockBufferBytes", TUnit::BYTES);
+  peak_reserved_counter_ =
+      profile->AddHighWaterMarkCounter("LzoPeakReservedBufferBytes", TUnit::BYTES);
+  read_ahead_backoffs_counter_ =
+      ADD_COUNTER(profile, "LzoReadAheadBackoffs", TUnit::UNIT);
+  buffer_pool_hits_counter_ = ADD_COUNTER(profile, "LzoBufferPoolHits", TUnit::UNIT);
+  buffer_pool_misses_counter_ = ADD_COUNTER(profile, "LzoBufferPoolMisses", TUnit::UNIT);
+  buffer_pool_idle_bytes_counter_ =
+      ADD_COUNTER(profile, "LzoBufferPoolIdleBytes", TUnit::BYTES);
+  zone_map_skipped_counter_ =
+      ADD_COUNTER(profile, "LzoZoneMapBlocksSkipped", TUnit::UNIT);
+  indexed_rows_counter_ = ADD_COUNTER(profile, "LzoRowsCountedFromIndex", TUnit::UNIT);
+  block_cache_hits_counter_ = ADD_COUNTER(profile, "LzoBlockCacheHits", TUnit::UNIT);
+  block_cache_misses_counter_ = ADD_COUNTER(profile, "LzoBlockCacheMisses", TUnit::UNIT);
+  block_cache_bytes_counter_ = ADD_COUNTER(profile, "LzoBlockCacheBytes", TUnit::BYTES);
+  block_cache_evictions_counter_ =
+      ADD_COUNTER(profile, "LzoBlockCacheEvictions", TUnit::UNIT);
+}
+
+Status HdfsLzoTextScanner::CountRows(RowBatch* row_batch) {
+  if (!counted_indexed_rows_) {
+    counted_indexed_rows_ = true;
+    RETURN_IF_ERROR(CountIndexedRows());
+  }
+  while (!row_batch->AtCapacity()) {
+    if (rows_to_return_ == 0) {
+      if (count_eos_) {
+        eos_ = true;
+        return Status::OK();
+      }
+      Status status = CountNextBlock();
+      if (!status.ok()) {
+        bool found_block;
+        RETURN_IF_ERROR(SkipBadBlock(status, &found_block));
+        count_eos_ = !found_block;
+      }
+      continue;
+    }
+    int num_rows = min<int64_t>(rows_to_return_,
+        row_batch->capacity() - row_batch->num_rows());
+    TupleRow* row = row_batch->GetRow(row_batch->AddRow());
+    int num_to_commit = WriteTemplateTuples(row, num_rows);
+    COUNTER_ADD(scan_node_->rows_read_counter(), num_rows);
+    RETURN_IF_ERROR(CommitRows(num_to_commit, row_batch));
+    rows_to_return_ -= num_rows;
+  }
+  return Status::OK();
+}
+
+Status HdfsLzoTextScanner::CountIndexedRows() {
+  const LzoBlockOffsets& offsets = header_->offsets;
+  if (header_->line_counts.empty()
+      || header_->line_delim != context_->partition_descriptor()->line_delim()) {
+    return Status::OK();
+  }
+  int64_t range_end = stream_->scan_range()->offset() + stream_->scan_range()->len();
+  int64_t first = offsets.LowerBound(stream_->file_offset());
+  int64_t last = offsets.LowerBound(range_end);
+  if (first == last) return Status::OK();
+  // The last block is read, to find out whether the file ends with a line delimiter.
+  // So are any blocks after it, if the index is missing some.
+  bool has_last_block = last == offsets.size();
+  if (has_last_block) --last;
+  for (int64_t i = first; i != last; ++i) rows_to_return_ += header_->line_counts[i];
+  COUNTER_ADD(indexed_rows_counter_, rows_to_return_);
+  if (!has_last_block) {
+    count_eos_ = true;
+    return Status::OK();
+  }
+  Status status;
+  RETURN_IF_FALSE(stream_->SkipBytes(offsets[last] - stream_->file_offset(), &status));
+  return Status::OK();
+}
+
+Status HdfsLzoTextScanner::CountNextBlock() {
+  // Like the parsing path, read the blocks that start in the scan range.
+  if (stream_->eosr()) {
+    count_eos_ = true;
+    return Status::OK();
+  }
+  CompressedBlock block;
+  RETURN_IF_ERROR(ReadBlockHeader(&block));
+  if (block.uncompressed_len != 0) RETURN_IF_ERROR(ReadBlockData(&block, nullptr));
+  if (block.uncompressed_len == 0) {
+    count_eos_ = true;
+    return Status::OK();
+  }
+
+  const uint8_t* data = block.data;
+  if (block.compressed_len == block.uncompressed_len) {
+    COUNTER_ADD(stored_blocks_counter_, 1);
+    RETURN_IF_ERROR(Checksum(header_->input_checksum_type_, "compressed",
+        block.in_checksum, block.data, block.compressed_len, block.file_offset));
+  } else {
+    RETURN_IF_ERROR(GetRecycledBuffer(
+        block.uncompressed_len + LzoDecompressor::OUTPUT_SLACK, &recycled_buffer_));
+    RETURN_IF_ERROR(DecompressBlock(block, recycled_buffer_.data()));
+    data = recycled_buffer_.data();
+  }
+  char delim = context_->partition_descriptor()->line_delim();
+  rows_to_return_ += LzoFormat::CountLines(data, block.uncompressed_len, delim);
+  // Each row is counted by the block holding its delimiter. The last row of the file
+  // also counts if it has none, i.e. if only the end of file marker follows the block.
+  int64_t file_length = scan_node_->GetFileDesc(
+      context_->partition_descriptor()->id(), stream_->filename())->file_length;
+  if (stream_->file_offset() + sizeof(int32_t) >= file_length
+      && data[block.uncompressed_len - 1] != delim) {
+    ++rows_to_return_;
+  }
+  return Status::OK();
+}
+
 Status HdfsLzoTextScanner::GetNextInternal(RowBatch* row_batch) {
   if (eos_) return Status::OK();
 
   if (only_parsing_header_) {
     DCHECK(header_ == nullptr);
-    // This is the initial scan range just to parse the header
-    header_ = state_->obj_pool()->Add(new LzoFileHeader());
+    // This is the initial scan range just to parse the header. The query holds a
+    // reference to the header, which may also be held by LzoHeaderCache.
+    std::shared_ptr<LzoFileHeader> header(new LzoFileHeader());
+    state_->obj_pool()->Add(new std::shared_ptr<const LzoFileHeader>(header));
+    header_ = header.get();
     // Parse the header and read the index file.
-    Status status = ReadHeader();
-    if (!status.ok()) {
-      stringstream ss;
-      // TODO: remove this here. We should be able to just return the error and
-      // hdfs-scan-node should include all the diagnostics related to the stream.
-      // e.g. filename, file format, byte position, eosr, etc.
-      ss << "Invalid lzo header information: " << stream_->filename();
-      status.AddDetail(ss.str());
-      return status;
-    }
+    RETURN_IF_ERROR(ReadAndValidateHeader());
     RETURN_IF_ERROR(ReadIndexFile());
+    COUNTER_ADD(index_entries_counter_, header_->offsets.size());
+    MaybeReadZoneMapFile();
+    HdfsFileDesc* file_desc = scan_node_->GetFileDesc(
+        context_->partition_descriptor()->id(), stream_->filename());
+    if (LzoHeaderCache::IsEnabled() && !offsets_from_index_cache_) {
+      LzoHeaderCache::Insert(stream_->filename(), file_desc->mtime,
+          file_desc->file_length, header);
+    }
     // Header is parsed, set the metadata in the scan node.
     static_cast<HdfsScanNodeBase*>(scan_node_)->SetFileMetadata(
         context_->partition_descriptor()->id(), stream_->filename(), header_);
-    RETURN_IF_ERROR(IssueFileRanges(stream_->filename()));
+    RETURN_IF_ERROR(IssueFileRanges(scan_node_, file_desc, header_));
     scan_node_->UpdateRemainingScanRangeSubmissions(-1);
     eos_ = true;
   } else {
     DCHECK(header_ != nullptr);
+    if (count_rows_only_) return CountRows(row_batch);
     RETURN_IF_ERROR(HdfsTextScanner::GetNextInternal(row_batch));
   }
   return Status::OK();
 }
 
+Status HdfsLzoTextScanner::ReadAndValidateHeader() {
+  SCOPED_TIMER(header_parse_timer_);
+  Status status = ReadHeader();
+  if (!status.ok()) {
+    stringstream ss;
+    // TODO: remove this here. We should be able to just return the error and
+    // hdfs-scan-node should include all the diagnostics related to the stream.
+    // e.g. filename, file format, byte position, eosr, etc.
+    ss << "Invalid lzo header information: " << stream_->filename();
+    status.AddDetail(ss.str());
+  }
+  return status;
+}
+
+bool HdfsLzoTextScanner::IsWholeFileSplit(const HdfsFileDesc* file_desc) {
+  // The splits of a file are divided among the instances of the scan, so a single
+  // split may be any part of a file that other instances also read.
+  return file_desc->splits.size() == 1 && file_desc->splits[0]->offset() == 0
+      && file_desc->splits[0]->len() == file_desc->file_length;
+}
+
+bool HdfsLzoTextScanner::OwnsAllSplits(const HdfsFileDesc* file_desc) {
+  int64_t len = 0;
+  for (const ScanRange* split : file_desc->splits) len += split->len();
+  return len == file_desc->file_length;
+}
+
+Status HdfsLzoTextScanner::ReadInlineHeader() {
+  // No other scanner of this query reads this file. The index only matters for
+  // recovering from corrupt blocks, so it is read on the first error, unless its line
+  // counts can count the rows or the header is cached for later queries.
+  std::shared_ptr<LzoFileHeader> header(new LzoFileHeader());
+  state_->obj_pool()->Add(new std::shared_ptr<const LzoFileHeader>(header));
+  header_ = header.get();
+  RETURN_IF_ERROR(ReadAndValidateHeader());
+  if (!count_rows_only_ && !LzoHeaderCache::IsEnabled()) {
+    index_pending_ = true;
+    MaybeReadZoneMapFile();
+    return Status::OK();
+  }
+  RETURN_IF_ERROR(ReadIndexFile());
+  COUNTER_ADD(index_entries_counter_, header_->offsets.size());
+  MaybeReadZoneMapFile();
+  if (LzoHeaderCache::IsEnabled() && !offsets_from_index_cache_) {
+    HdfsFileDesc* file_desc = scan_node_->GetFileDesc(
+        context_->partition_descriptor()->id(), stream_->filename());
+    LzoHeaderCache::Insert(stream_->filename(), file_desc->mtime,
+        file_desc->file_length, header);
+  }
+  return Status::OK();
+}
+
 Status HdfsLzoTextScanner::LzoIssueInitialRangesImpl(HdfsScanNodeBase* scan_node,
     const vector<HdfsFileDesc*>& files) {
   vector<ScanRange*> header_ranges;
+  vector<ScanRange*> file_ranges;
   // Issue just the header range for each file.  When the header is complete,
   // we'll issue the ranges for that file.  Read the minimum header size plus
   // up to 255 bytes of optional file name.
@@ -158,26 +449,53 @@ Status HdfsLzoTextScanner::LzoIssueInitialRangesImpl(HdfsScanNodeBase* scan_node
 
     ScanRangeMetadata* metadata =
         reinterpret_cast<ScanRangeMetadata*>(files[i]->splits[0]->meta_data());
-    int64_t header_size = min(static_cast<int64_t>(HEADER_SIZE), files[i]->file_length);
     bool expected_local = false;
     int cache_options = !scan_node->IsDataCacheDisabled() ? BufferOpts::USE_DATA_CACHE :
         BufferOpts::NO_CACHING;
+    if (LzoHeaderCache::IsEnabled()) {
+      std::shared_ptr<const LzoFileHeader> header = LzoHeaderCache::Lookup(
+          files[i]->filename, files[i]->mtime, files[i]->file_length);
+      if (header != nullptr) {
+        // Keep the header alive for the query even if it is evicted from the cache.
+        scan_node->runtime_state()->obj_pool()->Add(
+            new std::shared_ptr<const LzoFileHeader>(header));
+        scan_node->SetFileMetadata(metadata->partition_id, files[i]->filename,
+            const_cast<LzoFileHeader*>(header.get()));
+        RETURN_IF_ERROR(IssueFileRanges(scan_node, files[i], header.get()));
+        continue;
+      }
+    }
+    if (IsWholeFileSplit(files[i])) {
+      // A file that is a single split is read by one scanner anyway, with or without
+      // an index. Issue one range for the whole file and parse the header at its start,
+      // rather than reading the header in a range of its own first.
+      ScanRange* split = files[i]->splits[0];
+      ScanRange* file_range = scan_node->AllocateScanRange(files[i]->fs,
+          files[i]->filename.c_str(), files[i]->file_length, 0, metadata->partition_id,
+          split->disk_id(), cache_options, split->expected_local(), files[i]->mtime);
+      file_ranges.push_back(file_range);
+      continue;
+    }
+    int64_t header_size = min(static_cast<int64_t>(HEADER_SIZE), files[i]->file_length);
     ScanRange* header_range = scan_node->AllocateScanRange(
         files[i]->fs, files[i]->filename.c_str(), header_size, 0, metadata->partition_id,
         -1, cache_options, expected_local, files[i]->mtime);
     header_ranges.push_back(header_range);
+    // Read the index while the header range is queued, rather than after it.
+    LzoIndexReader::Prefetch(files[i]->fs, files[i]->filename, files[i]->mtime);
   }
   // The files' ranges will be submitted once the header range completes.
   scan_node->UpdateRemainingScanRangeSubmissions(header_ranges.size());
   RETURN_IF_ERROR(scan_node->AddDiskIoRanges(header_ranges));
+  if (!file_ranges.empty()) RETURN_IF_ERROR(scan_node->AddDiskIoRanges(file_ranges));
   return Status::OK();
 }
 
-Status HdfsLzoTextScanner::IssueFileRanges(const char* filename) {
-  DCHECK(header_ != nullptr);
-  HdfsFileDesc* file_desc = scan_node_->GetFileDesc(
-      context_->partition_descriptor()->id(), filename);
-  if (header_->offsets.empty()) {
+Status HdfsLzoTextScanner::IssueFileRanges(HdfsScanNodeBase* scan_node,
+    HdfsFileDesc* file_desc, const LzoFileHeader* header) {
+  DCHECK(header != nullptr);
+  if (header->offsets.empty() && header->lazy_index_len == 0
+      && !FLAGS_lzo_resync_non_indexed_files) {
     // If offsets is empty then there was no index file.  The file cannot be split.
     // If this contains the range starting at offset 0 generate a scan for whole file.
     const vector<ScanRange*>& splits = file_desc->splits;
@@ -186,7 +504,7 @@ Status HdfsLzoTextScanner::IssueFileRanges(const char* filename) {
       if (splits[j]->offset() != 0) {
         // There is no index so this file is not splittable. Mark the other initial
         // splits complete.
-        scan_node_->RangeComplete(THdfsFileFormat::TEXT, THdfsCompression::LZO);
+        scan_node->RangeComplete(THdfsFileFormat::TEXT, THdfsCompression::LZO);
         continue;
       }
       // There can only be one 0-offset range
@@ -194,126 +512,596 @@ Status HdfsLzoTextScanner::IssueFileRanges(const char* filename) {
       ScanRangeMetadata* metadata =
           reinterpret_cast<ScanRangeMetadata*>(file_desc->splits[0]->meta_data());
       bool expected_local = false;
-      zero_offset_range = scan_node_->AllocateScanRange(
-          file_desc->fs, filename, file_desc->file_length, 0, metadata->partition_id,
-          -1, BufferOpts::NO_CACHING, expected_local, file_desc->mtime);
+      int cache_options = !scan_node->IsDataCacheDisabled() ?
+          BufferOpts::USE_DATA_CACHE : BufferOpts::NO_CACHING;
+      zero_offset_range = scan_node->AllocateScanRange(
+          file_desc->fs, file_desc->filename.c_str(), file_desc->file_length, 0,
+          metadata->partition_id, -1, cache_options, expected_local, file_desc->mtime);
     }
     // Add the 0-offset range.
     if (zero_offset_range != nullptr) {
-      RETURN_IF_ERROR(scan_node_->AddDiskIoRanges(
+      RETURN_IF_ERROR(scan_node->AddDiskIoRanges(
         vector<ScanRange*>(1, zero_offset_range)));
     }
+  } else if (!header->offsets.empty()) {
+    RETURN_IF_ERROR(IssueBlockAlignedRanges(scan_node, file_desc, header));
   } else {
-    RETURN_IF_ERROR(scan_node_->AddDiskIoRanges(file_desc));
+    // Without the offsets, each scanner finds the first block in its split, in the
+    // slice of a lazily read index or by searching the data.
+    RETURN_IF_ERROR(scan_node->AddDiskIoRanges(file_desc));
   }
   return Status::OK();
 }
 
+// Returns the split of 'splits' that contains 'offset', or 'fallback' if none does, as
+// when the split holding it belongs to another instance of the scan.
+static ScanRange* FindSplit(const vector<ScanRange*>& splits, int64_t offset,
+    ScanRange* fallback) {
+  for (ScanRange* split : splits) {
+    if (offset >= split->offset() && offset < split->offset() + split->len()) {
+      return split;
+    }
+  }
+  return fallback;
+}
+
+Status HdfsLzoTextScanner::IssueBlockAlignedRanges(HdfsScanNodeBase* scan_node,
+    HdfsFileDesc* file_desc, const LzoFileHeader* header) {
+  int cache_options = !scan_node->IsDataCacheDisabled() ? BufferOpts::USE_DATA_CACHE :
+      BufferOpts::NO_CACHING;
+  const vector<ScanRange*>& splits = file_desc->splits;
+  vector<pair<int64_t, int64_t>> split_bounds;
+  for (ScanRange* split : splits) {
+    split_bounds.emplace_back(split->offset(), split->len());
+  }
+  vector<LzoFormat::Range> plan;
+  LzoFormat::PlanRanges(*header, file_desc->file_length, split_bounds,
+      FLAGS_lzo_balance_splits, &plan);
+  vector<ScanRange*> ranges;
+  for (int i = 0; i < splits.size(); ++i) {
+    if (plan[i].empty()) {
+      // No block starts in the range.
+      scan_node->RangeComplete(THdfsFileFormat::TEXT, THdfsCompression::LZO);
+      continue;
+    }
+    ScanRange* split = splits[i];
+    int64_t offset = plan[i].offset;
+    int64_t end = plan[i].end;
+    // A balanced range is read from the disk holding its first block.
+    if (FLAGS_lzo_balance_splits) {
+      split = FindSplit(splits, header->offsets[plan[i].first_block], splits[i]);
+    }
+    ScanRangeMetadata* metadata =
+        reinterpret_cast<ScanRangeMetadata*>(split->meta_data());
+    ranges.push_back(scan_node->AllocateScanRange(file_desc->fs,
+        file_desc->filename.c_str(), end - offset, offset, metadata->partition_id,
+        split->disk_id(), cache_options, split->expected_local(), file_desc->mtime));
+  }
+  if (!ranges.empty()) RETURN_IF_ERROR(scan_node->AddDiskIoRanges(ranges));
+  return Status::OK();
+}
+
+Status HdfsLzoTextScanner::ReadRangeOffsets() {
+  SCOPED_TIMER(index_load_timer_);
+  HdfsFileDesc* file_desc = scan_node_->GetFileDesc(
+      context_->partition_descriptor()->id(), stream_->filename());
+  int64_t range_start = stream_->scan_range()->offset();
+  RETURN_IF_ERROR(LzoIndexReader::ReadRange(stream_->scan_range()->fs(),
+      stream_->filename(), file_desc->file_length, header_->lazy_index_len, range_start,
+      range_start + stream_->scan_range()->len(), &range_offsets_));
+  COUNTER_ADD(index_entries_counter_, range_offsets_.size());
+  return Status::OK();
+}
+
 Status HdfsLzoTextScanner::ReadIndexFile() {
-  string index_filename(stream_->filename());
-  index_filename.append(HdfsTextScanner::LZO_INDEX_SUFFIX);
+  SCOPED_TIMER(index_load_timer_);
+  HdfsFileDesc* file_desc = scan_node_->GetFileDesc(
+      context_->partition_descriptor()->id(), stream_->filename());
+  bool found;
+  RETURN_IF_ERROR(LzoIndexReader::Read(stream_->scan_range()->fs(), stream_->filename(),
+      file_desc->mtime, header_, &found));
+  if (found) return Status::OK();
 
-  hdfsFS connection = stream_->scan_range()->fs();
   // If there is no index file we can read the file by starting at the beginning
   // and reading through to the end.
-  if (hdfsExists(connection, index_filename.c_str()) != 0) {
-    LOG(WARNING) << "No index file for: " << stream_->filename()
-                 << ". Split scans are not possible.";
-    return Status::OK();
+  if (LzoIndexCache::IsEnabled() && OwnsAllSplits(file_desc)) {
+    // Use the index built by an earlier scan of the file, if any. The cache is local
+    // to this daemon, so only if no other instance has splits of the file: they would
+    // not find the index and would read the file from the start, or not at all, so
+    // rows would be read twice or missed.
+    Status status = LzoIndexCache::Lookup(stream_->filename(), file_desc->mtime,
+        file_desc->file_length, &header_->offsets, &found);
+    if (!status.ok()) {
+      LOG(WARNING) << "Error reading cached index for: " << stream_->filename()
+                   << ": " << status.GetDetail();
+      header_->offsets.clear();
+    } else if (found) {
+      VLOG_FILE << "Using cached index for: " << stream_->filename();
+      offsets_from_index_cache_ = true;
+      return Status::OK();
+    }
   }
+  LOG(WARNING) << "No index file for: " << stream_->filename()
+               << ". Split scans are not possible.";
+  return Status::OK();
+}
 
-  hdfsFile index_file = hdfsOpenFile(connection,
-       index_filename.c_str(), O_RDONLY, 0, 0, 0);
-
-  if (index_file == nullptr) {
-    return Status(GetHdfsErrorMsg("Error while opening index file: ", index_filename));
+Status HdfsLzoTextScanner::ReadZoneMapFile() {
+  HdfsFileDesc* file_desc = scan_node_->GetFileDesc(
+      context_->partition_descriptor()->id(), stream_->filename());
+  hdfsFS fs = stream_->scan_range()->fs();
+  string filename = stream_->filename() + LzoZoneMap::SUFFIX;
+  if (hdfsExists(fs, filename.c_str()) != 0) return Status::OK();
+
+  hdfsFile file = hdfsOpenFile(fs, filename.c_str(), O_RDONLY, 0, 0, 0);
+  if (file == nullptr) {
+    return Status(GetHdfsErrorMsg("Error while opening zone map file: ", filename));
+  }
+  vector<uint8_t> data;
+  int64_t data_len = 0;
+  int num_read;
+  do {
+    data.resize(max<int64_t>(data_len + 64 * 1024, 2 * data.size()));
+    num_read = hdfsRead(fs, file, data.data() + data_len, data.size() - data_len);
+    if (num_read > 0) data_len += num_read;
+  } while (num_read > 0);
+  int close_stat = hdfsCloseFile(fs, file);
+  if (num_read < 0) {
+    return Status(GetHdfsErrorMsg("Error while reading zone map file: ", filename));
+  }
+  if (close_stat != 0) {
+    return Status(GetHdfsErrorMsg("Error while closing zone map file: ", filename));
   }
 
-  // TODO: This should go through the I/O manager.
-  constexpr uint16_t TARGET_READ_SIZE = 10 * 1024;
-  uint8_t buffer[TARGET_READ_SIZE];
-  tSize bytes_read;
-  uint8_t unprocessed_bytes = 0;
+  std::shared_ptr<LzoZoneMap> zone_map(new LzoZoneMap());
+  string error;
+  if (!zone_map->Deserialize(data.data(), data_len, &error)) {
+    stringstream ss;
+    ss << "Invalid zone map file: " << filename << ": " << error;
+    return Status(ss.str());
+  }
+  if (zone_map->file_length() != file_desc->file_length) {
+    // The file was rewritten after the zone map.
+    LOG(WARNING) << "Ignoring zone map of " << zone_map->file_length()
+                 << " byte file for: " << stream_->filename() << " of "
+                 << file_desc->file_length << " bytes";
+    return Status::OK();
+  }
+  header_->zone_map = zone_map;
+  VLOG_FILE << "Using zone map with " << zone_map->num_blocks() << " blocks for: "
+            << stream_->filename();
+  return Status::OK();
+}
 
-  // We expect that the file size be a multiple of sizeof(uint64_t). However, we may not
-  // always get a buffer of a size that is a multiple of sizeof(uint64_t) from hdfsRead().
-  // We carry over the (buffer size % sizeof(uint64_t)) from every hdfsRead() every time
-  // and process it in the next iteration of the loop so as to not over look some bytes.
-  while ((bytes_read = hdfsRead(connection, index_file,
-      buffer + unprocessed_bytes, TARGET_READ_SIZE - unprocessed_bytes)) > 0) {
-    bytes_read += unprocessed_bytes;
-    unprocessed_bytes = bytes_read % sizeof(uint64_t);
+void HdfsLzoTextScanner::MaybeReadZoneMapFile() {
+  if (!FLAGS_lzo_zone_maps) return;
+  Status status = ReadZoneMapFile();
+  if (!status.ok()) {
+    LOG(WARNING) << "Error reading zone map for: " << stream_->filename() << ": "
+                 << status.GetDetail();
+  }
+}
 
-    // Round down to the nearset multiple of size(uint64_t).
-    uint16_t read_until = bytes_read - unprocessed_bytes;
-    // Interpret bytes as a series of 64-bit offsets.
-    for (uint8_t* bp = buffer; bp < buffer + read_until; bp += sizeof(uint64_t)) {
-      int64_t offset = ReadWriteUtil::GetInt<uint64_t>(bp);
-      header_->offsets.push_back(offset);
+void HdfsLzoTextScanner::InitZoneMap() {
+  const LzoZoneMap* zone_map = header_->zone_map.get();
+  if (zone_map == nullptr) return;
+  // Rows are cut at line delimiters, which can't be told apart from escaped ones.
+  const HdfsPartitionDescriptor* partition = context_->partition_descriptor();
+  if (partition->escape_char() != '\0'
+      || partition->line_delim() != zone_map->line_delim()
+      || partition->field_delim() != zone_map->field_delim()) {
+    return;
+  }
+  zone_map_ = zone_map;
+  const vector<ScalarExpr*>& conjuncts = scan_node_->conjuncts();
+  for (int i = 0; i < conjuncts.size(); ++i) {
+    LzoZoneMap::Predicate predicate;
+    if (GetZoneMapPredicate(*conjuncts[i], (*conjunct_evals_)[i], &predicate)) {
+      zone_map_predicates_.push_back(predicate);
     }
-    // Move over the remaining 0-7 bytes that haven't been processed to the beginning of
-    // the buffer.
-    for (uint8_t i = 0; i < unprocessed_bytes; ++i) {
-      buffer[i] = buffer[read_until + i];
+  }
+  if (zone_map_predicates_.empty()) zone_map_ = nullptr;
+}
+
+bool HdfsLzoTextScanner::GetZoneMapPredicate(const ScalarExpr& conjunct,
+    ScalarExprEvaluator* eval, LzoZoneMap::Predicate* predicate) const {
+  static const pair<const char*, LzoZoneMap::Predicate::Op> OPS[] = {
+    {"lt", LzoZoneMap::Predicate::LT}, {"le", LzoZoneMap::Predicate::LE},
+    {"eq", LzoZoneMap::Predicate::EQ}, {"ge", LzoZoneMap::Predicate::GE},
+    {"gt", LzoZoneMap::Predicate::GT}};
+  if (conjunct.GetNumChildren() != 2) return false;
+  int op = 0;
+  while (op < 5 && conjunct.function_name() != OPS[op].first) ++op;
+  if (op == 5) return false;
+  predicate->op = OPS[op].second;
+
+  // Put the column on the left, mirroring the comparison if it is on the right.
+  const ScalarExpr* column = conjunct.GetChild(0);
+  const ScalarExpr* constant = conjunct.GetChild(1);
+  if (!column->IsSlotRef()) {
+    swap(column, constant);
+    predicate->op = static_cast<LzoZoneMap::Predicate::Op>(
+        LzoZoneMap::Predicate::GT - predicate->op);
+  }
+  if (!column->IsSlotRef() || !constant->IsLiteral()) return false;
+  if (column->type().type != constant->type().type) return false;
+
+  SlotId slot_id = static_cast<const SlotRef*>(column)->slot_id();
+  const SlotDescriptor* slot = nullptr;
+  for (const SlotDescriptor* s : scan_node_->tuple_desc()->slots()) {
+    if (s->id() == slot_id) slot = s;
+  }
+  if (slot == nullptr) return false;
+  predicate->column =
+      zone_map_->FindColumn(slot->col_pos() - scan_node_->num_partition_keys());
+  if (predicate->column < 0) return false;
+  LzoZoneMap::ColumnType type = zone_map_->columns()[predicate->column].type;
+
+  // A comparison with NULL is never true, but is left to the conjunct.
+  void* value = eval->GetValue(*constant, nullptr);
+  if (value == nullptr) return false;
+  switch (slot->type().type) {
+    case TYPE_TINYINT:
+      predicate->int_value = *reinterpret_cast<int8_t*>(value);
+      return type == LzoZoneMap::INT;
+    case TYPE_SMALLINT:
+      predicate->int_value = *reinterpret_cast<int16_t*>(value);
+      return type == LzoZoneMap::INT;
+    case TYPE_INT:
+      predicate->int_value = *reinterpret_cast<int32_t*>(value);
+      return type == LzoZoneMap::INT;
+    case TYPE_BIGINT:
+      predicate->int_value = *reinterpret_cast<int64_t*>(value);
+      return type == LzoZoneMap::INT;
+    case TYPE_DOUBLE:
+      predicate->double_value = *reinterpret_cast<double*>(value);
+      return type == LzoZoneMap::DOUBLE && !std::isnan(predicate->double_value);
+    case TYPE_STRING: {
+      const StringValue* sv = reinterpret_cast<StringValue*>(value);
+      predicate->string_value.assign(sv->ptr, sv->len);
+      return type == LzoZoneMap::STRING;
     }
+    default:
+      // Values that don't parse as the column's type are NULL in Impala but unbounded
+      // in the zone map, so only types parsed the same way by both are used.
+      return false;
   }
+}
 
-  // If there are any left over bytes, they are deliberately ignored.
-  int close_stat = hdfsCloseFile(connection, index_file);
+bool HdfsLzoTextScanner::ZoneMapExcludes(int64_t offset) const {
+  int64_t block = zone_map_->FindBlock(offset);
+  return block >= 0 && zone_map_->CanSkip(block, zone_map_predicates_);
+}
 
-  if (bytes_read == -1) {
-    return Status(GetHdfsErrorMsg("Error while reading index file: ", index_filename));
+Status HdfsLzoTextScanner::ApplyZoneMap(CompressedBlock* block, bool* skip) {
+  *skip = false;
+  if (zone_map_ == nullptr) return Status::OK();
+  int64_t offset = stream_->file_offset()
+      - BlockHeaderLength(block->uncompressed_len, block->compressed_len);
+  int64_t next_offset = stream_->file_offset() + block->compressed_len;
+  int64_t range_end = stream_->scan_range()->offset() + stream_->scan_range()->len();
+
+  if (skip_next_block_) {
+    Status status;
+    RETURN_IF_FALSE(stream_->SkipBytes(block->compressed_len, &status));
+    context_->ReleaseCompletedResources(false);
+    if (record_offsets_) recorded_offsets_.push_back(offset);
+    COUNTER_ADD(zone_map_skipped_counter_, 1);
+    *skip = true;
+    // The row at the end of the skipped block continues into the next one.
+    dropping_row_ = true;
+    skip_next_block_ = false;
+    if (next_offset >= range_end) {
+      // So does the row that ends this scan range.
+      zone_map_eos_ = true;
+    } else {
+      skip_next_block_ = ZoneMapExcludes(next_offset);
+    }
+    return Status::OK();
   }
 
-  if (close_stat == -1) {
-    return Status(GetHdfsErrorMsg("Error while closing index file: ", index_filename));
+  int64_t index = zone_map_->FindBlock(offset);
+  if (index < 0) {
+    stringstream ss;
+    ss << "Lzo zone map of file: " << stream_->filename() << " has no block at offset: "
+       << offset;
+    return Status(ss.str());
+  }
+  // The rest of a dropped row ends at the block's first line delimiter, if it has one.
+  block->trim_leading = dropping_row_;
+  dropping_row_ = dropping_row_ && !zone_map_->HasRowEnd(index);
+  if (ZoneMapExcludes(next_offset) && (dropping_row_ || zone_map_->HasRowEnd(index))) {
+    // The row at the end of this block continues into the next, skipped, block.
+    block->trim_trailing = !dropping_row_;
+    dropping_row_ = true;
+    if (next_offset >= range_end) {
+      zone_map_eos_ = true;
+    } else {
+      skip_next_block_ = true;
+    }
+  } else if (dropping_row_ && next_offset >= range_end) {
+    // The dropped row is the one that ends this scan range.
+    zone_map_eos_ = true;
   }
+  return Status::OK();
+}
 
+Status HdfsLzoTextScanner::TrimBlockRows(
+    const CompressedBlock& block, uint8_t** data, int* len) const {
+  char delim = context_->partition_descriptor()->line_delim();
+  bool found_delim = false;
+  if (block.trim_leading) {
+    uint8_t* row_end = reinterpret_cast<uint8_t*>(memchr(*data, delim, *len));
+    if (row_end == nullptr) {
+      *len = 0;
+      return Status::OK();
+    }
+    *len -= row_end + 1 - *data;
+    *data = row_end + 1;
+    found_delim = true;
+  }
+  if (block.trim_trailing) {
+    uint8_t* row_end = reinterpret_cast<uint8_t*>(memrchr(*data, delim, *len));
+    if (row_end == nullptr) {
+      *len = 0;
+      if (found_delim) return Status::OK();
+      stringstream ss;
+      ss << "Lzo zone map of file: " << stream_->filename()
+         << " does not match the block at offset: " << block.file_offset;
+      return Status(ss.str());
+    }
+    *len = row_end + 1 - *data;
+  }
   return Status::OK();
 }
 
+Status HdfsLzoTextScanner::TrimReadBlock(const CompressedBlock& block, MemPool* pool) {
+  if (!block.trim_leading && !block.trim_trailing) return Status::OK();
+  Status status = TrimBlockRows(block, &block_buffer_ptr_, &bytes_remaining_);
+  if (!status.ok()) RETURN_IF_ERROR(state_->LogOrReturnError(status.msg()));
+  if (bytes_remaining_ != 0 || zone_map_eos_ || stream_->eof()) return Status::OK();
+  return ReadAndDecompressData(pool);
+}
+
+void HdfsLzoTextScanner::PersistRecordedOffsets() {
+  DCHECK(record_offsets_);
+  Status status = LzoIndexCache::Insert(stream_->filename(),
+      stream_->scan_range()->mtime(), stream_->scan_range()->len(), recorded_offsets_);
+  if (!status.ok()) {
+    LOG(WARNING) << "Could not cache index for: " << stream_->filename() << ": "
+                 << status.GetDetail();
+    return;
+  }
+  VLOG_FILE << "Cached index with " << recorded_offsets_.size() << " blocks for: "
+            << stream_->filename();
+}
+
 Status HdfsLzoTextScanner::FindFirstBlock(bool* found) {
+  if (header_->lazy_index_len > 0 && !range_offsets_read_) {
+    range_offsets_read_ = true;
+    RETURN_IF_ERROR(ReadRangeOffsets());
+  }
+  const LzoBlockOffsets& offsets = BlockOffsets();
+  if (offsets.empty() && header_->lazy_index_len == 0) {
+    // There is no index, so blocks can only be found by their headers.
+    if (FLAGS_lzo_resync_non_indexed_files) {
+      int64_t offset = stream_->file_offset();
+      Status status = ResyncToBlock(found);
+      COUNTER_ADD(skipped_to_block_counter_, stream_->file_offset() - offset);
+      return status;
+    }
+    *found = false;
+    return Status::OK();
+  }
+
   int64_t offset = stream_->file_offset();
+  int64_t range_end = stream_->scan_range()->offset() + stream_->scan_range()->len();
 
   // Find the first block at or after the current file offset.  That way the
-  // scan will start, or restart, on a block boundary.
-  vector<int64_t>::iterator pos =
-      upper_bound(header_->offsets.begin(), header_->offsets.end(), offset);
+  // scan will start, or restart, on a block boundary. Ranges of indexed files start
+  // at a block, see IssueBlockAlignedRanges().
+  int64_t pos = offsets.LowerBound(offset);
 
-  if (pos == header_->offsets.end()) {
+  if (pos == offsets.size()) {
     // In this case, the scan range started past the end of the last block. Skip
     // this as the previous scan range is responsible for it.
     *found = false;
     return Status::OK();
   }
 
-  if (*pos > offset + stream_->scan_range()->len()) {
-    // In this case, the scan range does not contain the start of any blocks.
-    // This scan range is then not responsible for any bytes.
+  int64_t block_offset = offsets[pos];
+  if (block_offset >= range_end) {
+    // In this case, the rest of the scan range does not contain the start of any
+    // blocks. This scan range is then not responsible for any more bytes.
     *found = false;
     return Status::OK();
   }
 
   VLOG_ROW << "First Block: " << stream_->filename()
-           << " for " << offset << " @" << *pos;
+           << " for " << offset << " @" << block_offset;
+  COUNTER_ADD(skipped_to_block_counter_, block_offset - offset);
   Status status;
-  if (!stream_->SkipBytes(*pos - offset, &status)) return status;
+  if (!stream_->SkipBytes(block_offset - offset, &status)) return status;
   *found = true;
   return status;
 }
 
+int HdfsLzoTextScanner::BlockHeaderLength(
+    int32_t uncompressed_len, int32_t compressed_len) const {
+  return LzoFormat::BlockHeaderLength(*header_, uncompressed_len, compressed_len);
+}
+
+bool HdfsLzoTextScanner::IsPlausibleBlockHeader(
+    const uint8_t* ptr, int64_t file_offset, int64_t file_length) const {
+  int32_t uncompressed_len = ReadWriteUtil::GetInt<uint32_t>(ptr);
+  int32_t compressed_len = ReadWriteUtil::GetInt<uint32_t>(ptr + sizeof(int32_t));
+  if (uncompressed_len <= 0 || uncompressed_len > LZO_MAX_BLOCK_SIZE) return false;
+  // lzop stores a block uncompressed if compressing it does not make it smaller.
+  if (compressed_len <= 0 || compressed_len > uncompressed_len) return false;
+  int64_t block_end = file_offset + BlockHeaderLength(uncompressed_len, compressed_len)
+      + compressed_len;
+  // lzop gives every block but the last the same uncompressed length, but Hadoop's
+  // LzopCodec ends a block wherever its writer flushes, so the length is not checked
+  // against the first block's.
+  return block_end <= file_length;
+}
+
+Status HdfsLzoTextScanner::ValidateBlock(int64_t skip, int64_t file_length,
+    bool* valid) {
+  *valid = false;
+  uint8_t* buffer;
+  int64_t bytes_read;
+  Status status;
+  RETURN_IF_FALSE(stream_->GetBytes(BLOCK_LENGTHS_SIZE + skip, &buffer, &bytes_read,
+      &status, true));
+  if (bytes_read < BLOCK_LENGTHS_SIZE + skip) return Status::OK();
+  int32_t uncompressed_len = ReadWriteUtil::GetInt<uint32_t>(buffer + skip);
+  int32_t compressed_len =
+      ReadWriteUtil::GetInt<uint32_t>(buffer + skip + sizeof(int32_t));
+  int header_len = BlockHeaderLength(uncompressed_len, compressed_len);
+
+  // Peek at the whole block and the lengths of the following one.
+  int64_t block_len = header_len + compressed_len;
+  int64_t len = skip + block_len + BLOCK_LENGTHS_SIZE;
+  RETURN_IF_FALSE(stream_->GetBytes(len, &buffer, &bytes_read, &status, true));
+  if (bytes_read < skip + block_len) return Status::OK();
+  uint8_t* block = buffer + skip;
+  int64_t block_offset = stream_->file_offset() + skip;
+
+  // Unless this is the last block, the next block must start right after it.
+  if (bytes_read == len) {
+    uint8_t* next_block = block + block_len;
+    if (ReadWriteUtil::GetInt<uint32_t>(next_block) != 0 &&
+        !IsPlausibleBlockHeader(next_block, block_offset + block_len, file_length)) {
+      return Status::OK();
+    }
+  }
+
+  // The checksums are the strongest evidence, so they are verified even if
+  // --disable_lzo_checksums is set.
+  uint8_t* ptr = block + BLOCK_LENGTHS_SIZE;
+  int32_t out_checksum = 0;
+  int32_t in_checksum = 0;
+  if (header_->output_checksum_type_ != CHECK_NONE) {
+    out_checksum = ReadWriteUtil::GetInt<uint32_t>(ptr);
+    ptr += sizeof(int32_t);
+  }
+  if (compressed_len < uncompressed_len && header_->input_checksum_type_ != CHECK_NONE) {
+    in_checksum = ReadWriteUtil::GetInt<uint32_t>(ptr);
+    ptr += sizeof(int32_t);
+    if (ComputeChecksum(header_->input_checksum_type_, ptr, compressed_len)
+        != in_checksum) {
+      return Status::OK();
+    }
+  }
+  if (compressed_len == uncompressed_len) {
+    // A stored block is not decompressed, so without a checksum of its data nothing
+    // but its lengths shows it is a block, and any bytes would do.
+    if (header_->output_checksum_type_ == CHECK_NONE) return Status::OK();
+    *valid = ComputeChecksum(header_->output_checksum_type_, ptr, compressed_len)
+        == out_checksum;
+    return Status::OK();
+  }
+
+  // Try to decompress the block.
+  LzoBufferPool::Buffer scratch_buffer;
+  RETURN_IF_ERROR(GetRecycledBuffer(
+      uncompressed_len + LzoDecompressor::OUTPUT_SLACK, &scratch_buffer));
+  uint8_t* scratch = scratch_buffer.data();
+  int32_t decompressed_len;
+  int ret = DecompressLzo1x(ptr, compressed_len, scratch, uncompressed_len,
+      &decompressed_len);
+  *valid = ret == LZO_E_OK && decompressed_len == uncompressed_len
+      && ComputeChecksum(header_->output_checksum_type_, scratch, uncompressed_len)
+          == out_checksum;
+  return Status::OK();
+}
+
+Status HdfsLzoTextScanner::ResyncToBlock(bool* found) {
+  *found = false;
+  const HdfsFileDesc* file_desc = scan_node_->GetFileDesc(
+      context_->partition_descriptor()->id(), stream_->filename());
+  int64_t range_end = stream_->scan_range()->offset() + stream_->scan_range()->len();
+
+  // Look at every position in the range until one holds a valid block. Each window is
+  // scanned with the cheap IsPlausibleBlockHeader() test, and ValidateBlock() rejects
+  // its false positives with the block's checksums and a trial decompression.
+  Status status;
+  while (stream_->file_offset() < range_end) {
+    uint8_t* buffer;
+    int64_t bytes_read;
+    RETURN_IF_FALSE(stream_->GetBytes(
+        MAX_BLOCK_COMPRESSED_SIZE, &buffer, &bytes_read, &status, true));
+    int64_t file_offset = stream_->file_offset();
+    int64_t num_positions =
+        min(range_end - file_offset, bytes_read - BLOCK_LENGTHS_SIZE + 1);
+    // Too close to the end of the file to hold another block.
+    if (num_positions <= 0) break;
+
+    for (int64_t i = 0; i < num_positions; ++i) {
+      if (!IsPlausibleBlockHeader(buffer + i, file_offset + i, file_desc->file_length)) {
+        continue;
+      }
+      bool valid;
+      RETURN_IF_ERROR(ValidateBlock(i, file_desc->file_length, &valid));
+      if (valid) {
+        VLOG_ROW << "Resynced to block: " << stream_->filename()
+                 << " for " << stream_->scan_range()->offset() << " @" << file_offset + i;
+        RETURN_IF_FALSE(stream_->SkipBytes(i, &status));
+        *found = true;
+        return Status::OK();
+      }
+      // ValidateBlock() may have peeked further, which invalidates 'buffer'.
+      RETURN_IF_FALSE(stream_->GetBytes(
+          MAX_BLOCK_COMPRESSED_SIZE, &buffer, &bytes_read, &status, true));
+    }
+    RETURN_IF_FALSE(stream_->SkipBytes(num_positions, &status));
+  }
+  return Status::OK();
+}
+
+Status HdfsLzoTextScanner::SkipBadBlock(const Status& error, bool* found) {
+  // Running out of memory says nothing about the block. Skipping it would drop its
+  // rows from the result.
+  if (error.IsMemLimitExceeded()) return error;
+  record_offsets_ = false;
+  RETURN_IF_ERROR(state_->LogOrReturnError(error.msg()));
+  COUNTER_ADD(recoveries_counter_, 1);
+  // The rows of the blocks around the bad one are no longer known.
+  zone_map_ = nullptr;
+  skip_next_block_ = false;
+  dropping_row_ = false;
+
+  if (index_pending_) {
+    // The header was read inline, without the index. Read it now to find the next
+    // block.
+    index_pending_ = false;
+    Status status = ReadIndexFile();
+    if (!status.ok()) {
+      header_->offsets.clear();
+      header_->uncompressed_lens.clear();
+      header_->line_counts.clear();
+      RETURN_IF_ERROR(state_->LogOrReturnError(status.msg()));
+    }
+    COUNTER_ADD(index_entries_counter_, header_->offsets.size());
+  }
+
+  // On error try to skip forward to the next block.
+  Status status = FindFirstBlock(found);
+  if (!status.ok()) {
+    *found = false;
+    RETURN_IF_ERROR(state_->LogOrReturnError(status.msg()));
+  }
+  return Status::OK();
+}
+
 Status HdfsLzoTextScanner::ReadData(MemPool* pool) {
   do {
     Status status = ReadAndDecompressData(pool);
     if (status.ok()) return Status::OK();
-    RETURN_IF_ERROR(state_->LogOrReturnError(status.msg()));
-
-    // On error try to skip forward to the next block.
     bool found_block;
-    status = FindFirstBlock(&found_block);
-    if (!status.ok() || !found_block) {
-      if (!status.ok()) RETURN_IF_ERROR(state_->LogOrReturnError(status.msg()));
-
+    RETURN_IF_ERROR(SkipBadBlock(status, &found_block));
+    if (!found_block) {
       // Just force to end of file, we cannot do more recovery if we can't find
       // the next block
       eos_read_ = true;
@@ -331,7 +1119,7 @@ Status HdfsLzoTextScanner::FillByteBuffer(MemPool* pool, bool* eosr, int num_byt
   *eosr = false;
   byte_buffer_read_size_ = 0;
 
-  if (stream_->eof()) {
+  if (stream_->eof() && read_ahead_blocks_.empty() && !decompressing_chunks_) {
     *eosr = true;
     return Status::OK();
   }
@@ -369,7 +1157,15 @@ Status HdfsLzoTextScanner::FillByteBuffer(MemPool* pool, bool* eosr, int num_byt
     block_buffer_ptr_ += byte_buffer_read_size_;
   }
 
-  *eosr = stream_->eosr() || (eos_read_ && bytes_remaining_ == 0);
+  // When reading ahead, the stream passes the end of the scan range before the last
+  // block in the range is returned. 'eos_read_' is set once that block is.
+  if (read_ahead_) {
+    *eosr = eos_read_;
+  } else {
+    // The rest of a block decompressed in chunks is still in range.
+    *eosr = !decompressing_chunks_
+        && (stream_->eosr() || (eos_read_ && bytes_remaining_ == 0));
+  }
 
   if (VLOG_ROW_IS_ON && *eosr) {
     VLOG_ROW << "Returning eosr for: " << stream_->filename()
@@ -379,232 +1175,296 @@ Status HdfsLzoTextScanner::FillByteBuffer(MemPool* pool, bool* eosr, int num_byt
 }
 
 Status HdfsLzoTextScanner::Checksum(LzoChecksum type, const string& source,
-    int expected_checksum, uint8_t* buffer, int length) {
+    int expected_checksum, uint8_t* buffer, int length, int64_t file_offset) const {
 
-  if (disable_checksum_) return Status::OK();
+  if (disable_checksum_ || type == CHECK_NONE) return Status::OK();
+  SCOPED_TIMER(checksum_timer_);
 
   // Do the checksum if requested.
-  int32_t calculated_checksum = 0;
-  switch (type) {
-    case CHECK_NONE:
-      return Status::OK();
-
-    case CHECK_CRC32:
-      calculated_checksum = lzo_crc32(CRC32_INIT_VALUE, buffer, length);
-      break;
-
-    case CHECK_ADLER:
-      calculated_checksum = lzo_adler32(ADLER32_INIT_VALUE, buffer, length);
-      break;
-
-    default:
-      DCHECK(false) << "Should have been handled when parsing metadata.";
-  }
-
+  int32_t calculated_checksum = ComputeChecksum(type, buffer, length);
   if (calculated_checksum != expected_checksum) {
     stringstream ss;
     ss << "Checksum of " << source << " block failed on file: " << stream_->filename()
-       << " at offset: " << stream_->file_offset() - length
+       << " at offset: " << file_offset
        << " expected: " << expected_checksum << " got: " << calculated_checksum;
     return Status(ss.str());
   }
   return Status::OK();
 }
 
+int32_t HdfsLzoTextScanner::ComputeChecksum(
+    LzoChecksum type, const uint8_t* buffer, int length) {
+  DCHECK(type == CHECK_NONE || type == CHECK_CRC32 || type == CHECK_ADLER)
+      << "Should have been handled when parsing metadata.";
+  return LzoChecksumUtil::Compute(type, buffer, length);
+}
+
 Status HdfsLzoTextScanner::ReadHeader() {
-  uint8_t* magic;
+  uint8_t* header;
   int64_t bytes_read;
   Status status;
-  // Read the header in. HEADER_SIZE over estimates the maximum header.
-  RETURN_IF_FALSE(stream_->GetBytes(HEADER_SIZE, &magic, &bytes_read, &status));
+  // Peek at the header. HEADER_SIZE over estimates the maximum header. The caller skips
+  // 'header_size_' bytes if it goes on to read the blocks.
+  RETURN_IF_FALSE(stream_->GetBytes(HEADER_SIZE, &header, &bytes_read, &status, true));
 
-  if (bytes_read < MIN_HEADER_SIZE) {
-    stringstream ss;
-    ss << "File is too short. File size: " << bytes_read;
-    return Status(ss.str());
+  string error;
+  if (!LzoFormat::ParseHeader(header, bytes_read, header_, &error)) {
+    return Status(error);
   }
-
-  if (memcmp(magic, LZOP_MAGIC, sizeof(LZOP_MAGIC))) {
-    stringstream ss;
-    ss << "Invalid LZOP_MAGIC: '"
-       << ReadWriteUtil::HexDump(magic, sizeof(LZOP_MAGIC)) << "'" << endl;
-    return Status(ss.str());
-  }
-
-  uint8_t* header = magic + sizeof(LZOP_MAGIC);
-  uint8_t* h_ptr = header;
-
-  int version = ReadWriteUtil::GetInt<uint16_t>(h_ptr);
-  if (version > LZOP_VERSION) {
-    stringstream ss;
-    ss << "Compressed with later version of lzop: " << version
-       << " must be less than: " << LZOP_VERSION;
-    return Status(ss.str());
-  }
-  h_ptr += sizeof(int16_t);
-
-  int libversion = ReadWriteUtil::GetInt<uint16_t>(h_ptr);
-  if (libversion < MIN_LZO_VERSION) {
-    stringstream ss;
-    ss << "Compressed with incompatible lzo version: " << version
-       << "must be at least: " << MIN_ZOP_VERSION;
-    return Status(ss.str());
-  }
-  h_ptr += sizeof(int16_t);
-
-  // The version of LZOP needed to interpret this file.
-  int neededversion = ReadWriteUtil::GetInt<uint16_t>(h_ptr);
-  if (neededversion > LZOP_VERSION) {
-    stringstream ss;
-    ss << "Compressed with imp incompatible lzo version: " << neededversion
-       << "must be at no more than: " << LZOP_VERSION;
-    return Status(ss.str());
-  }
-  h_ptr += sizeof(int16_t);
-
-  uint8_t method = *h_ptr++;
-  if (method < 1 || method > 3) {
-    stringstream ss;
-    ss << "Invalid compression method: " << method;
-    return Status(ss.str());
-  }
-  uint8_t level = *h_ptr++;
-
-  int flags = ReadWriteUtil::GetInt<uint32_t>(h_ptr);
-  LzoChecksum header_checksum = (flags & F_H_CRC32) ? CHECK_CRC32 : CHECK_ADLER;
-  header_->output_checksum_type_ = (flags & F_CRC32_D) ? CHECK_CRC32 :
-      (flags & F_ADLER32_D) ? CHECK_ADLER : CHECK_NONE;
-  header_->input_checksum_type_ = (flags & F_CRC32_C) ? CHECK_CRC32 :
-      (flags & F_ADLER32_C) ? CHECK_ADLER : CHECK_NONE;
-
-  if (flags & (F_RESERVED | F_MULTIPART | F_H_FILTER)) {
-    stringstream ss;
-    ss << "Unsupported flags: " << flags;
-    return Status(ss.str());
-  }
-  h_ptr += sizeof(int32_t);
-
-  // skip mode and time fields
-  h_ptr += 3 * sizeof(int32_t);
-
-  // Skip filename.
-  h_ptr += *h_ptr + 1;
-
-  // The header always has a checksum.
-  int32_t expected_checksum = ReadWriteUtil::GetInt<uint32_t>(h_ptr);
-  int32_t computed_checksum;
-  if (header_checksum == CHECK_CRC32) {
-    computed_checksum = CRC32_INIT_VALUE;
-    computed_checksum = lzo_crc32(computed_checksum, header, h_ptr - header);
-  } else {
-    computed_checksum = ADLER32_INIT_VALUE;
-    computed_checksum = lzo_adler32(computed_checksum, header, h_ptr - header);
-  }
-
-  if (computed_checksum != expected_checksum) {
-    stringstream ss;
-    ss << "Invalid header checksum: " << computed_checksum
-       << " expected: " << expected_checksum;
-    return Status(ss.str());
-  }
-  h_ptr += sizeof(int32_t);
-
-  // Skip the extra field if any.
-  if (flags & F_H_EXTRA_FIELD) {
-    int32_t len;
-    Status extra_status;
-    if (!stream_->ReadInt(&len, &extra_status)) return extra_status;
-    // Add the size of the len and the checksum and the len to the total h_ptr size.
-    h_ptr += (2 * sizeof(int32_t)) + len;
-  }
-
-  VLOG_FILE << "Reading: " << stream_->filename() << " Header: version: " << version
-            << "(" << libversion << "/" << neededversion << ")"
-            << " method: " << (int)method << "@" << (int)level
-            << " flags: " << flags;
-
-  RETURN_IF_ERROR(status);
-
-  header_->header_size_ = h_ptr - magic;
+  VLOG_FILE << "Reading: " << stream_->filename() << " Header: size: "
+            << header_->header_size_ << " checksums: " << header_->input_checksum_type_
+            << "/" << header_->output_checksum_type_;
   return Status::OK();
 }
 
-Status HdfsLzoTextScanner::ReadAndDecompressData(MemPool* pool) {
-  bytes_remaining_ = 0;
+Status HdfsLzoTextScanner::ReadBlockHeader(CompressedBlock* block) {
   Status status;
 
   // Read the uncompressed
-  int32_t uncompressed_len = 0, compressed_len = 0;
-  RETURN_IF_FALSE(stream_->ReadInt(&uncompressed_len, &status));
-  if (uncompressed_len == 0) {
+  RETURN_IF_FALSE(stream_->ReadInt(&block->uncompressed_len, &status));
+  if (block->uncompressed_len == 0) {
     DCHECK(stream_->eosr());
-    eos_read_ = true;
+    read_eof_ = true;
     return Status::OK();
   }
-  if (uncompressed_len < 0) {
+  if (block->uncompressed_len < 0) {
     stringstream ss;
-    ss << "Corrupt lzo file. Invalid uncompressed length: " << uncompressed_len
+    ss << "Corrupt lzo file. Invalid uncompressed length: " << block->uncompressed_len
        << " in file: " << stream_->filename();
     return Status(ss.str());
   }
 
   // Read the compressed len
-  RETURN_IF_FALSE(stream_->ReadInt(&compressed_len, &status));
+  RETURN_IF_FALSE(stream_->ReadInt(&block->compressed_len, &status));
 
-  if (compressed_len > LZO_MAX_BLOCK_SIZE) {
+  if (block->compressed_len > LZO_MAX_BLOCK_SIZE) {
     stringstream ss;
-    ss << "Blocksize: " << compressed_len << " is greater than LZO_MAX_BLOCK_SIZE: "
-       << LZO_MAX_BLOCK_SIZE;
+    ss << "Blocksize: " << block->compressed_len
+       << " is greater than LZO_MAX_BLOCK_SIZE: " << LZO_MAX_BLOCK_SIZE;
     return Status(ss.str());
-  } else if (compressed_len <= 0) {
+  } else if (block->compressed_len <= 0) {
     stringstream ss;
-    ss << "Blocksize: " << compressed_len << " must be positive";
+    ss << "Blocksize: " << block->compressed_len << " must be positive";
     return Status(ss.str());
   }
 
-  int out_checksum = 0;
   // The checksum of the uncompressed data.
   if (header_->output_checksum_type_ != CHECK_NONE) {
-    RETURN_IF_FALSE(stream_->ReadInt(&out_checksum, &status));
+    RETURN_IF_FALSE(stream_->ReadInt(&block->out_checksum, &status));
   }
 
-  int in_checksum = 0;
-  if (compressed_len < uncompressed_len && header_->input_checksum_type_ != CHECK_NONE) {
-    RETURN_IF_FALSE(stream_->ReadInt(&in_checksum, &status));
+  if (block->compressed_len < block->uncompressed_len &&
+      header_->input_checksum_type_ != CHECK_NONE) {
+    RETURN_IF_FALSE(stream_->ReadInt(&block->in_checksum, &status));
   } else {
     // If the compressed data size is equal to the uncompressed data size, then
     // the uncompressed data is stored and there is no compressed checksum.
-    in_checksum = out_checksum;
+    block->in_checksum = block->out_checksum;
   }
+  return Status::OK();
+}
 
-  // Read in the compressed data
-  uint8_t* compressed_data;
-  int64_t bytes_read;
-  RETURN_IF_FALSE(
-      stream_->GetBytes(compressed_len, &compressed_data, &bytes_read, &status));
+Status HdfsLzoTextScanner::ReadBlockData(CompressedBlock* block, uint8_t* copy_buffer) {
+  Status status;
+  int64_t bytes_read = 0;
+  if (copy_buffer == nullptr) {
+    RETURN_IF_FALSE(stream_->GetBytes(
+        block->compressed_len, &block->data, &bytes_read, &status));
+  } else {
+    // Copy straight out of the I/O buffers. GetBytes() would first copy a block that
+    // spans buffers into the stream's boundary buffer.
+    while (bytes_read < block->compressed_len) {
+      uint8_t* buffer;
+      int64_t buffer_len;
+      RETURN_IF_ERROR(stream_->GetBuffer(true, &buffer, &buffer_len));
+      if (buffer_len == 0) break;
+      buffer_len = min<int64_t>(buffer_len, block->compressed_len - bytes_read);
+      memcpy(copy_buffer + bytes_read, buffer, buffer_len);
+      RETURN_IF_FALSE(stream_->SkipBytes(buffer_len, &status));
+      bytes_read += buffer_len;
+    }
+    block->data = copy_buffer;
+  }
   if (bytes_read == 0) {
     DCHECK(stream_->eof());
-    DCHECK_EQ(bytes_remaining_, 0);
-    if (compressed_len != 0 && state_->abort_on_error()) {
+    if (block->compressed_len != 0 && state_->abort_on_error()) {
       // The last block might be empty if it is the end of the file.
       stringstream ss;
-      ss << "Last lzo block missing. Expected block size: " << compressed_len;
+      ss << "Last lzo block missing. Expected block size: " << block->compressed_len;
       return Status(ss.str());
     }
+    block->uncompressed_len = 0;
+    read_eof_ = true;
     return Status::OK();
-  } else if (compressed_len != bytes_read) {
+  } else if (block->compressed_len != bytes_read) {
     stringstream ss;
     ss << "Corrupt lzo file. Compressed block should have length '"
-       << compressed_len << "' but could only read '" << bytes_read << "' from file: "
-       << stream_->filename();
+       << block->compressed_len << "' but could only read '" << bytes_read
+       << "' from file: " << stream_->filename();
     return Status(ss.str());
   }
+  block->file_offset = stream_->file_offset() - block->compressed_len;
   context_->ReleaseCompletedResources(false);
-  eos_read_ = stream_->eosr();
+  // Blocks that start in the range are read to their end, see ReadPastSize().
+  int64_t range_end = stream_->scan_range()->offset() + stream_->scan_range()->len();
+  if (stream_->file_offset() > range_end) {
+    COUNTER_ADD(read_past_bytes_counter_, stream_->file_offset()
+        - max(range_end, block->file_offset));
+  }
+  if (record_offsets_) {
+    recorded_offsets_.push_back(block->file_offset
+        - BlockHeaderLength(block->uncompressed_len, block->compressed_len));
+  }
+  return Status::OK();
+}
+
+int HdfsLzoTextScanner::ReadPastSize(int64_t file_offset) const {
+  if (header_ == nullptr) return MAX_BLOCK_COMPRESSED_SIZE;
+  int64_t file_length = scan_node_->GetFileDesc(
+      context_->partition_descriptor()->id(), stream_->filename())->file_length;
+  int64_t size;
+  const LzoBlockOffsets& offsets = BlockOffsets();
+  int64_t next_block = offsets.UpperBound(file_offset);
+  if (next_block < offsets.size()) {
+    // The block containing 'file_offset' ends where the next one starts.
+    size = offsets[next_block] - file_offset;
+  } else if (!offsets.empty() && header_->lazy_index_len == 0) {
+    // The last block is followed by the end of file marker.
+    size = file_length - file_offset;
+  } else {
+    // There is no index, or the slice of a lazily read one ends at this block, so the
+    // next block's offset is not known. lzop writes blocks of the same uncompressed
+    // length, and stores the ones that do not compress, so no block is longer than the
+    // first one plus its header. Files written with a larger block size than lzop's
+    // default need more than MAX_BLOCK_COMPRESSED_SIZE.
+    size = max<int64_t>(MAX_BLOCK_COMPRESSED_SIZE,
+        header_->block_size_ + BLOCK_LENGTHS_SIZE + 2 * sizeof(int32_t));
+  }
+  // No block is longer than LZO_MAX_BLOCK_SIZE plus its header. This also keeps the
+  // size within an int when an out of date index ends long before the file does.
+  size = min<int64_t>(size,
+      LZO_MAX_BLOCK_SIZE + BLOCK_LENGTHS_SIZE + 2 * sizeof(int32_t));
+  size = min(size, file_length - file_offset);
+  return max<int64_t>(size, 1);
+}
 
-  // Checksum the data.
-  RETURN_IF_ERROR(Checksum(header_->input_checksum_type_,
-      "compressed", in_checksum, compressed_data, compressed_len));
+Status HdfsLzoTextScanner::DecompressBlock(
+    const CompressedBlock& block, uint8_t* out) const {
+  RETURN_IF_ERROR(Checksum(header_->input_checksum_type_, "compressed",
+      block.in_checksum, block.data, block.compressed_len, block.file_offset));
+
+  int ret;
+  int32_t uncompressed_len;
+  {
+    // Decompress the data.  lzop always uses lzo1x.
+    SCOPED_TIMER(decompress_timer_);
+    MonotonicStopWatch watch;
+    watch.Start();
+    ret = DecompressLzo1x(block.data, block.compressed_len, out,
+        block.uncompressed_len, &uncompressed_len);
+    block_decompress_time_->UpdateCounter(watch.ElapsedTime());
+  }
+  COUNTER_ADD(blocks_decompressed_counter_, 1);
+  COUNTER_ADD(compressed_bytes_counter_, block.compressed_len);
+  COUNTER_ADD(uncompressed_bytes_counter_, uncompressed_len);
+
+  if (ret != LZO_E_OK || uncompressed_len != block.uncompressed_len) {
+    stringstream ss;
+    ss << "Lzo decompression failed on file: " << stream_->filename()
+       << " at offset: " << block.file_offset + block.compressed_len
+       << " returned: " << ret << " output size: " << uncompressed_len
+       << " expected: " << block.uncompressed_len;
+    return Status(ss.str());
+  }
+
+  // Do the checksum if requested.
+  return Checksum(header_->output_checksum_type_, "decompressed", block.out_checksum,
+      out, uncompressed_len, block.file_offset);
+}
+
+Status HdfsLzoTextScanner::GetRecycledBuffer(int64_t len,
+    LzoBufferPool::Buffer* buffer) {
+  bool hit;
+  RETURN_IF_ERROR(LzoBufferPool::Get(len, scan_node_->mem_tracker(), buffer, &hit));
+  COUNTER_ADD(hit ? buffer_pool_hits_counter_ : buffer_pool_misses_counter_, 1);
+  return Status::OK();
+}
+
+Status HdfsLzoTextScanner::AllocateBlockBuffer(MemPool* pool, int64_t len,
+    uint8_t** buffer) {
+  *buffer = pool->TryAllocate(len);
+  if (*buffer != nullptr) return Status::OK();
+  stringstream ss;
+  ss << "Could not reserve " << len << " bytes for an lzo block of file: "
+     << stream_->filename();
+  return scan_node_->mem_tracker()->MemLimitExceeded(state_, ss.str(), len);
+}
+
+bool HdfsLzoTextScanner::CanReserve(int64_t len) const {
+  MemTracker* mem_tracker = scan_node_->mem_tracker();
+  if (!mem_tracker->TryConsume(len)) return false;
+  mem_tracker->Release(len);
+  return true;
+}
+
+void HdfsLzoTextScanner::UpdateReservedBytes() {
+  int64_t bytes = block_buffer_pool_->total_reserved_bytes()
+      + recycled_buffer_.capacity() + chunk_compressed_buffer_.capacity()
+      + current_block_buffer_.capacity();
+  if (current_block_pool_ != nullptr) {
+    bytes += current_block_pool_->total_reserved_bytes();
+  }
+  for (const unique_ptr<ReadAheadBlock>& read_ahead_block : read_ahead_blocks_) {
+    if (read_ahead_block->pool != nullptr) {
+      bytes += read_ahead_block->pool->total_reserved_bytes();
+    }
+    bytes += read_ahead_block->compressed_buffer.capacity()
+        + read_ahead_block->uncompressed_buffer.capacity();
+  }
+  peak_reserved_counter_->UpdateMax(bytes);
+}
+
+int HdfsLzoTextScanner::DecompressLzo1x(const uint8_t* in, int32_t in_len, uint8_t* out,
+    int32_t max_out_len, int32_t* out_len) {
+  if (FLAGS_lzo_fast_decompressor) {
+    int64_t len;
+    int ret = LzoDecompressor::Decompress(
+        in, in_len, out, max_out_len, LzoDecompressor::OUTPUT_SLACK, &len);
+    *out_len = static_cast<int32_t>(len);
+    return ret;
+  }
+
+  // IMPALA-5172: lzo_uint is a 64-bit datatype. &uncompressed_len cannot be cast to
+  // an lzo_uint*, as it points to a 32-bit integer. Use a temporary 64-bit variable to
+  // interact with lzo1x_decompress_safe(). Since the variable won't be set to a value
+  // greater than what was passed in, it can safely be assigned to a 32 bit integer
+  // afterward.
+  uint64_t uncompressed_len_64bit = static_cast<uint64_t>(max_out_len);
+  int ret = lzo1x_decompress_safe(in, in_len, out, &uncompressed_len_64bit, nullptr);
+  DCHECK_LE(uncompressed_len_64bit, max_out_len);
+  *out_len = static_cast<int32_t>(uncompressed_len_64bit);
+  return ret;
+}
+
+Status HdfsLzoTextScanner::ReadAndDecompressData(MemPool* pool) {
+  if (read_ahead_) return ReadAheadAndDecompressData(pool);
+  if (decompressing_chunks_) return DecompressNextChunk();
+  bytes_remaining_ = 0;
+
+  CompressedBlock block;
+  bool skip;
+  do {
+    if (zone_map_eos_) {
+      eos_read_ = true;
+      return Status::OK();
+    }
+    RETURN_IF_ERROR(ReadBlockHeader(&block));
+    if (block.uncompressed_len == 0) {
+      eos_read_ = true;
+      return Status::OK();
+    }
+    RETURN_IF_ERROR(ApplyZoneMap(&block, &skip));
+  } while (skip);
 
   // Attach any data that previously returned string slots may reference.
   bool has_string_slots = !scan_node_->tuple_desc()->string_slots().empty();
@@ -619,60 +1479,102 @@ Status HdfsLzoTextScanner::ReadAndDecompressData(MemPool* pool) {
   }
 
   // If the compressed length is the same as the uncompressed length, it means the data
-  // was not compressed. If there are string slots, we need to copy the data out so it can
-  // be returned.
-  if (compressed_len == uncompressed_len) {
-    if (has_string_slots) {
-      DCHECK_EQ(0, block_buffer_len_);
-      block_buffer_ptr_ = block_buffer_ = block_buffer_pool_->Allocate(uncompressed_len);
-      block_buffer_len_ = uncompressed_len;
-      memcpy(block_buffer_ptr_, compressed_data, uncompressed_len);
-    } else {
-      block_buffer_ptr_ = compressed_data;
+  // was not compressed. The I/O buffers cannot be attached to row batches, so if there
+  // are string slots the data is copied out of them as it is read.
+  bool stored = block.compressed_len == block.uncompressed_len;
+  // The cache is keyed by the offset of the compressed data, which is read next.
+  std::shared_ptr<const string> cached_block;
+  if (!stored && LzoBlockCache::IsEnabled()) {
+    cached_block = LzoBlockCache::Lookup(
+        stream_->filename(), stream_->scan_range()->mtime(), stream_->file_offset());
+    if (cached_block != nullptr && cached_block->size() != block.uncompressed_len) {
+      cached_block.reset();
     }
-    bytes_remaining_ = uncompressed_len;
+    COUNTER_ADD(cached_block != nullptr ? block_cache_hits_counter_ :
+        block_cache_misses_counter_, 1);
+  }
+  // The LzoDecompressor can pause, but liblzo can't. A decompressed checksum can only
+  // be verified once the whole block has been returned, and rows can only be dropped
+  // from the end of a block once it has been decompressed.
+  bool chunked = !stored && cached_block == nullptr && FLAGS_lzo_fast_decompressor
+      && FLAGS_lzo_decompress_chunk_size > 0
+      && block.uncompressed_len > FLAGS_lzo_decompress_chunk_size
+      && (disable_checksum_ || header_->output_checksum_type_ == CHECK_NONE)
+      && !block.trim_leading && !block.trim_trailing;
+  uint8_t* copy_buffer = nullptr;
+  if (stored && has_string_slots) {
+    RETURN_IF_ERROR(AllocateBlockBuffer(
+        block_buffer_pool_.get(), block.compressed_len, &copy_buffer));
+  } else if (chunked) {
+    // The compressed data must outlive reads from the stream between chunks.
+    RETURN_IF_ERROR(GetRecycledBuffer(block.compressed_len, &chunk_compressed_buffer_));
+    copy_buffer = chunk_compressed_buffer_.data();
+  }
+  RETURN_IF_ERROR(ReadBlockData(&block, copy_buffer));
+  peak_block_buffer_counter_->UpdateMax(block_buffer_pool_->total_reserved_bytes());
+  UpdateReservedBytes();
+  if (block.uncompressed_len == 0) {
+    eos_read_ = true;
     return Status::OK();
   }
+  eos_read_ = stream_->eosr();
 
+  if (stored) {
+    COUNTER_ADD(stored_blocks_counter_, 1);
+    // Checksum the data.
+    RETURN_IF_ERROR(Checksum(header_->input_checksum_type_, "compressed",
+        block.in_checksum, block.data, block.compressed_len, block.file_offset));
+    block_buffer_ptr_ = block.data;
+    if (has_string_slots) {
+      block_buffer_ = block.data;
+      block_buffer_len_ = block.uncompressed_len;
+    }
+    bytes_remaining_ = block.uncompressed_len;
+    return TrimReadBlock(block, pool);
+  }
 
-  if (uncompressed_len > block_buffer_len_) {
-    block_buffer_ = block_buffer_pool_->Allocate(uncompressed_len);
-    block_buffer_len_ = uncompressed_len;
+  if (block.uncompressed_len > block_buffer_len_) {
+    if (has_string_slots) {
+      RETURN_IF_ERROR(AllocateBlockBuffer(block_buffer_pool_.get(),
+          block.uncompressed_len + LzoDecompressor::OUTPUT_SLACK, &block_buffer_));
+      block_buffer_len_ = block.uncompressed_len;
+    } else {
+      // Nothing returned references the buffer, so it can be recycled.
+      RETURN_IF_ERROR(GetRecycledBuffer(
+          block.uncompressed_len + LzoDecompressor::OUTPUT_SLACK, &recycled_buffer_));
+      block_buffer_ = recycled_buffer_.data();
+      block_buffer_len_ = recycled_buffer_.capacity() - LzoDecompressor::OUTPUT_SLACK;
+    }
   }
   block_buffer_ptr_ = block_buffer_;
-  bytes_remaining_ = uncompressed_len;
-
-  // IMPALA-5172: lzo_uint is a 64-bit datatype. &uncompressed_len cannot be cast to
-  // an lzo_uint*, as it points to a 32-bit integer. Use a temporary 64-bit variable to
-  // interact with lzo1x_decompress_safe(). Since the variable won't be set to a value
-  // greater than what was passed in, it can safely be assigned to a 32 bit integer
-  // afterward.
-  uint64_t uncompressed_len_64bit = static_cast<uint64_t>(uncompressed_len);
-
-  // Decompress the data.  lzop always uses lzo1x.
-  SCOPED_TIMER(decompress_timer_);
-  int ret = lzo1x_decompress_safe(compressed_data, compressed_len,
-      block_buffer_, &uncompressed_len_64bit, nullptr);
-  DCHECK_LE(uncompressed_len_64bit, uncompressed_len);
-  uncompressed_len = static_cast<int32_t>(uncompressed_len_64bit);
-
-  if (ret != LZO_E_OK || bytes_remaining_ != uncompressed_len) {
-    // Avoid accumulating memory with repeated decompression failures.
-    block_buffer_pool_->Clear();
-    stringstream ss;
-    ss << "Lzo decompression failed on file: " << stream_->filename()
-       << " at offset: " << stream_->file_offset() << " returned: " << ret
-       << " output size: " << uncompressed_len << " expected: " << block_buffer_len_;
-    return Status(ss.str());
+  peak_block_buffer_counter_->UpdateMax(block_buffer_pool_->total_reserved_bytes());
+  UpdateReservedBytes();
+
+  if (chunked) {
+    RETURN_IF_ERROR(Checksum(header_->input_checksum_type_, "compressed",
+        block.in_checksum, block.data, block.compressed_len, block.file_offset));
+    chunk_block_ = block;
+    chunk_state_ = LzoDecompressor::State();
+    decompressing_chunks_ = true;
+    return DecompressNextChunk();
   }
 
-  // Do the checksum if requested.
-  Status checksum_status = Checksum(header_->output_checksum_type_,
-     "decompressed", out_checksum, block_buffer_, uncompressed_len);
-  if (!checksum_status.ok()) {
-    // Avoid accumulating memory with repeated checksum mismatches.
+  bytes_remaining_ = block.uncompressed_len;
+  if (cached_block != nullptr) {
+    // The cached block was verified when it was decompressed.
+    memcpy(block_buffer_, cached_block->data(), block.uncompressed_len);
+    return TrimReadBlock(block, pool);
+  }
+  Status status = DecompressBlock(block, block_buffer_);
+  if (!status.ok()) {
+    // Avoid accumulating memory with repeated decompression failures or checksum
+    // mismatches.
     block_buffer_pool_->Clear();
-    return checksum_status;
+    return status;
+  }
+  if (LzoBlockCache::IsEnabled()) {
+    LzoBlockCache::Insert(stream_->filename(), stream_->scan_range()->mtime(),
+        block.file_offset, block_buffer_, block.uncompressed_len);
   }
 
   // Return end of scan range even if there are bytes in the disk buffer.
@@ -680,9 +1582,229 @@ Status HdfsLzoTextScanner::ReadAndDecompressData(MemPool* pool) {
   // block.  When the scanner finishes with the data we return here it must
   // go into Finish mode and complete its final row.
   eos_read_ = stream_->eosr();
-  VLOG_ROW << "LZO decompressed " << uncompressed_len << " bytes from "
-           << stream_->filename() << " @" << stream_->file_offset() - compressed_len;
+  VLOG_ROW << "LZO decompressed " << block.uncompressed_len << " bytes from "
+           << stream_->filename() << " @" << block.file_offset;
+  return TrimReadBlock(block, pool);
+}
+
+Status HdfsLzoTextScanner::DecompressNextChunk() {
+  DCHECK(decompressing_chunks_);
+  const CompressedBlock& block = chunk_block_;
+  int64_t out_pos = chunk_state_.out_pos;
+  LzoDecompressor::Result ret;
+  {
+    SCOPED_TIMER(decompress_timer_);
+    MonotonicStopWatch watch;
+    watch.Start();
+    ret = LzoDecompressor::DecompressChunk(block.data, block.compressed_len,
+        block_buffer_, block.uncompressed_len, LzoDecompressor::OUTPUT_SLACK,
+        out_pos + FLAGS_lzo_decompress_chunk_size, &chunk_state_);
+    chunk_decompress_time_ += watch.ElapsedTime();
+  }
+  // The chunk follows the bytes of the block that have not been returned yet.
+  bytes_remaining_ += chunk_state_.out_pos - out_pos;
+  if (ret == LzoDecompressor::PAUSED) return Status::OK();
+
+  decompressing_chunks_ = false;
+  chunk_compressed_buffer_.Reset();
+  block_decompress_time_->UpdateCounter(chunk_decompress_time_);
+  chunk_decompress_time_ = 0;
+  COUNTER_ADD(blocks_decompressed_counter_, 1);
+  COUNTER_ADD(compressed_bytes_counter_, block.compressed_len);
+  COUNTER_ADD(uncompressed_bytes_counter_, chunk_state_.out_pos);
+  if (ret != LzoDecompressor::OK || chunk_state_.out_pos != block.uncompressed_len) {
+    bytes_remaining_ = 0;
+    stringstream ss;
+    ss << "Lzo decompression failed on file: " << stream_->filename()
+       << " at offset: " << block.file_offset + block.compressed_len
+       << " returned: " << ret << " output size: " << chunk_state_.out_pos
+       << " expected: " << block.uncompressed_len;
+    return Status(ss.str());
+  }
+  VLOG_ROW << "LZO decompressed " << block.uncompressed_len << " bytes in chunks from "
+           << stream_->filename() << " @" << block.file_offset;
   return Status::OK();
 }
 
+Status HdfsLzoTextScanner::FillReadAheadQueue(bool need_block) {
+  bool has_string_slots = !scan_node_->tuple_desc()->string_slots().empty();
+  while (!read_ahead_eof_ && !read_ahead_error_ &&
+      read_ahead_blocks_.size() < FLAGS_lzo_decompress_readahead_blocks) {
+    // Past the end of the scan range blocks are only read on demand, to complete the
+    // last tuple of the range.
+    if (stream_->eosr() && !(need_block && read_ahead_blocks_.empty())) break;
+    if (zone_map_eos_) {
+      read_ahead_eof_ = true;
+      break;
+    }
+    // Rather than fail the query, stop reading ahead while the memory limit leaves no
+    // room for another block, its compressed copy and its decompressed data. The next
+    // block is read anyway once the queue is empty.
+    if (!read_ahead_blocks_.empty() && !CanReserve(2 * max<int64_t>(
+            header_->block_size_, MAX_BLOCK_COMPRESSED_SIZE))) {
+      COUNTER_ADD(read_ahead_backoffs_counter_, 1);
+      break;
+    }
+
+    unique_ptr<ReadAheadBlock> read_ahead_block(new ReadAheadBlock());
+    CompressedBlock* block = &read_ahead_block->block;
+    Status status = ReadBlockHeader(block);
+    bool skip = false;
+    if (status.ok() && block->uncompressed_len != 0) {
+      status = ApplyZoneMap(block, &skip);
+    }
+    if (skip) continue;
+    bool stored = block->compressed_len == block->uncompressed_len;
+    if (status.ok() && block->uncompressed_len != 0) {
+      // Copy the compressed data out of the stream's buffers, which are reused by the
+      // next read. Buffers that returned string slots may reference come from 'pool',
+      // the others are recycled.
+      read_ahead_block->pool.reset(new MemPool(scan_node_->mem_tracker()));
+      uint8_t* compressed_data;
+      if (stored && has_string_slots) {
+        RETURN_IF_ERROR(AllocateBlockBuffer(
+            read_ahead_block->pool.get(), block->compressed_len, &compressed_data));
+      } else {
+        RETURN_IF_ERROR(GetRecycledBuffer(
+            block->compressed_len, &read_ahead_block->compressed_buffer));
+        compressed_data = read_ahead_block->compressed_buffer.data();
+      }
+      status = ReadBlockData(block, compressed_data);
+    }
+    if (!status.ok()) {
+      // Queue the error so blocks before it are still returned in order.
+      if (read_ahead_block->pool != nullptr) read_ahead_block->pool->FreeAll();
+      read_ahead_block->pool.reset();
+      read_ahead_block->status = status;
+      read_ahead_block->read_error = true;
+      read_ahead_block->done.Set(true);
+      read_ahead_blocks_.push_back(move(read_ahead_block));
+      read_ahead_error_ = true;
+      break;
+    }
+    if (block->uncompressed_len == 0) {
+      if (read_ahead_block->pool != nullptr) read_ahead_block->pool->FreeAll();
+      read_ahead_eof_ = true;
+      break;
+    }
+    read_ahead_block->eosr = stream_->eosr();
+
+    // A stored block needs no further work.
+    if (stored) {
+      COUNTER_ADD(stored_blocks_counter_, 1);
+      read_ahead_block->uncompressed_data = block->data;
+      read_ahead_block->status = Checksum(header_->input_checksum_type_, "compressed",
+          block->in_checksum, block->data, block->compressed_len, block->file_offset);
+      read_ahead_block->done.Set(true);
+    } else {
+      int64_t uncompressed_buffer_len =
+          block->uncompressed_len + LzoDecompressor::OUTPUT_SLACK;
+      Status reserve_status;
+      if (has_string_slots) {
+        reserve_status = AllocateBlockBuffer(read_ahead_block->pool.get(),
+            uncompressed_buffer_len, &read_ahead_block->uncompressed_data);
+      } else {
+        reserve_status = GetRecycledBuffer(
+            uncompressed_buffer_len, &read_ahead_block->uncompressed_buffer);
+        read_ahead_block->uncompressed_data =
+            read_ahead_block->uncompressed_buffer.data();
+      }
+      if (!reserve_status.ok()) {
+        read_ahead_block->pool->FreeAll();
+        return reserve_status;
+      }
+      ReadAheadBlock* task = read_ahead_block.get();
+      if (!decompression_pool_->Offer([this, task]() {
+            task->status = DecompressBlock(task->block, task->uncompressed_data);
+            task->done.Set(true);
+          })) {
+        read_ahead_block->pool->FreeAll();
+        return Status("Lzo decompression thread pool has been shut down.");
+      }
+    }
+    read_ahead_blocks_.push_back(move(read_ahead_block));
+    UpdateReservedBytes();
+  }
+  return Status::OK();
+}
+
+Status HdfsLzoTextScanner::ReadAheadAndDecompressData(MemPool* pool) {
+  bytes_remaining_ = 0;
+
+  // Attach the previous block, which previously returned string slots may reference.
+  if (current_block_pool_ != nullptr) {
+    bool has_string_slots = !scan_node_->tuple_desc()->string_slots().empty();
+    if (has_string_slots && pool != nullptr) {
+      pool->AcquireData(current_block_pool_.get(), false);
+    } else {
+      current_block_pool_->FreeAll();
+    }
+    current_block_pool_.reset();
+  }
+  current_block_buffer_.Reset();
+
+  while (true) {
+    RETURN_IF_ERROR(FillReadAheadQueue(true));
+    if (read_ahead_blocks_.empty()) {
+      eos_read_ = true;
+      return Status::OK();
+    }
+    unique_ptr<ReadAheadBlock> read_ahead_block = move(read_ahead_blocks_.front());
+    read_ahead_blocks_.pop_front();
+    read_ahead_block->done.Get();
+    uint8_t* data = read_ahead_block->uncompressed_data;
+    int len = read_ahead_block->block.uncompressed_len;
+    if (read_ahead_block->status.ok() && !read_ahead_block->read_error) {
+      read_ahead_block->status = TrimBlockRows(read_ahead_block->block, &data, &len);
+    }
+
+    if (read_ahead_block->read_error) {
+      // ReadData() moves the stream to the next block, then reading ahead resumes.
+      DCHECK(read_ahead_blocks_.empty());
+      read_ahead_error_ = false;
+      return read_ahead_block->status;
+    }
+    if (!read_ahead_block->status.ok()) {
+      // The stream is already past this block, so just move on to the next one.
+      read_ahead_block->pool->FreeAll();
+      record_offsets_ = false;
+      RETURN_IF_ERROR(state_->LogOrReturnError(read_ahead_block->status.msg()));
+      COUNTER_ADD(recoveries_counter_, 1);
+      continue;
+    }
+    if (len == 0) {
+      // All of the block's rows were dropped by the zone map.
+      read_ahead_block->pool->FreeAll();
+      continue;
+    }
+
+    current_block_pool_ = move(read_ahead_block->pool);
+    // The compressed copy of a decompressed block is recycled when 'read_ahead_block'
+    // goes out of scope.
+    if (read_ahead_block->block.compressed_len ==
+        read_ahead_block->block.uncompressed_len) {
+      current_block_buffer_ = move(read_ahead_block->compressed_buffer);
+    } else {
+      current_block_buffer_ = move(read_ahead_block->uncompressed_buffer);
+    }
+    block_buffer_ptr_ = data;
+    bytes_remaining_ = len;
+    eos_read_ = read_ahead_block->eosr;
+    VLOG_ROW << "LZO decompressed " << bytes_remaining_ << " bytes from "
+             << stream_->filename() << " @" << read_ahead_block->block.file_offset;
+    break;
+  }
+
+  // Keep the decompression threads busy while this block is parsed.
+  return FillReadAheadQueue(false);
+}
+
+void HdfsLzoTextScanner::DrainReadAheadQueue() {
+  for (unique_ptr<ReadAheadBlock>& read_ahead_block : read_ahead_blocks_) {
+    read_ahead_block->done.Get();
+    if (read_ahead_block->pool != nullptr) read_ahead_block->pool->FreeAll();
+  }
+  read_ahead_blocks_.clear();
+}
+
 }
@@ -3,11 +3,17 @@
 #ifndef IMPALA_LZO_TEXT_SCANNER_H
 #define IMPALA_LZO_TEXT_SCANNER_H
 
+#include "lzo-buffer-pool.h"
+#include "lzo-decompressor.h"
+#include "lzo-file-header.h"
 #include "lzo-header.h"
+#include <deque>
+#include <memory>
 #include <boost/thread/locks.hpp>
 #include "common/version.h"
 #include "exec/hdfs-text-scanner.h"
 #include "runtime/string-buffer.h"
+#include "util/promise.h"
 
 // This provides support for reading files compressed with lzop.
 // The file consists of a header and compressed blocks preceeded
@@ -53,7 +59,10 @@
 namespace impala {
 
 class ScannerContext;
+class ScalarExpr;
+class ScalarExprEvaluator;
 class HdfsLzoTextScanner;
+class LzoThreadPool;
 
 // HdfsScanner implementation that reads LZOP formatted text files.
 // The format of the data, after decompression, is the same as HdfsText files.
@@ -65,7 +74,35 @@ class HdfsLzoTextScanner;
 // This is used to find the beginning of a split and to skip over a bad block and
 // find the next block.
 // If there is no index file then the file is non-splittble. A single scan range
-// will be issued for the whole file and no error recovery is done.
+// will be issued for the whole file and no error recovery is done, unless
+// --lzo_resync_non_indexed_files is set. In that case the file's splits are scanned
+// in parallel and each scanner finds its first block by searching for a block header
+// that is consistent with the file, verified by the block's checksums or a trial
+// decompression. The same search is used to skip over a bad block.
+//
+// If --lzo_index_cache_dir is set, a scanner reading a whole file without an index
+// records the offset of each block and persists them with LzoIndexCache once it
+// reaches the end of the file. Later queries use them to split the file, if one
+// instance scans all of its splits.
+//
+// A file that is one split, read by no other instance, is read by one scan range that
+// parses the header at the start of the file, instead of a header range followed by a
+// range for the file.
+//
+// Parsed headers of indexed files are kept in LzoHeaderCache. Files whose header is
+// cached skip the header range and have their data ranges issued right away.
+//
+// If --lzo_decompress_readahead_blocks is set, the scanner reads that many compressed
+// blocks ahead of the block being parsed and decompresses them on a daemon-wide pool
+// of threads, so decompression of one scan range overlaps parsing and can use more
+// than one core. Blocks are returned from FillByteBuffer() in file order.
+//
+// If --lzo_zone_maps is set and a file has a zone map sidecar (see LzoZoneMap), blocks
+// in which no row can satisfy a comparison of a column with a constant in the scan's
+// conjuncts are skipped without being decompressed. The rows that span a skipped block
+// and its neighbours are dropped from the neighbours, which are cut at line delimiters.
+// Tables with an escape character are not supported, since an escaped delimiter does
+// not end a row.
 
 
 // Used to verify that this library was built against the expected Impala version when the
@@ -94,8 +131,10 @@ class HdfsLzoTextScanner : public HdfsTextScanner {
   virtual ~HdfsLzoTextScanner();
 
   // Determines whether this scanner is processing an initial scan range for which it
-  // should only parse the file header and index file (if any). For non-initial scan
-  // ranges, stream_ is positioned to the first byte that contains data.
+  // should only parse the file header and index file (if any). A file with a single
+  // split has no such range; its only range parses the header itself.
+  // For non-initial scan ranges, stream_ is positioned to the first byte that
+  // contains data.
   // Sets 'only_parsing_header_' and 'header_'.  Sets 'eos_' to true if this scan range
   // contains no tuples for which this scanner is responsible.
   virtual Status Open(ScannerContext* context);
@@ -117,58 +156,199 @@ class HdfsLzoTextScanner : public HdfsTextScanner {
       HdfsScanNodeBase* scan_node, const std::vector<HdfsFileDesc*>& files);
 
  private:
-  enum LzoChecksum {
-    CHECK_NONE,
-    CHECK_CRC32,
-    CHECK_ADLER
-  };
-
   // Block size in bytes used by LZOP. The compressed blocks will be no bigger than this.
   const static int MAX_BLOCK_COMPRESSED_SIZE = (256 * 1024);
 
-  // This is the fixed size of the header. It can have up to 255 bytes of
-  // file name in it as well.
-  const static int MIN_HEADER_SIZE = 32;
-
   // An over estimate of how big the header could be.  There is a path name
   // and an option seciton.
   const static int HEADER_SIZE = 300;
 
-  // Header informatation, shared by all scanners on this file.
-  struct LzoFileHeader {
-    LzoChecksum input_checksum_type_;
-    LzoChecksum output_checksum_type_;
+  // Size of the uncompressed and compressed lengths at the start of each block.
+  const static int BLOCK_LENGTHS_SIZE = 2 * sizeof(int32_t);
+
+  // Pointer to shared header information.
+  LzoFileHeader* header_;
+
+  // The lengths and checksums that precede a compressed block, and its data.
+  struct CompressedBlock {
+    int32_t uncompressed_len = 0;
+    int32_t compressed_len = 0;
+
+    // Checksums of the uncompressed and compressed data. Only set if the file
+    // header enables them.
+    int out_checksum = 0;
+    int in_checksum = 0;
+
+    // The compressed data. Points into the stream's buffers unless copied out.
+    uint8_t* data = nullptr;
 
-    uint32_t header_size_;
+    // File offset of the compressed data.
+    int64_t file_offset = 0;
 
-    // Offsets to compressed blocks.
-    std::vector<int64_t> offsets;
+    // Set by ApplyZoneMap() if the decompressed data up to and including the first
+    // line delimiter, or after the last one, belongs to rows that are dropped.
+    bool trim_leading = false;
+    bool trim_trailing = false;
   };
 
-  // Pointer to shared header information.
-  LzoFileHeader* header_;
+  // A block read ahead of the block being parsed. Compressed blocks are decompressed
+  // on a thread of the decompression pool.
+  struct ReadAheadBlock {
+    CompressedBlock block;
+
+    // Owns the copy of the compressed data and the decompressed data if returned
+    // string slots may reference them. nullptr if the block could not be read.
+    std::unique_ptr<MemPool> pool;
+
+    // The copy of the compressed data and the decompressed data, if not allocated
+    // from 'pool'.
+    LzoBufferPool::Buffer compressed_buffer;
+    LzoBufferPool::Buffer uncompressed_buffer;
+
+    // The decompressed data. Valid once 'done' is set.
+    uint8_t* uncompressed_data = nullptr;
+
+    // Result of reading, decompressing and verifying the block. Valid once 'done' is
+    // set.
+    Status status;
+
+    // True if 'status' is an error reading the block from stream_. The stream must be
+    // moved to the next block before reading further.
+    bool read_error = false;
+
+    // True if stream_ was at the end of the scan range after reading this block.
+    bool eosr = false;
+
+    // Set once the block has been decompressed, or immediately if no decompression
+    // is needed.
+    Promise<bool> done;
+  };
 
   // Fills the byte buffer by reading and decompressing blocks.
   // Attaches decompression buffers from previous calls that might still be referenced
   // by returned batches to 'pool'. If 'pool' is nullptr the buffers are freed instead.
   virtual Status FillByteBuffer(MemPool* pool, bool* eosr, int num_bytes = 0);
 
-  // Read header data and validate header.
+  // Read header data and validate header. Does not move the stream.
   Status ReadHeader();
 
-  // Read the index file and set up the header.offsets.
+  // Calls ReadHeader() and adds the file name to any error.
+  Status ReadAndValidateHeader();
+
+  // Returns true if this instance's splits of 'file_desc' are one split covering the
+  // whole file. Only then is no other scanner, on this or another instance, reading
+  // the file, so it can be read by one range that parses the header inline.
+  static bool IsWholeFileSplit(const HdfsFileDesc* file_desc);
+
+  // Returns true if this instance's splits of 'file_desc' cover the whole file. Only
+  // then may the file be split by an index from LzoIndexCache, which is local to this
+  // daemon: other instances, which would not see the index, read none of the file.
+  static bool OwnsAllSplits(const HdfsFileDesc* file_desc);
+
+  // Parses the header at the start of a range that covers a whole file with a single
+  // split, and sets up 'header_'. Unless 'count_rows_only_' or LzoHeaderCache is
+  // enabled, the index is not read until a block fails to read, see 'index_pending_'.
+  // Otherwise the index is read now and the header is cached.
+  Status ReadInlineHeader();
+
+  // Read the index file, usually prefetched by LzoIndexReader when the header range
+  // was issued, and set up the header.offsets. If there is no index file,
+  // looks for an index built by an earlier scan in LzoIndexCache.
   Status ReadIndexFile();
 
-  // Checksum data.
-  Status Checksum(LzoChecksum type,
-    const std::string& source, int expected_checksum, uint8_t* buffer, int length);
+  // Reads the zone map sidecar of the file into header_->zone_map, if there is one and
+  // it was built for the file's current length.
+  Status ReadZoneMapFile();
+
+  // Reads the zone map if --lzo_zone_maps is set. Errors are only logged, since the
+  // zone map is an optimization.
+  void MaybeReadZoneMapFile();
+
+  // Sets 'zone_map_' and 'zone_map_predicates_' if the file has a zone map that matches
+  // the partition's delimiters and some of the conjuncts can be checked against it.
+  void InitZoneMap();
+
+  // Translates 'conjunct', evaluated by 'eval', into *predicate if it compares a
+  // column in 'zone_map_' with a constant. Returns false otherwise.
+  bool GetZoneMapPredicate(const ScalarExpr& conjunct, ScalarExprEvaluator* eval,
+      LzoZoneMap::Predicate* predicate) const;
+
+  // Returns true if a block starts at file offset 'offset' and 'zone_map_' shows that
+  // none of its rows satisfy 'zone_map_predicates_'.
+  bool ZoneMapExcludes(int64_t offset) const;
+
+  // Decides, after ReadBlockHeader() read the header of 'block', whether the block is
+  // skipped and which of its rows are dropped, using 'zone_map_'. If *skip is set the
+  // stream has been moved past the block's data.
+  Status ApplyZoneMap(CompressedBlock* block, bool* skip);
+
+  // Cuts the 'len' bytes of decompressed data at *data of 'block' as set by
+  // block.trim_leading and block.trim_trailing. Returns an error if a line delimiter
+  // the zone map promised is missing, in which case *len is set to 0.
+  Status TrimBlockRows(const CompressedBlock& block, uint8_t** data, int* len) const;
+
+  // Applies TrimBlockRows() to the block ReadAndDecompressData() just read, and reads
+  // the next one if no rows are left.
+  Status TrimReadBlock(const CompressedBlock& block, MemPool* pool);
+
+  // Persists 'recorded_offsets_' with LzoIndexCache. Errors are only logged, since
+  // the index is an optimization for later scans.
+  void PersistRecordedOffsets();
 
-  // Adjust the context_ to the first block at or after the current context offset.
+  // Checksum data. 'file_offset' is the offset of the block in the file and is only
+  // used for the error message.
+  Status Checksum(LzoChecksum type, const std::string& source, int expected_checksum,
+      uint8_t* buffer, int length, int64_t file_offset) const;
+
+  // Returns the checksum of type 'type' of 'length' bytes at 'buffer', computed with
+  // the CPU's fastest implementation.
+  static int32_t ComputeChecksum(LzoChecksum type, const uint8_t* buffer, int length);
+
+  // Adjust the context_ to the first block at or after the current context offset
+  // and before the end of the scan range.
   // *found returns if a starting block was found.
   Status FindFirstBlock(bool* found);
 
-  // Issue the full file ranges after reading the headers.
-  Status IssueFileRanges(const char* filename);
+  // Returns the block offsets of the file, or those of the range's blocks if the
+  // header's index is read lazily.
+  const LzoBlockOffsets& BlockOffsets() const {
+    return header_->lazy_index_len > 0 ? range_offsets_ : header_->offsets;
+  }
+
+  // Reads the offsets of the range's blocks into 'range_offsets_' from the index
+  // header_->lazy_index_len says was left unread.
+  Status ReadRangeOffsets();
+
+  // Version of FindFirstBlock() for files without an index. Searches from the current
+  // stream offset to the end of the scan range for the first position holding a valid
+  // block and moves the stream to it.
+  Status ResyncToBlock(bool* found);
+
+  // Returns the size of the lengths and checksums preceding a block's data.
+  int BlockHeaderLength(int32_t uncompressed_len, int32_t compressed_len) const;
+
+  // Cheap test of whether the bytes at 'ptr', at 'file_offset' in a file of
+  // 'file_length' bytes, could be the lengths at the start of a block.
+  bool IsPlausibleBlockHeader(
+      const uint8_t* ptr, int64_t file_offset, int64_t file_length) const;
+
+  // Determines whether a valid block starts 'skip' bytes past the current stream
+  // offset, by checking its checksums, decompressing it and checking that the next
+  // block header is plausible. A stored block is never valid in a file without
+  // checksums of the uncompressed data. Does not move the stream.
+  Status ValidateBlock(int64_t skip, int64_t file_length, bool* valid);
+
+  // Issue the full file ranges of 'file_desc' after reading its header, or after
+  // finding 'header' in LzoHeaderCache.
+  static Status IssueFileRanges(HdfsScanNodeBase* scan_node, HdfsFileDesc* file_desc,
+      const LzoFileHeader* header);
+
+  // Issues one range per split of 'file_desc' that covers a run of the blocks listed in
+  // 'header->offsets', as planned by LzoFormat::PlanRanges(), balanced if
+  // --lzo_balance_splits is set. Ranges without blocks are marked complete instead of
+  // being issued.
+  static Status IssueBlockAlignedRanges(HdfsScanNodeBase* scan_node,
+      HdfsFileDesc* file_desc, const LzoFileHeader* header);
 
   // Read a data block.
   // sets: byte_buffer_ptr_, byte_buffer_read_size_ and eos_read_.
@@ -176,17 +356,108 @@ class HdfsLzoTextScanner : public HdfsTextScanner {
   // if the data was not compressed.
   // Attaches decompression buffers from previous calls that might still be referenced
   // by returned batches to 'pool'. If 'pool' is nullptr the buffers are freed instead.
+  // Blocks are copied out of LzoBlockCache if it holds them, and cached once
+  // decompressed otherwise.
   Status ReadAndDecompressData(MemPool* pool);
 
+  // Reads the next block's lengths and checksums from stream_. Sets
+  // block->uncompressed_len to 0 if there are no more blocks.
+  Status ReadBlockHeader(CompressedBlock* block);
+
+  // Reads the compressed data of the block whose header ReadBlockHeader() just read.
+  // If 'copy_buffer' is nullptr, block->data points into the stream's buffers and is
+  // only valid until the next read from stream_. Otherwise the data is copied directly
+  // from the I/O buffers into 'copy_buffer', which must have room for
+  // block->compressed_len bytes. Sets block->uncompressed_len to 0 if the file ends
+  // before the data.
+  Status ReadBlockData(CompressedBlock* block, uint8_t* copy_buffer);
+
+  // Verifies the compressed checksum of 'block', decompresses it into 'out', which
+  // must have room for block.uncompressed_len bytes plus
+  // LzoDecompressor::OUTPUT_SLACK, and verifies the decompressed
+  // checksum. Does not touch mutable scanner state, so it may be called from the
+  // decompression pool's threads.
+  Status DecompressBlock(const CompressedBlock& block, uint8_t* out) const;
+
+  // Adds the lzo specific counters to the scan node's profile.
+  void AddCounters();
+
+  // Gets a buffer of at least 'len' bytes from LzoBufferPool into 'buffer' and counts
+  // whether it was recycled. The buffer is reserved against the scan node's memory
+  // limit; a memory limit error is returned if it can't be.
+  Status GetRecycledBuffer(int64_t len, LzoBufferPool::Buffer* buffer);
+
+  // Allocates 'len' bytes from 'pool', which row batches may take over, into *buffer.
+  // Returns a memory limit error rather than go over the scan node's limit.
+  Status AllocateBlockBuffer(MemPool* pool, int64_t len, uint8_t** buffer);
+
+  // Returns true if 'len' more bytes could be reserved against the scan node's memory
+  // limit right now.
+  bool CanReserve(int64_t len) const;
+
+  // Updates 'peak_reserved_counter_' with the bytes of block buffers the scanner holds,
+  // including the blocks read ahead.
+  void UpdateReservedBytes();
+
+  // Decompresses the LZO1X data of 'in_len' bytes at 'in' into 'out', with liblzo or,
+  // if --lzo_fast_decompressor is set, LzoDecompressor. 'out' must have room for
+  // 'max_out_len' bytes plus LzoDecompressor::OUTPUT_SLACK. Sets *out_len to the
+  // number of bytes produced and returns an LZO_E_* code.
+  static int DecompressLzo1x(const uint8_t* in, int32_t in_len, uint8_t* out,
+      int32_t max_out_len, int32_t* out_len);
+
+  // Decompresses the next chunk of 'chunk_block_' into 'block_buffer_', after the bytes
+  // already decompressed, and adds it to 'bytes_remaining_'. Clears
+  // 'decompressing_chunks_' after the last chunk or on error.
+  Status DecompressNextChunk();
+
+  // Version of ReadAndDecompressData() used if 'read_ahead_' is set. Returns the next
+  // block from 'read_ahead_blocks_', logging and skipping blocks that fail to
+  // decompress. Returns an error only if a block could not be read from stream_.
+  Status ReadAheadAndDecompressData(MemPool* pool);
+
+  // Reads blocks from stream_ into 'read_ahead_blocks_' and hands them to the
+  // decompression pool until --lzo_decompress_readahead_blocks blocks are queued, the
+  // end of the scan range or file is reached, or a read fails. If 'need_block' is
+  // true and the queue is empty, reads one block even past the end of the scan range.
+  Status FillReadAheadQueue(bool need_block);
+
+  // Waits for all blocks in 'read_ahead_blocks_' to be decompressed and frees them.
+  void DrainReadAheadQueue();
+
   // Read compress data and recover from errosr.
   // Attaches decompression buffers from previous calls that might still be referenced
   // by returned batches to 'pool'. If 'pool' is nullptr the buffers are freed instead.
   Status ReadData(MemPool* pool);
 
-  // Callback for stream_ to determine how much to read past the scan range.
-  static int MaxBlockCompressedSize(int64_t file_offset) {
-    return MAX_BLOCK_COMPRESSED_SIZE;
-  }
+  // Logs 'error', which a block failed to read or decompress with, or returns it if
+  // the query aborts on errors or it is a memory limit error. Otherwise moves the
+  // stream to the next block and sets *found to whether there is one in the scan
+  // range.
+  Status SkipBadBlock(const Status& error, bool* found);
+
+  // Returns the rows of the scan range in 'row_batch' without parsing them, if
+  // 'count_rows_only_' is set. Each row is counted by the block that holds its line
+  // delimiter, so rows that span blocks or scan ranges are counted once, by the range
+  // whose blocks hold their end, rather than the one holding their start as when
+  // they are parsed.
+  Status CountRows(RowBatch* row_batch);
+
+  // Adds the line counts in a version 2 index of the blocks in the scan range, but the
+  // file's last block, to 'rows_to_return_', and skips the stream to the last block if
+  // the range has it.
+  Status CountIndexedRows();
+
+  // Reads and decompresses the next block in the scan range and adds its rows to
+  // 'rows_to_return_'. Sets 'count_eos_' once there are no more blocks.
+  Status CountNextBlock();
+
+  // Callback for stream_ to determine how much to read past the scan range, starting
+  // at 'file_offset'. With an index this is exactly the rest of the block containing
+  // 'file_offset', or the whole block if a block starts there. Without one, or past the
+  // end of the range's slice of a lazily read index, it is the largest block the file
+  // can have, going by the length of its first block.
+  int ReadPastSize(int64_t file_offset) const;
 
   // Pool for allocating the block_buffer_.
   boost::scoped_ptr<MemPool> block_buffer_pool_;
@@ -206,6 +477,153 @@ class HdfsLzoTextScanner : public HdfsTextScanner {
   // True if the end of scan has been read.
   bool eos_read_ = false;
 
+  // True while 'chunk_block_' is decompressed into 'block_buffer_' chunk by chunk, as
+  // FillByteBuffer() returns the data, if --lzo_decompress_chunk_size is set.
+  bool decompressing_chunks_ = false;
+
+  // The block being decompressed in chunks, where its decompression stopped and the
+  // copy of its compressed data.
+  CompressedBlock chunk_block_;
+  LzoDecompressor::State chunk_state_;
+  LzoBufferPool::Buffer chunk_compressed_buffer_;
+
+  // True if blocks are read ahead and decompressed by 'decompression_pool_'.
+  bool read_ahead_ = false;
+
+  // Daemon-wide pool that decompresses read-ahead blocks. Not owned.
+  LzoThreadPool* decompression_pool_ = nullptr;
+
+  // Blocks read ahead of the block being parsed, in file order.
+  std::deque<std::unique_ptr<ReadAheadBlock>> read_ahead_blocks_;
+
+  // Pool holding the read-ahead block currently being returned by FillByteBuffer().
+  std::unique_ptr<MemPool> current_block_pool_;
+
+  // Recycled buffer holding the read-ahead block currently being returned, if it was
+  // not allocated from 'current_block_pool_'.
+  LzoBufferPool::Buffer current_block_buffer_;
+
+  // Recycled buffer used as 'block_buffer_' if the tuple has no string slots.
+  LzoBufferPool::Buffer recycled_buffer_;
+
+  // Number of buffers that were and were not recycled by LzoBufferPool, and the bytes of
+  // free buffers the pool keeps, as of the end of the scan.
+  RuntimeProfile::Counter* buffer_pool_hits_counter_ = nullptr;
+  RuntimeProfile::Counter* buffer_pool_misses_counter_ = nullptr;
+  RuntimeProfile::Counter* buffer_pool_idle_bytes_counter_ = nullptr;
+
+  // Number of blocks copied out of and not found in LzoBlockCache, and the bytes of
+  // decompressed blocks the cache holds and the blocks it evicted, as of the end of the
+  // scan.
+  RuntimeProfile::Counter* block_cache_hits_counter_ = nullptr;
+  RuntimeProfile::Counter* block_cache_misses_counter_ = nullptr;
+  RuntimeProfile::Counter* block_cache_bytes_counter_ = nullptr;
+  RuntimeProfile::Counter* block_cache_evictions_counter_ = nullptr;
+
+  // True once the end of the file has been read into 'read_ahead_blocks_'.
+  bool read_ahead_eof_ = false;
+
+  // True if the last block queued in 'read_ahead_blocks_' could not be read. No
+  // more blocks are read until the error is returned and the stream is resynced.
+  bool read_ahead_error_ = false;
+
+  // True if this scanner reads a whole file that has no index and records the offset
+  // of each block in 'recorded_offsets_'. Cleared if any block fails to read or
+  // decompress, since the offsets may then be incomplete.
+  bool record_offsets_ = false;
+
+  // Offsets of the blocks read from stream_ so far, if 'record_offsets_' is true.
+  std::vector<int64_t> recorded_offsets_;
+
+  // True if ReadIndexFile() took the offsets from LzoIndexCache. The header is then not
+  // put in LzoHeaderCache, from which later queries would use the offsets without
+  // checking that they own all of the file's splits.
+  bool offsets_from_index_cache_ = false;
+
+  // True once ReadBlockHeader() or ReadBlockData() has reached the end of the file.
+  bool read_eof_ = false;
+
+  // Zone map of the file, if blocks may be skipped by it, and the conjuncts it can
+  // check. Cleared if a block fails to read.
+  const LzoZoneMap* zone_map_ = nullptr;
+  std::vector<LzoZoneMap::Predicate> zone_map_predicates_;
+
+  // True if the block after the one whose header was read last is skipped.
+  bool skip_next_block_ = false;
+
+  // True if the row at the current stream position overlaps a skipped block, so the
+  // data up to the end of that row is dropped.
+  bool dropping_row_ = false;
+
+  // True once the rest of the scan range, and the row that extends past it, has been
+  // skipped. No more blocks are read.
+  bool zone_map_eos_ = false;
+
+  // Number of blocks skipped with the zone map.
+  RuntimeProfile::Counter* zone_map_skipped_counter_ = nullptr;
+
+  // True if the scan materializes no slots, has no conjuncts and skips no header lines,
+  // so its rows are only counted. See CountRows() and LzoFormat::CanCountRowsByLines().
+  bool count_rows_only_ = false;
+
+  // Rows counted by CountRows() that have not been returned yet.
+  int64_t rows_to_return_ = 0;
+
+  // True once CountIndexedRows() has been called.
+  bool counted_indexed_rows_ = false;
+
+  // True once the rows of all blocks of the scan range have been counted.
+  bool count_eos_ = false;
+
+  // Number of rows counted from the line counts of a version 2 index.
+  RuntimeProfile::Counter* indexed_rows_counter_ = nullptr;
+
+  // Number of blocks decompressed and their compressed and uncompressed bytes, and the
+  // number of stored blocks, which need no decompression.
+  RuntimeProfile::Counter* blocks_decompressed_counter_ = nullptr;
+  RuntimeProfile::Counter* compressed_bytes_counter_ = nullptr;
+  RuntimeProfile::Counter* uncompressed_bytes_counter_ = nullptr;
+  RuntimeProfile::Counter* stored_blocks_counter_ = nullptr;
+
+  // Distribution of the time taken to decompress each block. The profile has no
+  // histograms, so this shows the minimum, average and maximum.
+  RuntimeProfile::SummaryStatsCounter* block_decompress_time_ = nullptr;
+
+  // Time spent decompressing the chunks of 'chunk_block_' so far.
+  int64_t chunk_decompress_time_ = 0;
+
+  // Time spent verifying checksums, parsing file headers and loading indexes, and the
+  // number of index entries loaded.
+  RuntimeProfile::Counter* checksum_timer_ = nullptr;
+  RuntimeProfile::Counter* header_parse_timer_ = nullptr;
+  RuntimeProfile::Counter* index_load_timer_ = nullptr;
+  RuntimeProfile::Counter* index_entries_counter_ = nullptr;
+
+  // Bytes of blocks that start in the scan range read past its end.
+  RuntimeProfile::Counter* read_past_bytes_counter_ = nullptr;
+
+  // Bytes skipped by FindFirstBlock() to reach a block, at the start of the range and
+  // after corrupt blocks, and the number of times ReadData() recovered from one.
+  RuntimeProfile::Counter* skipped_to_block_counter_ = nullptr;
+  RuntimeProfile::Counter* recoveries_counter_ = nullptr;
+
+  // Peak bytes held by 'block_buffer_pool_'.
+  RuntimeProfile::HighWaterMarkCounter* peak_block_buffer_counter_ = nullptr;
+
+  // Peak bytes of all block buffers reserved by the scanner, and the number of times
+  // reading ahead stopped because the next block could not be reserved.
+  RuntimeProfile::HighWaterMarkCounter* peak_reserved_counter_ = nullptr;
+  RuntimeProfile::Counter* read_ahead_backoffs_counter_ = nullptr;
+
+  // True if the header was read by ReadInlineHeader() and the index has not been read
+  // yet. ReadData() reads it before searching for the block after a bad one.
+  bool index_pending_ = false;
+
+  // With a lazily read index, the offsets of the blocks that start in the scan range
+  // and of the first block after it. Read on the first call to FindFirstBlock().
+  LzoBlockOffsets range_offsets_;
+  bool range_offsets_read_ = false;
+
   // This is set when the scanner object is constructed.  Currently always true.
   // HDFS checksums the blocks from the disk to the client, so this is redundent.
   bool disable_checksum_;
@@ -0,0 +1,359 @@
+// Copyright (c) 2012 Cloudera, Inc. All rights reserved.
+//
+// Measures how fast lzop files are decoded by the lzocore library that
+// HdfsLzoTextScanner is built on, on one core, so changes to the scanner's hot path
+// can be measured with local files only.
+//
+// Usage: lzo-benchmark [--min_time=<seconds>] [file.lzo ...]
+//   Without files, lzop files are generated in memory from synthetic delimited text,
+//   for every combination of block size, checksum type and fraction of blocks that
+//   are stored because they don't compress.
+//
+// For each file, prints the MB/s of uncompressed data of:
+//   checksum:  computing the checksums of the file's blocks, if it has any
+//   fast:      decompressing with LzoDecompressor (--lzo_fast_decompressor)
+//   liblzo:    decompressing with lzo1x_decompress_safe()
+//   decode:    LzoFormat::DecodeBlock(), i.e. LzoDecompressor and checksums, as the
+//              scanner does with --disable_lzo_checksums=false
+// Stored blocks count towards the uncompressed data but are not copied.
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <lzo/lzoconf.h>
+#include <lzo/lzo1x.h>
+
+#include "lzo-checksum.h"
+#include "lzo-decompressor.h"
+#include "lzo-format.h"
+
+using namespace impala;
+using namespace std;
+
+// Header flags of lzop. See lzo-header.h.
+static const uint32_t F_ADLER32_D = 0x00000001;
+static const uint32_t F_ADLER32_C = 0x00000002;
+static const uint32_t F_CRC32_D = 0x00000100;
+static const uint32_t F_CRC32_C = 0x00000200;
+
+// Length of each generated file, before compression.
+static const int64_t SYNTHETIC_FILE_SIZE = 64 * 1024 * 1024;
+
+namespace {
+
+// An lzop file and its blocks.
+struct LzoFile {
+  string name;
+  string data;
+  LzoFileHeader header;
+  vector<LzoFormat::Block> blocks;
+  int64_t uncompressed_len = 0;
+  int64_t num_stored = 0;
+  int32_t max_block_len = 0;
+};
+
+// Deterministic pseudo random numbers, so runs are comparable.
+class Random {
+ public:
+  explicit Random(uint64_t seed) : state_(seed * 0x9e3779b97f4a7c15ULL + 1) {}
+
+  uint32_t Next() {
+    state_ ^= state_ << 13;
+    state_ ^= state_ >> 7;
+    state_ ^= state_ << 17;
+    return static_cast<uint32_t>(state_ >> 16);
+  }
+
+ private:
+  uint64_t state_;
+};
+
+}
+
+static void PutInt32(uint32_t value, string* out) {
+  for (int i = 3; i >= 0; --i) out->push_back(static_cast<char>(value >> (8 * i)));
+}
+
+// Returns 'len' bytes of comma delimited rows, which compress about as well as typical
+// text tables.
+static string GenerateText(int64_t len, Random* random) {
+  static const char* const WORDS[] = { "alpha", "bravo", "charlie", "delta", "echo",
+      "foxtrot", "golf", "hotel", "india", "juliett", "kilo", "lima", "mike",
+      "november", "oscar", "papa" };
+  string text;
+  text.reserve(len + 256);
+  for (int64_t id = 0; text.size() < len; ++id) {
+    stringstream row;
+    row << id << "," << random->Next() % 100000 << "." << random->Next() % 100 << ","
+        << "2012-" << 1 + random->Next() % 12 << "-" << 1 + random->Next() % 28 << ","
+        << WORDS[random->Next() % 16] << " " << WORDS[random->Next() % 16] << "\n";
+    text.append(row.str());
+  }
+  text.resize(len);
+  return text;
+}
+
+// Returns an lzop file of 'text', compressed with lzo1x_1 in blocks of 'block_size'
+// bytes with checksums of type 'checksum'. 'stored_fraction' of the blocks are
+// replaced with random bytes, which lzop stores uncompressed.
+static string CompressLzop(const string& text, int block_size, LzoChecksum checksum,
+    double stored_fraction, Random* random) {
+  string file(reinterpret_cast<const char*>(LzoFormat::MAGIC), sizeof(LzoFormat::MAGIC));
+  uint32_t flags = checksum == CHECK_ADLER ? F_ADLER32_D | F_ADLER32_C :
+      checksum == CHECK_CRC32 ? F_CRC32_D | F_CRC32_C : 0;
+  string header;
+  // Version, library version, version needed to extract, method and level.
+  header.append("\x10\x30\x20\xa0\x09\x40\x01\x05", 8);
+  PutInt32(flags, &header);
+  // Mode, modification time and an empty file name.
+  PutInt32(0100644, &header);
+  PutInt32(0, &header);
+  PutInt32(0, &header);
+  header.push_back(0);
+  PutInt32(LzoChecksumUtil::Adler32(LzoChecksumUtil::ADLER32_INIT,
+      reinterpret_cast<const uint8_t*>(header.data()), header.size()), &header);
+  file.append(header);
+
+  vector<uint8_t> work_mem(LZO1X_1_MEM_COMPRESS);
+  vector<uint8_t> compressed(block_size + block_size / 16 + 64 + 3);
+  string block;
+  for (int64_t pos = 0; pos < text.size(); pos += block_size) {
+    block = text.substr(pos, block_size);
+    if (random->Next() % 1000 < stored_fraction * 1000) {
+      for (char& c : block) c = static_cast<char>(random->Next());
+    }
+    const uint8_t* data = reinterpret_cast<const uint8_t*>(block.data());
+    lzo_uint compressed_len;
+    lzo1x_1_compress(data, block.size(), compressed.data(), &compressed_len,
+        work_mem.data());
+    bool stored = compressed_len >= block.size();
+    PutInt32(block.size(), &file);
+    PutInt32(stored ? block.size() : compressed_len, &file);
+    if (checksum != CHECK_NONE) {
+      PutInt32(LzoChecksumUtil::Compute(checksum, data, block.size()), &file);
+      if (!stored) {
+        PutInt32(LzoChecksumUtil::Compute(checksum, compressed.data(), compressed_len),
+            &file);
+      }
+    }
+    if (stored) {
+      file.append(block);
+    } else {
+      file.append(reinterpret_cast<const char*>(compressed.data()), compressed_len);
+    }
+  }
+  PutInt32(0, &file);
+  return file;
+}
+
+// Parses the header and blocks of 'file'.
+static bool ParseFile(LzoFile* file, string* error) {
+  const uint8_t* start = reinterpret_cast<const uint8_t*>(file->data.data());
+  const uint8_t* end = start + file->data.size();
+  if (!LzoFormat::ParseHeader(start, file->data.size(), &file->header, error)) {
+    return false;
+  }
+  for (const uint8_t* ptr = start + file->header.header_size_; ; ) {
+    LzoFormat::Block block;
+    if (!LzoFormat::ParseBlock(file->header, ptr, end - ptr, &block, error)) {
+      return false;
+    }
+    if (block.uncompressed_len == 0) break;
+    file->blocks.push_back(block);
+    file->uncompressed_len += block.uncompressed_len;
+    if (block.stored()) ++file->num_stored;
+    file->max_block_len = max(file->max_block_len, block.uncompressed_len);
+    ptr += block.header_len + block.compressed_len;
+  }
+  return true;
+}
+
+// Runs 'fn', which processes 'len' bytes, for at least 'min_time' seconds and returns
+// the MB/s it processed.
+template <typename Fn>
+static double Measure(int64_t len, double min_time, const Fn& fn) {
+  typedef chrono::steady_clock Clock;
+  Clock::time_point start = Clock::now();
+  double elapsed;
+  int64_t iterations = 0;
+  do {
+    fn();
+    ++iterations;
+    elapsed = chrono::duration<double>(Clock::now() - start).count();
+  } while (elapsed < min_time);
+  return len * iterations / elapsed / (1024 * 1024);
+}
+
+// Measures and prints the decoding speeds of 'file'. Returns false if it fails to
+// decode.
+static bool Benchmark(const LzoFile& file, double min_time) {
+  const LzoFileHeader& header = file.header;
+  vector<uint8_t> out(file.max_block_len + LzoDecompressor::OUTPUT_SLACK);
+  string error;
+  bool ok = true;
+
+  // Decode the file once, which also checks it, and keep the uncompressed blocks for
+  // the checksum benchmark.
+  vector<string> uncompressed;
+  for (const LzoFormat::Block& block : file.blocks) {
+    const uint8_t* result;
+    if (!LzoFormat::DecodeBlock(header, block, true, out.data(), &result, &error)) {
+      cerr << file.name << ": " << error << endl;
+      return false;
+    }
+    uncompressed.emplace_back(reinterpret_cast<const char*>(result),
+        block.uncompressed_len);
+  }
+
+  double checksum_rate = 0;
+  if (header.input_checksum_type_ != CHECK_NONE
+      || header.output_checksum_type_ != CHECK_NONE) {
+    volatile uint32_t sink = 0;
+    checksum_rate = Measure(file.uncompressed_len, min_time, [&]() {
+      for (int i = 0; i < file.blocks.size(); ++i) {
+        const LzoFormat::Block& block = file.blocks[i];
+        sink = sink + LzoChecksumUtil::Compute(header.output_checksum_type_,
+            reinterpret_cast<const uint8_t*>(uncompressed[i].data()),
+            block.uncompressed_len);
+        if (!block.stored()) {
+          sink = sink + LzoChecksumUtil::Compute(header.input_checksum_type_,
+              block.data, block.compressed_len);
+        }
+      }
+    });
+  }
+
+  double fast_rate = Measure(file.uncompressed_len, min_time, [&]() {
+    for (const LzoFormat::Block& block : file.blocks) {
+      if (block.stored()) continue;
+      int64_t out_len;
+      if (LzoDecompressor::Decompress(block.data, block.compressed_len, out.data(),
+              block.uncompressed_len, LzoDecompressor::OUTPUT_SLACK, &out_len)
+          != LzoDecompressor::OK) {
+        ok = false;
+      }
+    }
+  });
+
+  double liblzo_rate = Measure(file.uncompressed_len, min_time, [&]() {
+    for (const LzoFormat::Block& block : file.blocks) {
+      if (block.stored()) continue;
+      lzo_uint out_len = block.uncompressed_len;
+      if (lzo1x_decompress_safe(block.data, block.compressed_len, out.data(), &out_len,
+              nullptr) != LZO_E_OK) {
+        ok = false;
+      }
+    }
+  });
+
+  double decode_rate = Measure(file.uncompressed_len, min_time, [&]() {
+    for (const LzoFormat::Block& block : file.blocks) {
+      const uint8_t* result;
+      if (!LzoFormat::DecodeBlock(header, block, true, out.data(), &result, &error)) {
+        ok = false;
+      }
+    }
+  });
+  if (!ok) {
+    cerr << file.name << ": decoding failed while measuring" << endl;
+    return false;
+  }
+
+  cout << left << setw(32) << file.name << right << fixed << setprecision(1)
+       << setw(8) << file.uncompressed_len / (1024.0 * 1024.0)
+       << setw(7) << static_cast<double>(file.uncompressed_len) / file.data.size()
+       << setw(8) << file.num_stored << "/" << left << setw(6) << file.blocks.size()
+       << right << setw(10);
+  if (checksum_rate > 0) {
+    cout << checksum_rate;
+  } else {
+    cout << "-";
+  }
+  cout << setw(10) << fast_rate << setw(10) << liblzo_rate << setw(10) << decode_rate
+       << endl;
+  return true;
+}
+
+static int Usage() {
+  cerr << "Usage: lzo-benchmark [--min_time=<seconds>] [file.lzo ...]" << endl;
+  return 1;
+}
+
+int main(int argc, char** argv) {
+  double min_time = 1;
+  vector<string> filenames;
+  for (int i = 1; i < argc; ++i) {
+    string arg = argv[i];
+    if (arg.compare(0, 11, "--min_time=") == 0) {
+      min_time = atof(arg.c_str() + 11);
+      if (min_time <= 0) return Usage();
+    } else if (arg.compare(0, 2, "--") == 0) {
+      return Usage();
+    } else {
+      filenames.push_back(arg);
+    }
+  }
+  if (lzo_init() != LZO_E_OK) {
+    cerr << "Could not initialize liblzo" << endl;
+    return 1;
+  }
+
+  vector<LzoFile> files;
+  if (filenames.empty()) {
+    Random random(1);
+    string text = GenerateText(SYNTHETIC_FILE_SIZE, &random);
+    static const char* const CHECKSUM_NAMES[] = { "none", "crc32", "adler32" };
+    for (int block_size : { 64 * 1024, 256 * 1024, 1024 * 1024 }) {
+      for (LzoChecksum checksum : { CHECK_NONE, CHECK_CRC32, CHECK_ADLER }) {
+        for (double stored_fraction : { 0.0, 0.25 }) {
+          LzoFile file;
+          stringstream name;
+          name << block_size / 1024 << "K/" << CHECKSUM_NAMES[checksum] << "/"
+               << static_cast<int>(stored_fraction * 100) << "% stored";
+          file.name = name.str();
+          file.data = CompressLzop(text, block_size, checksum, stored_fraction, &random);
+          files.push_back(move(file));
+        }
+      }
+    }
+  } else {
+    for (const string& filename : filenames) {
+      ifstream in(filename.c_str(), ios::in | ios::binary);
+      if (!in.is_open()) {
+        cerr << "Could not open " << filename << ": " << strerror(errno) << endl;
+        return 1;
+      }
+      stringstream contents;
+      contents << in.rdbuf();
+      LzoFile file;
+      file.name = filename;
+      file.data = contents.str();
+      files.push_back(move(file));
+    }
+  }
+
+  cout << "CRC32: " << LzoChecksumUtil::Crc32Implementation() << ", Adler32: "
+       << LzoChecksumUtil::Adler32Implementation() << endl;
+  cout << "MB/s of uncompressed data on one core" << endl;
+  cout << left << setw(32) << "file" << right << setw(8) << "MB" << setw(7) << "ratio"
+       << setw(15) << "stored/blocks" << setw(10) << "checksum" << setw(10) << "fast"
+       << setw(10) << "liblzo" << setw(10) << "decode" << endl;
+  int ret = 0;
+  for (LzoFile& file : files) {
+    string error;
+    if (!ParseFile(&file, &error)) {
+      cerr << file.name << ": " << error << endl;
+      ret = 1;
+      continue;
+    }
+    if (!Benchmark(file, min_time)) ret = 1;
+  }
+  return ret;
+}
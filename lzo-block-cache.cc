@@ -0,0 +1,104 @@
+// Copyright (c) 2012 Cloudera, Inc. All rights reserved.
+
+#include "lzo-block-cache.h"
+
+#include <functional>
+#include <boost/thread/locks.hpp>
+
+#include "common/logging.h"
+#include "runtime/exec-env.h"
+#include "runtime/mem-tracker.h"
+
+using namespace impala;
+using namespace std;
+
+DEFINE_int64(lzo_block_cache_capacity, 0,
+    "Maximum number of bytes of decompressed lzo blocks that are cached across queries, "
+    "so repeated scans of the same files do not decompress them again. If 0, blocks are "
+    "not cached. Blocks decompressed with --lzo_decompress_readahead_blocks or "
+    "--lzo_decompress_chunk_size are not cached.");
+
+// Per-entry overhead of the list node, map node and shared_ptr control block.
+static const int64_t ENTRY_OVERHEAD = 128;
+
+// Returns the tracker that cached blocks are charged to: that of the process, so the
+// cache counts against the daemon's memory limit like running queries.
+static MemTracker* CacheMemTracker() {
+  return ExecEnv::GetInstance()->process_mem_tracker();
+}
+
+namespace impala {
+
+size_t LzoBlockCache::KeyHash::operator()(const Key& key) const {
+  size_t hash = std::hash<string>()(key.filename);
+  hash ^= std::hash<int64_t>()(key.file_offset) + 0x9e3779b9 + (hash << 6) + (hash >> 2);
+  hash ^= std::hash<int64_t>()(key.mtime) + 0x9e3779b9 + (hash << 6) + (hash >> 2);
+  return hash;
+}
+
+bool LzoBlockCache::IsEnabled() {
+  return FLAGS_lzo_block_cache_capacity > 0;
+}
+
+LzoBlockCache* LzoBlockCache::GetInstance() {
+  // Like the header cache, the block cache lives until the process exits.
+  static LzoBlockCache* cache = new LzoBlockCache();
+  return cache;
+}
+
+shared_ptr<const string> LzoBlockCache::Lookup(
+    const string& filename, int64_t mtime, int64_t file_offset) {
+  DCHECK(IsEnabled());
+  LzoBlockCache* cache = GetInstance();
+  boost::lock_guard<boost::mutex> l(cache->lock_);
+  auto it = cache->index_.find(Key{filename, mtime, file_offset});
+  if (it == cache->index_.end()) {
+    ++cache->stats_.misses;
+    return nullptr;
+  }
+  ++cache->stats_.hits;
+  cache->entries_.splice(cache->entries_.begin(), cache->entries_, it->second);
+  return it->second->data;
+}
+
+void LzoBlockCache::Insert(const string& filename, int64_t mtime, int64_t file_offset,
+    const uint8_t* data, int64_t len) {
+  DCHECK(IsEnabled());
+  int64_t size = sizeof(Entry) + ENTRY_OVERHEAD + 2 * filename.size() + len;
+  if (size > FLAGS_lzo_block_cache_capacity) return;
+  // Copy the block before taking the lock.
+  shared_ptr<const string> copy(new string(reinterpret_cast<const char*>(data), len));
+
+  LzoBlockCache* cache = GetInstance();
+  boost::lock_guard<boost::mutex> l(cache->lock_);
+  Key key{filename, mtime, file_offset};
+  // Scanners of overlapping ranges may both decompress a block.
+  if (cache->index_.find(key) != cache->index_.end()) return;
+  cache->EvictTo(FLAGS_lzo_block_cache_capacity - size);
+  // Blocks are only worth caching if the process has memory to spare.
+  if (!CacheMemTracker()->TryConsume(size)) return;
+  cache->entries_.push_front(Entry{key, copy, size});
+  cache->index_[key] = cache->entries_.begin();
+  cache->size_ += size;
+  cache->stats_.bytes += len;
+}
+
+LzoBlockCache::Stats LzoBlockCache::GetStats() {
+  LzoBlockCache* cache = GetInstance();
+  boost::lock_guard<boost::mutex> l(cache->lock_);
+  return cache->stats_;
+}
+
+void LzoBlockCache::EvictTo(int64_t capacity) {
+  while (size_ > capacity && !entries_.empty()) {
+    const Entry& entry = entries_.back();
+    size_ -= entry.size;
+    CacheMemTracker()->Release(entry.size);
+    stats_.bytes -= entry.data->size();
+    ++stats_.evictions;
+    index_.erase(entry.key);
+    entries_.pop_back();
+  }
+}
+
+}
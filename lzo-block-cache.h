@@ -0,0 +1,102 @@
+// Copyright (c) 2012 Cloudera, Inc. All rights reserved.
+
+#ifndef IMPALA_LZO_BLOCK_CACHE_H
+#define IMPALA_LZO_BLOCK_CACHE_H
+
+#include <stdint.h>
+#include <list>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <boost/thread/mutex.hpp>
+
+namespace impala {
+
+// Daemon-wide LRU cache of decompressed lzo blocks, so repeated scans of hot files
+// copy each block out of memory rather than decompress it again. Blocks are keyed by
+// file name, modification time and the file offset of their compressed data, so a
+// block is never used for a file that has been rewritten; blocks of earlier versions
+// of a file are evicted as they age. The total size of the cached blocks is bounded
+// by --lzo_block_cache_capacity, and the cache is disabled by default. Cached blocks
+// are charged to the process MemTracker, and blocks are not cached if the process is
+// at its memory limit.
+//
+// Only blocks that decompressed and passed their checksums are cached. Stored blocks
+// are not, as returning them costs no more than copying them out of the cache.
+class LzoBlockCache {
+ public:
+  // Counters of the cache, for all scanners since startup.
+  struct Stats {
+    int64_t hits = 0;
+    int64_t misses = 0;
+
+    // Blocks removed to make room for others.
+    int64_t evictions = 0;
+
+    // Bytes of decompressed data in the cache.
+    int64_t bytes = 0;
+  };
+
+  // Returns true if --lzo_block_cache_capacity is positive.
+  static bool IsEnabled();
+
+  // Returns the decompressed data of the block of 'filename' at 'file_offset' for this
+  // 'mtime', or nullptr if it is not cached.
+  static std::shared_ptr<const std::string> Lookup(
+      const std::string& filename, int64_t mtime, int64_t file_offset);
+
+  // Caches a copy of the 'len' bytes at 'data' as the decompressed block of 'filename'
+  // at 'file_offset', evicting least recently used blocks to stay within the capacity.
+  static void Insert(const std::string& filename, int64_t mtime, int64_t file_offset,
+      const uint8_t* data, int64_t len);
+
+  static Stats GetStats();
+
+ private:
+  struct Key {
+    std::string filename;
+    int64_t mtime;
+    int64_t file_offset;
+
+    bool operator==(const Key& other) const {
+      return file_offset == other.file_offset && mtime == other.mtime
+          && filename == other.filename;
+    }
+  };
+
+  struct KeyHash {
+    size_t operator()(const Key& key) const;
+  };
+
+  struct Entry {
+    Key key;
+    std::shared_ptr<const std::string> data;
+
+    // Estimate of the memory used by this entry.
+    int64_t size;
+  };
+
+  // Entries in least recently used order, most recent first.
+  typedef std::list<Entry> EntryList;
+
+  // Returns the cache, creating it on first use.
+  static LzoBlockCache* GetInstance();
+
+  // Removes least recently used entries until the cache is at most 'capacity' bytes.
+  // 'lock_' must be held.
+  void EvictTo(int64_t capacity);
+
+  // Protects all members below.
+  boost::mutex lock_;
+
+  EntryList entries_;
+  std::unordered_map<Key, EntryList::iterator, KeyHash> index_;
+
+  // Sum of the sizes of 'entries_'.
+  int64_t size_ = 0;
+
+  Stats stats_;
+};
+
+}
+#endif
@@ -0,0 +1,118 @@
+// Copyright (c) 2012 Cloudera, Inc. All rights reserved.
+
+#include <stdlib.h>
+#include <algorithm>
+#include <vector>
+#include <gtest/gtest.h>
+
+#include "lzo-block-offsets.h"
+
+using namespace impala;
+using namespace std;
+
+namespace impala {
+
+// Appends 'expected' to 'offsets' and checks that they read back the same.
+static void AppendAll(const vector<int64_t>& expected, LzoBlockOffsets* offsets) {
+  for (int64_t offset : expected) ASSERT_TRUE(offsets->Append(offset));
+  ASSERT_EQ(offsets->size(), expected.size());
+  for (int64_t i = 0; i < expected.size(); ++i) {
+    ASSERT_EQ((*offsets)[i], expected[i]) << "offset " << i;
+  }
+}
+
+// Checks LowerBound() and UpperBound() at, around and between the offsets.
+static void CheckSearches(const vector<int64_t>& expected,
+    const LzoBlockOffsets& offsets) {
+  vector<int64_t> probes = { -1, 0 };
+  for (int64_t offset : expected) {
+    probes.push_back(offset - 1);
+    probes.push_back(offset);
+    probes.push_back(offset + 1);
+  }
+  for (int64_t probe : probes) {
+    EXPECT_EQ(offsets.LowerBound(probe),
+        lower_bound(expected.begin(), expected.end(), probe) - expected.begin())
+        << "probe " << probe;
+    EXPECT_EQ(offsets.UpperBound(probe),
+        upper_bound(expected.begin(), expected.end(), probe) - expected.begin())
+        << "probe " << probe;
+  }
+}
+
+TEST(LzoBlockOffsetsTest, Empty) {
+  LzoBlockOffsets offsets;
+  EXPECT_TRUE(offsets.empty());
+  EXPECT_EQ(offsets.size(), 0);
+  EXPECT_EQ(offsets.LowerBound(0), 0);
+  EXPECT_EQ(offsets.UpperBound(100), 0);
+}
+
+TEST(LzoBlockOffsetsTest, AppendRejectsNonIncreasing) {
+  LzoBlockOffsets offsets;
+  EXPECT_FALSE(offsets.Append(-1));
+  EXPECT_TRUE(offsets.Append(0));
+  EXPECT_FALSE(offsets.Append(0));
+  EXPECT_TRUE(offsets.Append(10));
+  EXPECT_FALSE(offsets.Append(5));
+  EXPECT_EQ(offsets.size(), 2);
+  EXPECT_EQ(offsets.back(), 10);
+  offsets.clear();
+  EXPECT_TRUE(offsets.empty());
+  EXPECT_TRUE(offsets.Append(5));
+}
+
+// Offsets of full groups, a partial group and groups whose distances need all widths,
+// up to distances beyond 32 bits.
+TEST(LzoBlockOffsetsTest, GroupBoundaries) {
+  const int group = LzoBlockOffsets::GROUP_SIZE;
+  for (int num_offsets : { 1, group - 1, group, group + 1, 5 * group + 7 }) {
+    for (int64_t step : { 1LL, 100000LL, 1LL << 33 }) {
+      vector<int64_t> expected;
+      for (int i = 0; i < num_offsets; ++i) expected.push_back(38 + i * step);
+      LzoBlockOffsets offsets;
+      offsets.Reserve(num_offsets);
+      AppendAll(expected, &offsets);
+      CheckSearches(expected, offsets);
+    }
+  }
+}
+
+TEST(LzoBlockOffsetsTest, RandomOffsets) {
+  srand(1);
+  for (int iteration = 0; iteration < 50; ++iteration) {
+    vector<int64_t> expected;
+    int num_offsets = rand() % 1000;
+    int64_t offset = rand() % 100;
+    for (int i = 0; i < num_offsets; ++i) {
+      expected.push_back(offset);
+      // Mostly lzop-sized blocks, and now and then a far larger gap.
+      offset += rand() % 10 == 0 ? 1 + (static_cast<int64_t>(rand()) << 8) :
+          1 + rand() % 300000;
+    }
+    LzoBlockOffsets offsets;
+    AppendAll(expected, &offsets);
+    CheckSearches(expected, offsets);
+  }
+}
+
+// Offsets of lzop's blocks take less than half the memory of a vector of int64_t.
+TEST(LzoBlockOffsetsTest, MemoryUsage) {
+  srand(1);
+  int num_offsets = 100 * LzoBlockOffsets::GROUP_SIZE;
+  LzoBlockOffsets offsets;
+  offsets.Reserve(num_offsets);
+  int64_t offset = 38;
+  for (int i = 0; i < num_offsets; ++i) {
+    ASSERT_TRUE(offsets.Append(offset));
+    offset += 90000 + rand() % 20000;
+  }
+  EXPECT_LT(offsets.MemoryUsage(), num_offsets * sizeof(int64_t) / 2);
+}
+
+}
+
+int main(int argc, char** argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,111 @@
+// Copyright (c) 2012 Cloudera, Inc. All rights reserved.
+
+#include "lzo-block-offsets.h"
+
+#include <algorithm>
+
+using namespace impala;
+using namespace std;
+
+// Bits per packed distance Reserve() assumes: enough for groups of lzop's 256KB blocks
+// that compress to no more than 256KB. Groups of larger blocks grow 'packed_'.
+static const int EXPECTED_WIDTH = 24;
+
+// Returns the number of 64-bit words holding a group's distances of 'width' bits.
+static int64_t WordsPerGroup(int width) {
+  return ((LzoBlockOffsets::GROUP_SIZE - 1) * width + 63) / 64;
+}
+
+namespace impala {
+
+void LzoBlockOffsets::Reserve(int64_t num_offsets) {
+  int64_t num_groups = num_offsets / GROUP_SIZE;
+  groups_.reserve(num_groups);
+  packed_.reserve(num_groups * WordsPerGroup(EXPECTED_WIDTH));
+  tail_.reserve(GROUP_SIZE);
+}
+
+bool LzoBlockOffsets::Append(int64_t offset) {
+  if (offset < 0 || (size_ > 0 && offset <= back())) return false;
+  tail_.push_back(offset);
+  ++size_;
+  if (tail_.size() == GROUP_SIZE) PackTail();
+  return true;
+}
+
+void LzoBlockOffsets::PackTail() {
+  Group group;
+  group.base = tail_[0];
+  group.word = packed_.size();
+  uint64_t max_distance = tail_.back() - group.base;
+  group.width = 64 - __builtin_clzll(max_distance);
+  groups_.push_back(group);
+  packed_.resize(packed_.size() + WordsPerGroup(group.width), 0);
+  uint64_t* words = packed_.data() + group.word;
+  for (int i = 1; i < GROUP_SIZE; ++i) {
+    uint64_t distance = tail_[i] - group.base;
+    int64_t bit = (i - 1) * group.width;
+    int shift = bit % 64;
+    words[bit / 64] |= distance << shift;
+    if (shift + group.width > 64) words[bit / 64 + 1] |= distance >> (64 - shift);
+  }
+  tail_.clear();
+}
+
+void LzoBlockOffsets::clear() {
+  groups_.clear();
+  packed_.clear();
+  tail_.clear();
+  size_ = 0;
+}
+
+int64_t LzoBlockOffsets::operator[](int64_t i) const {
+  int64_t group_index = i / GROUP_SIZE;
+  int index_in_group = i % GROUP_SIZE;
+  if (group_index == static_cast<int64_t>(groups_.size())) return tail_[index_in_group];
+  const Group& group = groups_[group_index];
+  if (index_in_group == 0) return group.base;
+  const uint64_t* words = packed_.data() + group.word;
+  int64_t bit = (index_in_group - 1) * group.width;
+  int shift = bit % 64;
+  uint64_t distance = words[bit / 64] >> shift;
+  if (shift + group.width > 64) distance |= words[bit / 64 + 1] << (64 - shift);
+  // Distances are less than 2^63, so 'width' is less than 64.
+  distance &= (1ULL << group.width) - 1;
+  return group.base + distance;
+}
+
+int64_t LzoBlockOffsets::LowerBound(int64_t offset) const {
+  // Find the groups whose base is less than 'offset'. The answer is after the base of
+  // the last of them and no later than the base of the next one, so only that group's
+  // distances (or, after the last group, the tail) are searched, in cache.
+  int64_t num_groups = lower_bound(groups_.begin(), groups_.end(), offset,
+      [](const Group& group, int64_t value) { return group.base < value; })
+      - groups_.begin();
+  int64_t first = 0;
+  int64_t last = size_;
+  if (num_groups > 0) {
+    first = (num_groups - 1) * GROUP_SIZE + 1;
+  } else if (!groups_.empty()) {
+    return 0;
+  }
+  if (num_groups < static_cast<int64_t>(groups_.size())) last = num_groups * GROUP_SIZE;
+  int64_t count = last - first;
+  while (count > 0) {
+    int64_t step = count / 2;
+    if ((*this)[first + step] < offset) {
+      first += step + 1;
+      count -= step + 1;
+    } else {
+      count = step;
+    }
+  }
+  return first;
+}
+
+int64_t LzoBlockOffsets::MemoryUsage() const {
+  return groups_.capacity() * sizeof(Group) + packed_.capacity() * sizeof(uint64_t)
+      + tail_.capacity() * sizeof(int64_t);
+}
+
+}
@@ -0,0 +1,85 @@
+// Copyright (c) 2012 Cloudera, Inc. All rights reserved.
+
+#ifndef IMPALA_LZO_BLOCK_OFFSETS_H
+#define IMPALA_LZO_BLOCK_OFFSETS_H
+
+#include <stdint.h>
+#include <vector>
+
+namespace impala {
+
+// The increasing file offsets of the blocks of an lzo file, in less than half the
+// memory of a vector of int64_t, for files with millions of blocks.
+//
+// Offsets are packed in groups of GROUP_SIZE. Each group keeps its first offset, the
+// directory entry searched first, and the distance of the others from it in a fixed
+// number of bits: the fewest that hold the largest distance in the group. With lzop's
+// 256KB blocks compressing to about 100KB, that is 23 bits per block. Any offset is
+// unpacked in constant time. Lookups binary search the group bases, then the
+// distances of the one group that holds the offset.
+//
+// Offsets are only appended. Once loaded they are not modified, so they can be shared
+// by scanners and by later queries through LzoHeaderCache.
+class LzoBlockOffsets {
+ public:
+  // Number of offsets in each packed group.
+  static const int GROUP_SIZE = 64;
+
+  // Makes room for 'num_offsets' offsets, so an index of known length is loaded
+  // without reallocating.
+  void Reserve(int64_t num_offsets);
+
+  // Appends 'offset'. Returns false, and appends nothing, if it is negative or not
+  // larger than the last offset.
+  bool Append(int64_t offset);
+
+  void clear();
+
+  int64_t size() const { return size_; }
+  bool empty() const { return size_ == 0; }
+
+  // Returns the offset at index 'i', which must be less than size().
+  int64_t operator[](int64_t i) const;
+
+  int64_t back() const { return (*this)[size_ - 1]; }
+
+  // Returns the index of the first offset that is not less than 'offset', or size() if
+  // there is none, like std::lower_bound().
+  int64_t LowerBound(int64_t offset) const;
+
+  // Returns the index of the first offset greater than 'offset', or size() if there is
+  // none, like std::upper_bound().
+  int64_t UpperBound(int64_t offset) const { return LowerBound(offset + 1); }
+
+  // Returns the number of bytes allocated for the offsets.
+  int64_t MemoryUsage() const;
+
+ private:
+  struct Group {
+    // The first offset of the group.
+    int64_t base;
+
+    // Index in 'packed_' of the word holding the first packed distance.
+    uint32_t word;
+
+    // Bits per packed distance.
+    uint8_t width;
+  };
+
+  // Packs 'tail_' into a new group.
+  void PackTail();
+
+  std::vector<Group> groups_;
+
+  // The distances of all but the first offset of each group from that offset, 'width'
+  // bits each, from the low bits of each word up.
+  std::vector<uint64_t> packed_;
+
+  // The offsets after the last full group, not packed yet.
+  std::vector<int64_t> tail_;
+
+  int64_t size_ = 0;
+};
+
+}
+#endif
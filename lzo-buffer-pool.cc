@@ -0,0 +1,158 @@
+// Copyright (c) 2012 Cloudera, Inc. All rights reserved.
+
+#include "lzo-buffer-pool.h"
+
+#include <stdlib.h>
+#include <sstream>
+#include <vector>
+#include <boost/thread/locks.hpp>
+#include <boost/thread/mutex.hpp>
+
+#include "common/logging.h"
+#include "runtime/exec-env.h"
+#include "runtime/mem-tracker.h"
+#include "util/bit-util.h"
+
+using namespace impala;
+using namespace std;
+
+DEFINE_int64(lzo_buffer_pool_capacity, 256L * 1024L * 1024L,
+    "Maximum number of bytes of free buffers that lzo scanners keep for reuse. They are "
+    "charged to the process memory limit, and are freed instead of kept if it has no "
+    "room for them. If 0, buffers are freed once a scanner is done with them.");
+
+// Buffers are at least this big, the size of a typical uncompressed lzop block.
+static const int MIN_SIZE_CLASS = 18;
+static const int64_t MIN_BUFFER_SIZE = 1L << MIN_SIZE_CLASS;
+
+// The largest size class holds buffers for the largest blocks lzop writes
+// (LZO_MAX_BLOCK_SIZE) plus slack.
+static const int NUM_SIZE_CLASSES = 27 - MIN_SIZE_CLASS + 1;
+
+namespace {
+
+struct PoolState {
+  boost::mutex lock;
+
+  // Free buffers of each size class.
+  vector<uint8_t*> free_buffers[NUM_SIZE_CLASSES];
+
+  LzoBufferPool::Stats stats;
+};
+
+PoolState* GetPoolState() {
+  // Lives until the process exits, like the library.
+  static PoolState* state = new PoolState();
+  return state;
+}
+
+// Returns the tracker that idle buffers are charged to: that of the process, so the
+// memory they hold counts against the daemon's limit like that of running queries.
+MemTracker* IdleMemTracker() {
+  return ExecEnv::GetInstance()->process_mem_tracker();
+}
+
+// Returns the size class of buffers of 'len' bytes, or -1 if they are too big to be
+// pooled.
+int SizeClass(int64_t len) {
+  if (len <= MIN_BUFFER_SIZE) return 0;
+  int size_class = BitUtil::Log2Ceiling64(len) - MIN_SIZE_CLASS;
+  return size_class < NUM_SIZE_CLASSES ? size_class : -1;
+}
+
+}
+
+namespace impala {
+
+LzoBufferPool::Buffer& LzoBufferPool::Buffer::operator=(Buffer&& other) {
+  if (this != &other) {
+    Reset();
+    data_ = other.data_;
+    capacity_ = other.capacity_;
+    mem_tracker_ = other.mem_tracker_;
+    other.data_ = nullptr;
+    other.capacity_ = 0;
+    other.mem_tracker_ = nullptr;
+  }
+  return *this;
+}
+
+void LzoBufferPool::Buffer::Reset() {
+  if (data_ == nullptr) return;
+  if (mem_tracker_ != nullptr) mem_tracker_->Release(capacity_);
+  Put(data_, capacity_);
+  data_ = nullptr;
+  capacity_ = 0;
+  mem_tracker_ = nullptr;
+}
+
+Status LzoBufferPool::Get(int64_t len, MemTracker* mem_tracker, Buffer* buffer,
+    bool* hit) {
+  buffer->Reset();
+  int size_class = SizeClass(len);
+  int64_t capacity = size_class < 0 ? len : MIN_BUFFER_SIZE << size_class;
+  // Reserve the buffer before taking it, so a scan over its memory limit fails
+  // instead of holding more memory than it may.
+  if (mem_tracker != nullptr && !mem_tracker->TryConsume(capacity)) {
+    stringstream ss;
+    ss << "Could not reserve lzo buffer of " << capacity << " bytes";
+    return mem_tracker->MemLimitExceeded(nullptr, ss.str(), capacity);
+  }
+  uint8_t* data = nullptr;
+  PoolState* state = GetPoolState();
+  {
+    boost::lock_guard<boost::mutex> l(state->lock);
+    if (size_class >= 0 && !state->free_buffers[size_class].empty()) {
+      data = state->free_buffers[size_class].back();
+      state->free_buffers[size_class].pop_back();
+      state->stats.idle_bytes -= capacity;
+      IdleMemTracker()->Release(capacity);
+      ++state->stats.hits;
+    } else {
+      ++state->stats.misses;
+    }
+  }
+  *hit = data != nullptr;
+  if (data == nullptr) {
+    data = reinterpret_cast<uint8_t*>(malloc(capacity));
+    if (data == nullptr) {
+      if (mem_tracker != nullptr) mem_tracker->Release(capacity);
+      stringstream ss;
+      ss << "Could not allocate lzo buffer of " << capacity << " bytes";
+      return Status(ss.str());
+    }
+  }
+  {
+    boost::lock_guard<boost::mutex> l(state->lock);
+    state->stats.in_use_bytes += capacity;
+  }
+  buffer->data_ = data;
+  buffer->capacity_ = capacity;
+  buffer->mem_tracker_ = mem_tracker;
+  return Status::OK();
+}
+
+void LzoBufferPool::Put(uint8_t* data, int64_t capacity) {
+  int size_class = SizeClass(capacity);
+  PoolState* state = GetPoolState();
+  {
+    boost::lock_guard<boost::mutex> l(state->lock);
+    state->stats.in_use_bytes -= capacity;
+    if (size_class >= 0 &&
+        state->stats.idle_bytes + capacity <= FLAGS_lzo_buffer_pool_capacity &&
+        IdleMemTracker()->TryConsume(capacity)) {
+      state->free_buffers[size_class].push_back(data);
+      state->stats.idle_bytes += capacity;
+      return;
+    }
+  }
+  free(data);
+}
+
+LzoBufferPool::Stats LzoBufferPool::GetStats() {
+  PoolState* state = GetPoolState();
+  boost::lock_guard<boost::mutex> l(state->lock);
+  return state->stats;
+}
+
+}
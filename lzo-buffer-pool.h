@@ -0,0 +1,82 @@
+// Copyright (c) 2012 Cloudera, Inc. All rights reserved.
+
+#ifndef IMPALA_LZO_BUFFER_POOL_H
+#define IMPALA_LZO_BUFFER_POOL_H
+
+#include <stdint.h>
+
+#include "common/status.h"
+
+namespace impala {
+
+class MemTracker;
+
+// Daemon-wide pool of recycled buffers for lzo scanners, so scanners on many files do
+// not allocate and fault in a new buffer for every block. Buffers are grouped in
+// power of two size classes. Freed buffers are kept for reuse, up to
+// --lzo_buffer_pool_capacity bytes, and other buffers are returned to the system.
+// Buffers in use are charged to the scanner's MemTracker, and kept buffers to the
+// process MemTracker.
+//
+// Only buffers that stay with the scanner can be recycled: those that hold the data
+// of a block only until the next block is read. Buffers that row batches may
+// reference are allocated from MemPools, which free them when the batches are freed.
+class LzoBufferPool {
+ public:
+  // A buffer from the pool. Returns the buffer to the pool when reset or destroyed.
+  class Buffer {
+   public:
+    Buffer() {}
+    Buffer(Buffer&& other) { *this = static_cast<Buffer&&>(other); }
+    Buffer& operator=(Buffer&& other);
+    ~Buffer() { Reset(); }
+
+    uint8_t* data() const { return data_; }
+    int64_t capacity() const { return capacity_; }
+
+    // Returns the buffer to the pool.
+    void Reset();
+
+   private:
+    friend class LzoBufferPool;
+
+    Buffer(const Buffer&) = delete;
+    Buffer& operator=(const Buffer&) = delete;
+
+    uint8_t* data_ = nullptr;
+    int64_t capacity_ = 0;
+
+    // Tracker the buffer's capacity is charged to while it is in use. May be nullptr.
+    MemTracker* mem_tracker_ = nullptr;
+  };
+
+  // Counters of the pool, for all scanners since startup.
+  struct Stats {
+    // Buffers handed out from the pool and newly allocated.
+    int64_t hits = 0;
+    int64_t misses = 0;
+
+    // Bytes of buffers kept in the pool for reuse.
+    int64_t idle_bytes = 0;
+
+    // Bytes of buffers currently in use.
+    int64_t in_use_bytes = 0;
+  };
+
+  // Returns in *buffer a buffer of at least 'len' bytes, releasing any buffer it held.
+  // Its capacity is charged to 'mem_tracker' until it is returned, if not nullptr.
+  // Sets *hit to true if the buffer was recycled. Returns a memory limit error if
+  // 'mem_tracker' has no room for the buffer, or an error if a new buffer could not be
+  // allocated.
+  static Status Get(int64_t len, MemTracker* mem_tracker, Buffer* buffer, bool* hit);
+
+  static Stats GetStats();
+
+ private:
+  // Returns 'data' of 'capacity' bytes to the pool, or frees it if the pool is full or
+  // the process is at its memory limit.
+  static void Put(uint8_t* data, int64_t capacity);
+};
+
+}
+#endif
@@ -0,0 +1,110 @@
+// Copyright (c) 2012 Cloudera, Inc. All rights reserved.
+
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+#include <gtest/gtest.h>
+#include <zlib.h>
+
+#include "lzo-checksum.h"
+
+using namespace impala;
+using namespace std;
+
+namespace impala {
+
+// Returns zlib's CRC32 or Adler32 of 'len' bytes at 'buf', continuing from 'value'.
+typedef uint32_t (*ReferenceFn)(uint32_t value, const uint8_t* buf, int64_t len);
+
+static uint32_t ZlibCrc32(uint32_t crc, const uint8_t* buf, int64_t len) {
+  return crc32(crc, buf, len);
+}
+
+static uint32_t ZlibAdler32(uint32_t adler, const uint8_t* buf, int64_t len) {
+  return adler32(adler, buf, len);
+}
+
+// Compares every implementation in 'impls' with 'reference' over prefixes of 'data'
+// of many lengths, at every alignment, and split in two at several points.
+static void CheckImplementations(const vector<LzoChecksumUtil::Implementation>& impls,
+    ReferenceFn reference, uint32_t init, const vector<uint8_t>& data) {
+  vector<int64_t> lengths;
+  for (int64_t len = 0; len <= 300; ++len) lengths.push_back(len);
+  for (int64_t len : { 5551, 5552, 5553, 65536, 100000 }) lengths.push_back(len);
+
+  for (const LzoChecksumUtil::Implementation& impl : impls) {
+    for (int64_t len : lengths) {
+      for (int align = 0; align < 32; ++align) {
+        const uint8_t* buf = &data[align];
+        uint32_t expected = reference(init, buf, len);
+        ASSERT_EQ(impl.fn(init, buf, len), expected)
+            << impl.name << " length " << len << " alignment " << align;
+      }
+      const uint8_t* buf = &data[0];
+      uint32_t expected = reference(init, buf, len);
+      for (int64_t split : { len / 3, len / 2, len - 1 }) {
+        if (split < 0) continue;
+        uint32_t value = impl.fn(init, buf, split);
+        ASSERT_EQ(impl.fn(value, buf + split, len - split), expected)
+            << impl.name << " length " << len << " split at " << split;
+      }
+    }
+  }
+}
+
+class LzoChecksumTest : public testing::Test {
+ protected:
+  LzoChecksumTest() {
+    srand(1);
+    for (int i = 0; i < 200000; ++i) random_.push_back(rand());
+    // All bytes at their maximum value grow the Adler32 sums the fastest.
+    max_.assign(200000, 0xff);
+  }
+
+  vector<uint8_t> random_;
+  vector<uint8_t> max_;
+};
+
+TEST_F(LzoChecksumTest, Crc32) {
+  vector<LzoChecksumUtil::Implementation> impls = LzoChecksumUtil::Crc32Implementations();
+  ASSERT_STREQ(impls[0].name, "scalar");
+  CheckImplementations(impls, ZlibCrc32, LzoChecksumUtil::CRC32_INIT, random_);
+  CheckImplementations(impls, ZlibCrc32, LzoChecksumUtil::CRC32_INIT, max_);
+}
+
+TEST_F(LzoChecksumTest, Adler32) {
+  vector<LzoChecksumUtil::Implementation> impls =
+      LzoChecksumUtil::Adler32Implementations();
+  ASSERT_STREQ(impls[0].name, "scalar");
+  CheckImplementations(impls, ZlibAdler32, LzoChecksumUtil::ADLER32_INIT, random_);
+  CheckImplementations(impls, ZlibAdler32, LzoChecksumUtil::ADLER32_INIT, max_);
+}
+
+// The implementations in use are among those checked above, and are picked by Update().
+TEST_F(LzoChecksumTest, InUse) {
+  const uint8_t* buf = &random_[0];
+  int64_t len = random_.size();
+  bool found = false;
+  for (const LzoChecksumUtil::Implementation& impl :
+       LzoChecksumUtil::Crc32Implementations()) {
+    found |= strcmp(impl.name, LzoChecksumUtil::Crc32Implementation()) == 0;
+  }
+  EXPECT_TRUE(found);
+  found = false;
+  for (const LzoChecksumUtil::Implementation& impl :
+       LzoChecksumUtil::Adler32Implementations()) {
+    found |= strcmp(impl.name, LzoChecksumUtil::Adler32Implementation()) == 0;
+  }
+  EXPECT_TRUE(found);
+
+  EXPECT_EQ(LzoChecksumUtil::Compute(CHECK_CRC32, buf, len), ZlibCrc32(0, buf, len));
+  EXPECT_EQ(LzoChecksumUtil::Compute(CHECK_ADLER, buf, len), ZlibAdler32(1, buf, len));
+  EXPECT_EQ(LzoChecksumUtil::Compute(CHECK_NONE, buf, len), 0);
+}
+
+}
+
+int main(int argc, char** argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
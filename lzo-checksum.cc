@@ -0,0 +1,377 @@
+// Copyright (c) 2012 Cloudera, Inc. All rights reserved.
+
+#include "lzo-checksum.h"
+
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define LZO_CHECKSUM_X86 1
+#endif
+
+using namespace impala;
+using namespace std;
+
+// Largest number of bytes that can be added to the Adler32 sums before s2 has to be
+// reduced modulo ADLER_BASE to stay within 32 bits.
+static const int ADLER_NMAX = 5552;
+static const uint32_t ADLER_BASE = 65521;
+
+// Reversed CRC32 polynomial, as used by zlib and lzo.
+static const uint32_t CRC32_POLY = 0xedb88320;
+
+namespace {
+
+// Tables for the slicing-by-8 CRC32. table[k][b] is the CRC of byte 'b' followed by
+// 'k' zero bytes.
+struct Crc32Tables {
+  uint32_t table[8][256];
+
+  Crc32Tables() {
+    for (uint32_t b = 0; b < 256; ++b) {
+      uint32_t crc = b;
+      for (int i = 0; i < 8; ++i) crc = (crc >> 1) ^ ((crc & 1) ? CRC32_POLY : 0);
+      table[0][b] = crc;
+    }
+    for (uint32_t b = 0; b < 256; ++b) {
+      for (int k = 1; k < 8; ++k) {
+        table[k][b] = (table[k - 1][b] >> 8) ^ table[0][table[k - 1][b] & 0xff];
+      }
+    }
+  }
+};
+
+const Crc32Tables crc32_tables;
+
+// Works on the inverted CRC, as all the kernels below do.
+uint32_t Crc32Scalar(uint32_t crc, const uint8_t* buf, int64_t len) {
+  const uint32_t (*t)[256] = crc32_tables.table;
+  while (len > 0 && (reinterpret_cast<uintptr_t>(buf) & 7) != 0) {
+    crc = (crc >> 8) ^ t[0][(crc ^ *buf++) & 0xff];
+    --len;
+  }
+  while (len >= 8) {
+    uint32_t lo;
+    uint32_t hi;
+    memcpy(&lo, buf, sizeof(lo));
+    memcpy(&hi, buf + sizeof(lo), sizeof(hi));
+    lo ^= crc;
+    crc = t[7][lo & 0xff] ^ t[6][(lo >> 8) & 0xff] ^ t[5][(lo >> 16) & 0xff]
+        ^ t[4][lo >> 24] ^ t[3][hi & 0xff] ^ t[2][(hi >> 8) & 0xff]
+        ^ t[1][(hi >> 16) & 0xff] ^ t[0][hi >> 24];
+    buf += 8;
+    len -= 8;
+  }
+  while (len-- > 0) crc = (crc >> 8) ^ t[0][(crc ^ *buf++) & 0xff];
+  return crc;
+}
+
+uint32_t Adler32Scalar(uint32_t adler, const uint8_t* buf, int64_t len) {
+  uint32_t s1 = adler & 0xffff;
+  uint32_t s2 = adler >> 16;
+  while (len > 0) {
+    int n = len < ADLER_NMAX ? len : ADLER_NMAX;
+    len -= n;
+    for (; n >= 8; n -= 8, buf += 8) {
+      s1 += buf[0]; s2 += s1;
+      s1 += buf[1]; s2 += s1;
+      s1 += buf[2]; s2 += s1;
+      s1 += buf[3]; s2 += s1;
+      s1 += buf[4]; s2 += s1;
+      s1 += buf[5]; s2 += s1;
+      s1 += buf[6]; s2 += s1;
+      s1 += buf[7]; s2 += s1;
+    }
+    for (; n > 0; --n) {
+      s1 += *buf++;
+      s2 += s1;
+    }
+    s1 %= ADLER_BASE;
+    s2 %= ADLER_BASE;
+  }
+  return s1 | (s2 << 16);
+}
+
+#ifdef LZO_CHECKSUM_X86
+
+// CRC32 by folding 64 bytes at a time with carry-less multiplication, then reducing
+// with Barrett reduction. See "Fast CRC Computation for Generic Polynomials Using
+// PCLMULQDQ Instruction" (Intel, 2009). The constants are those of the paper for the
+// bit-reflected CRC32 polynomial. Requires len >= 64 and a multiple of 16.
+__attribute__((target("pclmul,sse4.1")))
+uint32_t Crc32Pclmul(uint32_t crc, const uint8_t* buf, int64_t len) {
+  alignas(16) static const uint64_t k1k2[] = { 0x0154442bd4, 0x01c6e41596 };
+  alignas(16) static const uint64_t k3k4[] = { 0x01751997d0, 0x00ccaa009e };
+  alignas(16) static const uint64_t k5k0[] = { 0x0163cd6124, 0x0000000000 };
+  alignas(16) static const uint64_t poly[] = { 0x01db710641, 0x01f7011641 };
+
+  __m128i x1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(buf));
+  __m128i x2 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(buf + 16));
+  __m128i x3 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(buf + 32));
+  __m128i x4 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(buf + 48));
+  x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(crc));
+  __m128i k = _mm_load_si128(reinterpret_cast<const __m128i*>(k1k2));
+  buf += 64;
+  len -= 64;
+
+  // Fold four 128-bit lanes in parallel.
+  while (len >= 64) {
+    __m128i x5 = _mm_clmulepi64_si128(x1, k, 0x00);
+    __m128i x6 = _mm_clmulepi64_si128(x2, k, 0x00);
+    __m128i x7 = _mm_clmulepi64_si128(x3, k, 0x00);
+    __m128i x8 = _mm_clmulepi64_si128(x4, k, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, k, 0x11);
+    x2 = _mm_clmulepi64_si128(x2, k, 0x11);
+    x3 = _mm_clmulepi64_si128(x3, k, 0x11);
+    x4 = _mm_clmulepi64_si128(x4, k, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x5),
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(buf)));
+    x2 = _mm_xor_si128(_mm_xor_si128(x2, x6),
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(buf + 16)));
+    x3 = _mm_xor_si128(_mm_xor_si128(x3, x7),
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(buf + 32)));
+    x4 = _mm_xor_si128(_mm_xor_si128(x4, x8),
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(buf + 48)));
+    buf += 64;
+    len -= 64;
+  }
+
+  // Fold the four lanes into one.
+  k = _mm_load_si128(reinterpret_cast<const __m128i*>(k3k4));
+  __m128i x5 = _mm_clmulepi64_si128(x1, k, 0x00);
+  x1 = _mm_clmulepi64_si128(x1, k, 0x11);
+  x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+  x5 = _mm_clmulepi64_si128(x1, k, 0x00);
+  x1 = _mm_clmulepi64_si128(x1, k, 0x11);
+  x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+  x5 = _mm_clmulepi64_si128(x1, k, 0x00);
+  x1 = _mm_clmulepi64_si128(x1, k, 0x11);
+  x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+  // Fold the remaining 16 byte blocks.
+  while (len >= 16) {
+    x2 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(buf));
+    x5 = _mm_clmulepi64_si128(x1, k, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, k, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+    buf += 16;
+    len -= 16;
+  }
+
+  // Fold 128 bits to 64 bits.
+  x2 = _mm_clmulepi64_si128(x1, k, 0x10);
+  x3 = _mm_setr_epi32(~0, 0, ~0, 0);
+  x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+  k = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(k5k0));
+  x2 = _mm_srli_si128(x1, 4);
+  x1 = _mm_and_si128(x1, x3);
+  x1 = _mm_clmulepi64_si128(x1, k, 0x00);
+  x1 = _mm_xor_si128(x1, x2);
+
+  // Barrett reduction to 32 bits.
+  k = _mm_load_si128(reinterpret_cast<const __m128i*>(poly));
+  x2 = _mm_and_si128(x1, x3);
+  x2 = _mm_clmulepi64_si128(x2, k, 0x10);
+  x2 = _mm_and_si128(x2, x3);
+  x2 = _mm_clmulepi64_si128(x2, k, 0x00);
+  x1 = _mm_xor_si128(x1, x2);
+  return _mm_extract_epi32(x1, 1);
+}
+
+uint32_t Crc32Accelerated(uint32_t crc, const uint8_t* buf, int64_t len) {
+  if (len >= 64) {
+    int64_t folded_len = len & ~static_cast<int64_t>(15);
+    crc = Crc32Pclmul(crc, buf, folded_len);
+    buf += folded_len;
+    len -= folded_len;
+  }
+  return Crc32Scalar(crc, buf, len);
+}
+
+// Adler32 of 32 byte blocks, with the sums of each block computed with SSSE3: s1 with
+// sums of absolute differences against zero and s2 with multiply-adds of the bytes by
+// their distance from the end of the block. 'ps' accumulates s1 at the start of each
+// block, which contributes 32 * s1 to s2.
+__attribute__((target("ssse3")))
+uint32_t Adler32Ssse3(uint32_t adler, const uint8_t* buf, int64_t len) {
+  const int BLOCK_SIZE = 32;
+  uint32_t s1 = adler & 0xffff;
+  uint32_t s2 = adler >> 16;
+  int64_t blocks = len / BLOCK_SIZE;
+  len -= blocks * BLOCK_SIZE;
+
+  const __m128i tap1 =
+      _mm_setr_epi8(32, 31, 30, 29, 28, 27, 26, 25, 24, 23, 22, 21, 20, 19, 18, 17);
+  const __m128i tap2 =
+      _mm_setr_epi8(16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1);
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i ones = _mm_set1_epi16(1);
+  while (blocks > 0) {
+    int n = ADLER_NMAX / BLOCK_SIZE;
+    if (n > blocks) n = blocks;
+    blocks -= n;
+
+    __m128i v_ps = _mm_set_epi32(0, 0, 0, s1 * n);
+    __m128i v_s2 = _mm_set_epi32(0, 0, 0, s2);
+    __m128i v_s1 = zero;
+    do {
+      __m128i bytes1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(buf));
+      __m128i bytes2 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(buf + 16));
+      v_ps = _mm_add_epi32(v_ps, v_s1);
+      v_s1 = _mm_add_epi32(v_s1, _mm_sad_epu8(bytes1, zero));
+      v_s2 = _mm_add_epi32(v_s2, _mm_madd_epi16(_mm_maddubs_epi16(bytes1, tap1), ones));
+      v_s1 = _mm_add_epi32(v_s1, _mm_sad_epu8(bytes2, zero));
+      v_s2 = _mm_add_epi32(v_s2, _mm_madd_epi16(_mm_maddubs_epi16(bytes2, tap2), ones));
+      buf += BLOCK_SIZE;
+    } while (--n);
+    v_s2 = _mm_add_epi32(v_s2, _mm_slli_epi32(v_ps, 5));
+
+    // Sum the lanes.
+    v_s1 = _mm_add_epi32(v_s1, _mm_shuffle_epi32(v_s1, _MM_SHUFFLE(1, 0, 3, 2)));
+    s1 += _mm_cvtsi128_si32(v_s1);
+    v_s2 = _mm_add_epi32(v_s2, _mm_shuffle_epi32(v_s2, _MM_SHUFFLE(2, 3, 0, 1)));
+    v_s2 = _mm_add_epi32(v_s2, _mm_shuffle_epi32(v_s2, _MM_SHUFFLE(1, 0, 3, 2)));
+    s2 = _mm_cvtsi128_si32(v_s2);
+    s1 %= ADLER_BASE;
+    s2 %= ADLER_BASE;
+  }
+  return Adler32Scalar(s1 | (s2 << 16), buf, len);
+}
+
+// Same as Adler32Ssse3(), with the 32 byte blocks in one 256-bit register.
+__attribute__((target("avx2")))
+uint32_t Adler32Avx2(uint32_t adler, const uint8_t* buf, int64_t len) {
+  const int BLOCK_SIZE = 32;
+  uint32_t s1 = adler & 0xffff;
+  uint32_t s2 = adler >> 16;
+  int64_t blocks = len / BLOCK_SIZE;
+  len -= blocks * BLOCK_SIZE;
+
+  const __m256i tap = _mm256_setr_epi8(32, 31, 30, 29, 28, 27, 26, 25, 24, 23, 22, 21,
+      20, 19, 18, 17, 16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1);
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i ones = _mm256_set1_epi16(1);
+  while (blocks > 0) {
+    int n = ADLER_NMAX / BLOCK_SIZE;
+    if (n > blocks) n = blocks;
+    blocks -= n;
+
+    __m256i v_ps = _mm256_setzero_si256();
+    __m256i v_s2 = _mm256_setzero_si256();
+    __m256i v_s1 = _mm256_setzero_si256();
+    uint32_t s1_start = s1 * n;
+    do {
+      __m256i bytes = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(buf));
+      v_ps = _mm256_add_epi32(v_ps, v_s1);
+      v_s1 = _mm256_add_epi32(v_s1, _mm256_sad_epu8(bytes, zero));
+      v_s2 = _mm256_add_epi32(
+          v_s2, _mm256_madd_epi16(_mm256_maddubs_epi16(bytes, tap), ones));
+      buf += BLOCK_SIZE;
+    } while (--n);
+    v_s2 = _mm256_add_epi32(v_s2, _mm256_slli_epi32(v_ps, 5));
+
+    // Sum the lanes.
+    __m128i s1_sum = _mm_add_epi32(
+        _mm256_castsi256_si128(v_s1), _mm256_extracti128_si256(v_s1, 1));
+    s1_sum = _mm_add_epi32(s1_sum, _mm_shuffle_epi32(s1_sum, _MM_SHUFFLE(1, 0, 3, 2)));
+    __m128i s2_sum = _mm_add_epi32(
+        _mm256_castsi256_si128(v_s2), _mm256_extracti128_si256(v_s2, 1));
+    s2_sum = _mm_add_epi32(s2_sum, _mm_shuffle_epi32(s2_sum, _MM_SHUFFLE(2, 3, 0, 1)));
+    s2_sum = _mm_add_epi32(s2_sum, _mm_shuffle_epi32(s2_sum, _MM_SHUFFLE(1, 0, 3, 2)));
+    s2 += _mm_cvtsi128_si32(s2_sum) + (s1_start << 5);
+    s1 += _mm_cvtsi128_si32(s1_sum);
+    s1 %= ADLER_BASE;
+    s2 %= ADLER_BASE;
+  }
+  return Adler32Scalar(s1 | (s2 << 16), buf, len);
+}
+
+#endif
+
+typedef uint32_t (*ChecksumFn)(uint32_t, const uint8_t*, int64_t);
+
+// The implementations in use, picked by the CPU's features.
+struct ChecksumImpls {
+  ChecksumFn crc32 = Crc32Scalar;
+  const char* crc32_name = "scalar";
+  ChecksumFn adler32 = Adler32Scalar;
+  const char* adler32_name = "scalar";
+
+  ChecksumImpls() {
+#ifdef LZO_CHECKSUM_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1")) {
+      crc32 = Crc32Accelerated;
+      crc32_name = "pclmul";
+    }
+    if (__builtin_cpu_supports("avx2")) {
+      adler32 = Adler32Avx2;
+      adler32_name = "avx2";
+    } else if (__builtin_cpu_supports("ssse3")) {
+      adler32 = Adler32Ssse3;
+      adler32_name = "ssse3";
+    }
+#endif
+  }
+};
+
+const ChecksumImpls impls;
+
+// Calls the CRC32 kernel FN, which works on the inverted CRC, like Crc32().
+template <ChecksumFn FN>
+uint32_t Crc32Of(uint32_t crc, const uint8_t* buf, int64_t len) {
+  return ~FN(~crc, buf, len);
+}
+
+}
+
+namespace impala {
+
+uint32_t LzoChecksumUtil::Crc32(uint32_t crc, const uint8_t* buf, int64_t len) {
+  return ~impls.crc32(~crc, buf, len);
+}
+
+uint32_t LzoChecksumUtil::Adler32(uint32_t adler, const uint8_t* buf, int64_t len) {
+  return impls.adler32(adler, buf, len);
+}
+
+uint32_t LzoChecksumUtil::Update(LzoChecksum type, uint32_t value, const uint8_t* buf,
+    int64_t len) {
+  switch (type) {
+    case CHECK_CRC32:
+      return Crc32(value, buf, len);
+    case CHECK_ADLER:
+      return Adler32(value, buf, len);
+    default:
+      return 0;
+  }
+}
+
+const char* LzoChecksumUtil::Crc32Implementation() {
+  return impls.crc32_name;
+}
+
+const char* LzoChecksumUtil::Adler32Implementation() {
+  return impls.adler32_name;
+}
+
+vector<LzoChecksumUtil::Implementation> LzoChecksumUtil::Crc32Implementations() {
+  vector<Implementation> result = { { "scalar", Crc32Of<Crc32Scalar> } };
+#ifdef LZO_CHECKSUM_X86
+  if (__builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1")) {
+    result.push_back({ "pclmul", Crc32Of<Crc32Accelerated> });
+  }
+#endif
+  return result;
+}
+
+vector<LzoChecksumUtil::Implementation> LzoChecksumUtil::Adler32Implementations() {
+  vector<Implementation> result = { { "scalar", Adler32Scalar } };
+#ifdef LZO_CHECKSUM_X86
+  if (__builtin_cpu_supports("ssse3")) result.push_back({ "ssse3", Adler32Ssse3 });
+  if (__builtin_cpu_supports("avx2")) result.push_back({ "avx2", Adler32Avx2 });
+#endif
+  return result;
+}
+
+}
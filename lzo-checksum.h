@@ -0,0 +1,66 @@
+// Copyright (c) 2012 Cloudera, Inc. All rights reserved.
+
+#ifndef IMPALA_LZO_CHECKSUM_H
+#define IMPALA_LZO_CHECKSUM_H
+
+#include <stdint.h>
+#include <vector>
+
+#include "lzo-file-header.h"
+
+namespace impala {
+
+// CRC32 and Adler32 checksums of lzop blocks. The results are the same as those of
+// lzo_crc32() and lzo_adler32() (and of zlib's crc32() and adler32()), but they are
+// computed with PCLMULQDQ carry-less multiplication for CRC32 and SSSE3 or AVX2 for
+// Adler32, if the CPU supports them. The implementation is picked once, at startup.
+//
+// All functions continue from a previous checksum value, so a buffer can be
+// checksummed in pieces, e.g. while it is being decompressed and is still in cache.
+class LzoChecksumUtil {
+ public:
+  // Initial values of the checksums, before any data.
+  static const uint32_t CRC32_INIT = 0;
+  static const uint32_t ADLER32_INIT = 1;
+
+  // Returns the initial value of checksums of type 'type'.
+  static uint32_t Init(LzoChecksum type) {
+    return type == CHECK_ADLER ? ADLER32_INIT : CRC32_INIT;
+  }
+
+  // Returns the checksum of type 'type' of the data checksummed by 'value' followed
+  // by 'len' bytes at 'buf'. Returns 0 for CHECK_NONE.
+  static uint32_t Update(LzoChecksum type, uint32_t value, const uint8_t* buf,
+      int64_t len);
+
+  // Returns the checksum of type 'type' of 'len' bytes at 'buf'.
+  static uint32_t Compute(LzoChecksum type, const uint8_t* buf, int64_t len) {
+    return Update(type, Init(type), buf, len);
+  }
+
+  // Returns the CRC32 of the data checksummed by 'crc' followed by 'len' bytes at
+  // 'buf'.
+  static uint32_t Crc32(uint32_t crc, const uint8_t* buf, int64_t len);
+
+  // Returns the Adler32 of the data checksummed by 'adler' followed by 'len' bytes at
+  // 'buf'.
+  static uint32_t Adler32(uint32_t adler, const uint8_t* buf, int64_t len);
+
+  // Returns the names of the CRC32 and Adler32 implementations in use, for logging.
+  static const char* Crc32Implementation();
+  static const char* Adler32Implementation();
+
+  // A CRC32 or Adler32 implementation, called like Crc32() or Adler32().
+  struct Implementation {
+    const char* name;
+    uint32_t (*fn)(uint32_t value, const uint8_t* buf, int64_t len);
+  };
+
+  // Returns every CRC32 and Adler32 implementation the CPU supports, including the
+  // scalar ones that are not in use, so that tests can compare them all.
+  static std::vector<Implementation> Crc32Implementations();
+  static std::vector<Implementation> Adler32Implementations();
+};
+
+}
+#endif
@@ -0,0 +1,169 @@
+// Copyright (c) 2012 Cloudera, Inc. All rights reserved.
+//
+// Compresses a local file into an lzop file with LzoWriter, on several threads, and
+// writes its index at the same time, so the file is splittable as soon as it is copied
+// into HDFS together with the index. The output is read by lzop and hadoop-lzo.
+//
+// Usage: lzo-compress [options] <input> [<output.lzo>]
+//   The output is <input>.lzo by default and the index is <output.lzo>.index.
+// Options:
+//   --threads=<n>         compression threads, the number of cores by default
+//   --block_size=<bytes>  uncompressed length of each block, 256KB by default
+//   --checksum=<type>     adler32 (the default), crc32 or none
+//   --line_delim=<c>      line delimiter counted in a version 2 index, '\n' by default
+//   --v2_index            write the version 2 index format instead of hadoop-lzo's,
+//                         for files that are read by Impala alone
+//   --no_index            do not write an index
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include <lzo/lzoconf.h>
+
+#include "lzo-format.h"
+#include "lzo-writer.h"
+
+using namespace impala;
+using namespace std;
+
+// Size of each read from the input.
+static const int READ_SIZE = 1024 * 1024;
+
+// Parses the value of option 'name' out of 'arg', if 'arg' is that option.
+static bool GetOption(const string& arg, const string& name, string* value) {
+  string prefix = "--" + name + "=";
+  if (arg.compare(0, prefix.size(), prefix) != 0) return false;
+  *value = arg.substr(prefix.size());
+  return true;
+}
+
+// Returns the delimiter character written as 'value', which may be an escape such as
+// '\t' or '\001'.
+static bool ParseDelimiter(const string& value, char* delim) {
+  if (value.size() == 1) {
+    *delim = value[0];
+    return true;
+  }
+  if (value == "\\t") {
+    *delim = '\t';
+  } else if (value == "\\n") {
+    *delim = '\n';
+  } else if (value.size() == 4 && value[0] == '\\') {
+    *delim = static_cast<char>(strtol(value.c_str() + 1, nullptr, 8));
+  } else {
+    return false;
+  }
+  return true;
+}
+
+static int Usage() {
+  cerr << "Usage: lzo-compress [--threads=<n>] [--block_size=<bytes>] "
+       << "[--checksum=adler32|crc32|none] [--line_delim=<c>] [--v2_index] "
+       << "[--no_index] <input> [<output.lzo>]" << endl;
+  return 1;
+}
+
+int main(int argc, char** argv) {
+  LzoWriter::Options options;
+  options.num_threads = thread::hardware_concurrency();
+  bool write_index = true;
+  vector<string> args;
+  for (int i = 1; i < argc; ++i) {
+    string arg = argv[i];
+    string value;
+    if (GetOption(arg, "threads", &value)) {
+      options.num_threads = atoi(value.c_str());
+      if (options.num_threads <= 0) return Usage();
+    } else if (GetOption(arg, "block_size", &value)) {
+      options.block_size = atoi(value.c_str());
+      if (options.block_size <= 0 || options.block_size > LzoFormat::MAX_BLOCK_SIZE) {
+        return Usage();
+      }
+    } else if (GetOption(arg, "checksum", &value)) {
+      if (value == "adler32") {
+        options.checksum = CHECK_ADLER;
+      } else if (value == "crc32") {
+        options.checksum = CHECK_CRC32;
+      } else if (value == "none") {
+        options.checksum = CHECK_NONE;
+      } else {
+        return Usage();
+      }
+    } else if (GetOption(arg, "line_delim", &value)) {
+      if (!ParseDelimiter(value, &options.line_delim)) return Usage();
+    } else if (arg == "--v2_index") {
+      options.v2_index = true;
+    } else if (arg == "--no_index") {
+      write_index = false;
+    } else if (arg.compare(0, 2, "--") == 0) {
+      return Usage();
+    } else {
+      args.push_back(arg);
+    }
+  }
+  if (args.empty() || args.size() > 2) return Usage();
+  if (lzo_init() != LZO_E_OK) {
+    cerr << "Could not initialize liblzo" << endl;
+    return 1;
+  }
+
+  const string& input_filename = args[0];
+  string output_filename = args.size() == 2 ? args[1] : input_filename + ".lzo";
+  ifstream in(input_filename.c_str(), ios::in | ios::binary);
+  if (!in.is_open()) {
+    cerr << "Could not open " << input_filename << ": " << strerror(errno) << endl;
+    return 1;
+  }
+  struct stat input_stat;
+  if (stat(input_filename.c_str(), &input_stat) == 0) options.mtime = input_stat.st_mtime;
+  size_t slash = input_filename.rfind('/');
+  options.name =
+      slash == string::npos ? input_filename : input_filename.substr(slash + 1);
+
+  ofstream out(output_filename.c_str(), ios::out | ios::binary | ios::trunc);
+  if (!out.is_open()) {
+    cerr << "Could not create " << output_filename << ": " << strerror(errno) << endl;
+    return 1;
+  }
+  string index_filename = output_filename + ".index";
+  unique_ptr<ofstream> index_out;
+  if (write_index) {
+    index_out.reset(new ofstream(index_filename.c_str(),
+        ios::out | ios::binary | ios::trunc));
+    if (!index_out->is_open()) {
+      cerr << "Could not create " << index_filename << ": " << strerror(errno) << endl;
+      return 1;
+    }
+  }
+
+  LzoWriter writer(options, &out, index_out.get());
+  vector<char> buffer(READ_SIZE);
+  string error;
+  while (in) {
+    in.read(buffer.data(), buffer.size());
+    if (!writer.Write(reinterpret_cast<const uint8_t*>(buffer.data()), in.gcount(),
+            &error)) {
+      cerr << output_filename << ": " << error << endl;
+      return 1;
+    }
+  }
+  if (in.bad()) {
+    cerr << "Could not read " << input_filename << ": " << strerror(errno) << endl;
+    return 1;
+  }
+  if (!writer.Close(&error)) {
+    cerr << output_filename << ": " << error << endl;
+    return 1;
+  }
+  cout << "Wrote " << writer.num_blocks() << " blocks to " << output_filename;
+  if (write_index) cout << " and its index to " << index_filename;
+  cout << endl;
+  return 0;
+}
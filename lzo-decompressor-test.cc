@@ -0,0 +1,201 @@
+// Copyright (c) 2012 Cloudera, Inc. All rights reserved.
+
+#include <stdlib.h>
+#include <algorithm>
+#include <set>
+#include <string>
+#include <vector>
+#include <gtest/gtest.h>
+#include <lzo/lzoconf.h>
+#include <lzo/lzo1x.h>
+
+#include "lzo-decompressor.h"
+
+using namespace impala;
+using namespace std;
+
+namespace impala {
+
+// Returns 'len' bytes of: random bytes, which do not compress; repeated words, which
+// compress into matches of all lengths and distances with short literal runs between
+// them; or runs of a single byte, which compress into overlapping matches.
+static vector<uint8_t> MakeData(int kind, int64_t len) {
+  static const char* const WORDS[] = { "impala", "lzo", "block", "\n", "hdfs", ",",
+      "scanner", "0123456789", "a", " " };
+  vector<uint8_t> data;
+  while (data.size() < len) {
+    if (kind == 0) {
+      data.push_back(rand());
+    } else if (kind == 1) {
+      for (const char* c = WORDS[rand() % 10]; *c != '\0'; ++c) data.push_back(*c);
+      if (rand() % 8 == 0) data.push_back(rand());
+    } else {
+      data.insert(data.end(), 1 + rand() % 1000, rand() % 2 == 0 ? 0 : rand());
+    }
+  }
+  data.resize(len);
+  return data;
+}
+
+// Returns 'data' compressed with liblzo's lzo1x_1_compress().
+static vector<uint8_t> Compress(const vector<uint8_t>& data) {
+  vector<uint8_t> work_mem(LZO1X_1_MEM_COMPRESS);
+  vector<uint8_t> compressed(data.size() + data.size() / 16 + 64 + 3);
+  lzo_uint compressed_len;
+  EXPECT_EQ(lzo1x_1_compress(data.data(), data.size(), compressed.data(),
+      &compressed_len, work_mem.data()), LZO_E_OK);
+  compressed.resize(compressed_len);
+  return compressed;
+}
+
+// The input of every test, made once: data of every kind and of lengths around those
+// that change the first instruction of the stream.
+class LzoDecompressorTest : public testing::Test {
+ protected:
+  static void SetUpTestCase() {
+    srand(1);
+    for (int kind = 0; kind < 3; ++kind) {
+      for (int64_t len : { 0, 1, 3, 4, 17, 18, 100, 1000, 65536, 256 * 1024 }) {
+        data_.push_back(MakeData(kind, len));
+        compressed_.push_back(Compress(data_.back()));
+      }
+    }
+  }
+
+  static vector<vector<uint8_t>> data_;
+  static vector<vector<uint8_t>> compressed_;
+};
+
+vector<vector<uint8_t>> LzoDecompressorTest::data_;
+vector<vector<uint8_t>> LzoDecompressorTest::compressed_;
+
+// Byte written after the output buffers, to check that it is not overwritten.
+static const uint8_t GUARD = 0xa5;
+
+TEST_F(LzoDecompressorTest, RoundTrip) {
+  for (int i = 0; i < data_.size(); ++i) {
+    const vector<uint8_t>& data = data_[i];
+    const vector<uint8_t>& compressed = compressed_[i];
+    // With and without slack, which decides which copies are wide.
+    for (int64_t slack : { 0, LzoDecompressor::OUTPUT_SLACK }) {
+      vector<uint8_t> out(data.size() + slack + 64, GUARD);
+      int64_t out_len;
+      ASSERT_EQ(LzoDecompressor::Decompress(compressed.data(), compressed.size(),
+          out.data(), data.size(), slack, &out_len), LzoDecompressor::OK)
+          << "data " << i << " slack " << slack;
+      ASSERT_EQ(out_len, data.size());
+      ASSERT_TRUE(equal(data.begin(), data.end(), out.begin())) << "data " << i;
+      for (int64_t j = data.size() + slack; j < out.size(); ++j) {
+        ASSERT_EQ(out[j], GUARD) << "data " << i << " wrote past the slack";
+      }
+    }
+  }
+}
+
+// Every truncation of a stream is an error, and output is never written past the
+// buffer.
+TEST_F(LzoDecompressorTest, TruncatedInput) {
+  for (int i = 0; i < data_.size(); ++i) {
+    const vector<uint8_t>& data = data_[i];
+    const vector<uint8_t>& compressed = compressed_[i];
+    int64_t step = max<int64_t>(1, compressed.size() / 500);
+    for (int64_t len = 0; len < compressed.size(); len += step) {
+      // A copy of exactly 'len' bytes, so reads past it are caught by sanitizers.
+      vector<uint8_t> truncated(compressed.begin(), compressed.begin() + len);
+      vector<uint8_t> out(data.size() + 64, GUARD);
+      int64_t out_len;
+      LzoDecompressor::Result result = LzoDecompressor::Decompress(truncated.data(), len,
+          out.data(), data.size(), 0, &out_len);
+      ASSERT_NE(result, LzoDecompressor::OK) << "data " << i << " length " << len;
+      ASSERT_LE(out_len, data.size());
+      for (int64_t j = data.size(); j < out.size(); ++j) ASSERT_EQ(out[j], GUARD);
+    }
+  }
+}
+
+// A stream that decompresses to more than 'max_out_len' bytes is an error, whatever the
+// slack.
+TEST_F(LzoDecompressorTest, OutputOverrun) {
+  for (int i = 0; i < data_.size(); ++i) {
+    const vector<uint8_t>& data = data_[i];
+    const vector<uint8_t>& compressed = compressed_[i];
+    int64_t len = data.size();
+    if (len == 0) continue;
+    for (int64_t max_out_len : { 0L, len / 2, len - 1 }) {
+      vector<uint8_t> out(data.size() + LzoDecompressor::OUTPUT_SLACK);
+      int64_t out_len;
+      EXPECT_EQ(LzoDecompressor::Decompress(compressed.data(), compressed.size(),
+          out.data(), max_out_len, LzoDecompressor::OUTPUT_SLACK, &out_len),
+          LzoDecompressor::OUTPUT_OVERRUN) << "data " << i << " max " << max_out_len;
+      EXPECT_LE(out_len, max_out_len);
+    }
+  }
+}
+
+// A match that refers to bytes before the start of the output is an error.
+TEST_F(LzoDecompressorTest, LookbehindOverrun) {
+  // A literal run of 'a', then a match of 3 bytes at a distance of 2048 and the end of
+  // stream marker.
+  const uint8_t stream[] = { 18, 'a', 0x5c, 0xff, 0x11, 0, 0 };
+  vector<uint8_t> out(100);
+  int64_t out_len;
+  EXPECT_EQ(LzoDecompressor::Decompress(stream, sizeof(stream), out.data(), 100, 0,
+      &out_len), LzoDecompressor::LOOKBEHIND_OVERRUN);
+  LzoDecompressor::State state;
+  EXPECT_EQ(LzoDecompressor::DecompressChunk(stream, sizeof(stream), out.data(), 100, 0,
+      100, &state), LzoDecompressor::LOOKBEHIND_OVERRUN);
+}
+
+// Input left after the end of stream marker is an error.
+TEST_F(LzoDecompressorTest, InputNotConsumed) {
+  vector<uint8_t> compressed = compressed_[5];
+  compressed.push_back(0);
+  vector<uint8_t> out(data_[5].size());
+  int64_t out_len;
+  EXPECT_EQ(LzoDecompressor::Decompress(compressed.data(), compressed.size(),
+      out.data(), out.size(), 0, &out_len), LzoDecompressor::INPUT_NOT_CONSUMED);
+}
+
+// Decompressing in chunks, resuming at every kind of instruction boundary, gives the
+// same output as Decompress().
+TEST_F(LzoDecompressorTest, Chunked) {
+  set<int> resume_points;
+  for (int i = 0; i < data_.size(); ++i) {
+    const vector<uint8_t>& data = data_[i];
+    const vector<uint8_t>& compressed = compressed_[i];
+    // Chunks of at least one byte, which pause at every instruction, and chunks of
+    // random lengths.
+    for (bool random_step : { false, true }) {
+      vector<uint8_t> out(data.size() + LzoDecompressor::OUTPUT_SLACK);
+      LzoDecompressor::State state;
+      LzoDecompressor::Result result = LzoDecompressor::PAUSED;
+      int64_t out_limit = 0;
+      while (result == LzoDecompressor::PAUSED) {
+        out_limit += random_step ? 1 + rand() % 5000 : 1;
+        int64_t prev_out_pos = state.out_pos;
+        result = LzoDecompressor::DecompressChunk(compressed.data(), compressed.size(),
+            out.data(), data.size(), LzoDecompressor::OUTPUT_SLACK, out_limit, &state);
+        ASSERT_GE(state.out_pos, prev_out_pos);
+        if (result == LzoDecompressor::PAUSED) {
+          ASSERT_GE(state.out_pos, out_limit);
+          resume_points.insert(state.resume_point);
+        }
+        // The output so far is final.
+        ASSERT_TRUE(equal(out.begin() + prev_out_pos, out.begin() + state.out_pos,
+            data.begin() + prev_out_pos)) << "data " << i << " at " << prev_out_pos;
+      }
+      ASSERT_EQ(result, LzoDecompressor::OK) << "data " << i;
+      ASSERT_EQ(state.out_pos, data.size());
+    }
+  }
+  // Before a token, after a literal run and after the literals of a match.
+  EXPECT_EQ(resume_points.size(), 3);
+}
+
+}
+
+int main(int argc, char** argv) {
+  if (lzo_init() != LZO_E_OK) return 1;
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
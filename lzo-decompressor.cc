@@ -0,0 +1,303 @@
+// Copyright (c) 2012 Cloudera, Inc. All rights reserved.
+// The decoding follows lzo1x_d.ch from the LZO library, which is:
+//   Copyright (C) 1996-2010 Markus Franz Xaver Johannes Oberhumer
+//   All Rights Reserved.
+//   Distributed under the terms of the GNU General Public License, version 2 or later.
+
+#include "lzo-decompressor.h"
+
+#include <string.h>
+
+using namespace impala;
+using namespace std;
+
+#define LZO_LIKELY(x) __builtin_expect(!!(x), 1)
+#define LZO_UNLIKELY(x) __builtin_expect(!!(x), 0)
+
+// Bounds checks. The same checks as lzo1x_decompress_safe() are made at the same
+// points, so the same streams are rejected.
+#define NEED_IP(n) if (LZO_UNLIKELY(ip_end - ip < static_cast<int64_t>(n))) \
+    goto input_overrun
+#define NEED_OP(n) if (LZO_UNLIKELY(op_end - op < static_cast<int64_t>(n))) \
+    goto output_overrun
+#define TEST_LB(m_pos) if (LZO_UNLIKELY((m_pos) < out)) goto lookbehind_overrun
+
+// Pauses a chunked decompression once enough output has been produced. 'point' is
+// where to resume.
+#define PAUSE_POINT(point) \
+  if (CHUNKED && op - out >= out_limit) { \
+    state->in_pos = ip - in; \
+    state->resume_point = point; \
+    *out_len = op - out; \
+    return PAUSED; \
+  }
+
+// Values of State::resume_point: before the token of a literal run or a match, after a
+// literal run and after the literals following a match.
+enum ResumePoint {
+  RESUME_START = 0,
+  RESUME_NEXT_TOKEN,
+  RESUME_AFTER_LITERAL_RUN,
+  RESUME_AFTER_MATCH_LITERALS,
+};
+
+// Largest distance of an M2 match, and the distance added to M4 matches.
+static const int M2_MAX_OFFSET = 0x0800;
+static const int M4_BASE_OFFSET = 0x4000;
+
+// Copies 'len' bytes from 'src' to 'dst', in 16 byte chunks that may copy up to 15
+// bytes too many. The buffers must not overlap.
+static inline void WildCopy16(uint8_t* dst, const uint8_t* src, int64_t len) {
+  uint8_t* end = dst + len;
+  do {
+    memcpy(dst, src, 16);
+    dst += 16;
+    src += 16;
+  } while (dst < end);
+}
+
+// Copies 'len' bytes of a match from 'src' to 'dst', where 'src' is at least 8 bytes
+// behind 'dst', in 8 byte chunks that may copy up to 7 bytes too many.
+static inline void WildCopy8(uint8_t* dst, const uint8_t* src, int64_t len) {
+  uint8_t* end = dst + len;
+  do {
+    memcpy(dst, src, 8);
+    dst += 8;
+    src += 8;
+  } while (dst < end);
+}
+
+// Copies the 'len' literals at 'ip' to 'op' and advances both. The caller has checked
+// both buffers have room for 'len' bytes.
+static inline void CopyLiterals(uint8_t*& op, const uint8_t*& ip, int64_t len,
+    const uint8_t* op_slack_end, const uint8_t* ip_end) {
+  if (LZO_LIKELY(op_slack_end - op >= len + 15 && ip_end - ip >= len + 15)) {
+    WildCopy16(op, ip, len);
+  } else {
+    memcpy(op, ip, len);
+  }
+  op += len;
+  ip += len;
+}
+
+// Copies a match of 'len' bytes starting at 'm_pos' to 'op', which may overlap it,
+// and advances 'op'. The caller has checked the output has room for 'len' bytes.
+static inline void CopyMatch(uint8_t*& op, const uint8_t* m_pos, int64_t len,
+    const uint8_t* op_slack_end) {
+  int64_t distance = op - m_pos;
+  if (LZO_LIKELY(op_slack_end - op >= len + 15)) {
+    if (distance >= 16) {
+      WildCopy16(op, m_pos, len);
+      op += len;
+      return;
+    } else if (distance >= 8) {
+      WildCopy8(op, m_pos, len);
+      op += len;
+      return;
+    }
+  }
+  if (distance == 1) {
+    // A run of one byte.
+    memset(op, *m_pos, len);
+    op += len;
+    return;
+  }
+  uint8_t* end = op + len;
+  do {
+    *op++ = *m_pos++;
+  } while (op < end);
+}
+
+namespace impala {
+
+LzoDecompressor::Result LzoDecompressor::Decompress(const uint8_t* in, int64_t in_len,
+    uint8_t* out, int64_t max_out_len, int64_t slack, int64_t* out_len) {
+  return DecompressImpl<false>(in, in_len, out, max_out_len, slack, 0, nullptr, out_len);
+}
+
+LzoDecompressor::Result LzoDecompressor::DecompressChunk(const uint8_t* in,
+    int64_t in_len, uint8_t* out, int64_t max_out_len, int64_t slack, int64_t out_limit,
+    State* state) {
+  return DecompressImpl<true>(
+      in, in_len, out, max_out_len, slack, out_limit, state, &state->out_pos);
+}
+
+template <bool CHUNKED>
+LzoDecompressor::Result LzoDecompressor::DecompressImpl(const uint8_t* in,
+    int64_t in_len, uint8_t* out, int64_t max_out_len, int64_t slack, int64_t out_limit,
+    State* state, int64_t* out_len) {
+  const uint8_t* ip = in;
+  const uint8_t* const ip_end = in + in_len;
+  uint8_t* op = out;
+  uint8_t* const op_end = out + max_out_len;
+  const uint8_t* const op_slack_end = op_end + slack;
+  const uint8_t* m_pos;
+  int64_t t;
+  Result result;
+
+  if (CHUNKED && state->resume_point != RESUME_START) {
+    ip = in + state->in_pos;
+    op = out + state->out_pos;
+    switch (state->resume_point) {
+      case RESUME_NEXT_TOKEN: goto next_token;
+      case RESUME_AFTER_LITERAL_RUN: goto first_literal_run;
+      case RESUME_AFTER_MATCH_LITERALS: goto match_literals_done;
+      default: return ERROR;
+    }
+  }
+
+  NEED_IP(1);
+  if (*ip > 17) {
+    // The stream starts with a literal run.
+    t = *ip++ - 17;
+    if (t < 4) goto match_next;
+    NEED_OP(t);
+    NEED_IP(t + 3);
+    CopyLiterals(op, ip, t, op_slack_end, ip_end);
+    goto first_literal_run;
+  }
+
+  while (true) {
+    PAUSE_POINT(RESUME_NEXT_TOKEN);
+next_token:
+    NEED_IP(3);
+    t = *ip++;
+    if (t >= 16) goto match;
+
+    // A literal run of t + 3 bytes. A 0 is followed by an extended length.
+    if (t == 0) {
+      while (*ip == 0) {
+        t += 255;
+        ++ip;
+        NEED_IP(1);
+      }
+      t += 15 + *ip++;
+    }
+    NEED_OP(t + 3);
+    NEED_IP(t + 6);
+    CopyLiterals(op, ip, t + 3, op_slack_end, ip_end);
+    PAUSE_POINT(RESUME_AFTER_LITERAL_RUN);
+
+first_literal_run:
+    // Right after a literal run of 4 or more bytes, a token below 16 is a 3 byte
+    // match at a distance of more than M2_MAX_OFFSET.
+    t = *ip++;
+    if (t >= 16) goto match;
+    m_pos = op - (1 + M2_MAX_OFFSET);
+    m_pos -= t >> 2;
+    m_pos -= *ip++ << 2;
+    TEST_LB(m_pos);
+    NEED_OP(3);
+    op[0] = m_pos[0];
+    op[1] = m_pos[1];
+    op[2] = m_pos[2];
+    op += 3;
+    goto match_done;
+
+    while (true) {
+match:
+      if (t >= 64) {
+        // M2: length 3 to 8, distance up to M2_MAX_OFFSET.
+        m_pos = op - 1;
+        m_pos -= (t >> 2) & 7;
+        m_pos -= *ip++ << 3;
+        t = (t >> 5) - 1;
+        TEST_LB(m_pos);
+        NEED_OP(t + 2);
+        CopyMatch(op, m_pos, t + 2, op_slack_end);
+        goto match_done;
+      } else if (t >= 32) {
+        // M3: distance up to 16KB.
+        t &= 31;
+        if (t == 0) {
+          while (*ip == 0) {
+            t += 255;
+            ++ip;
+            NEED_IP(1);
+          }
+          t += 31 + *ip++;
+          NEED_IP(2);
+        }
+        m_pos = op - 1;
+        m_pos -= (ip[0] >> 2) + (ip[1] << 6);
+        ip += 2;
+      } else if (t >= 16) {
+        // M4: distance from 16KB to 48KB, or the end of the stream.
+        m_pos = op;
+        m_pos -= (t & 8) << 11;
+        t &= 7;
+        if (t == 0) {
+          while (*ip == 0) {
+            t += 255;
+            ++ip;
+            NEED_IP(1);
+          }
+          t += 7 + *ip++;
+          NEED_IP(2);
+        }
+        m_pos -= (ip[0] >> 2) + (ip[1] << 6);
+        ip += 2;
+        if (m_pos == op) goto eof_found;
+        m_pos -= M4_BASE_OFFSET;
+      } else {
+        // M1: right after 1 to 3 literals, a 2 byte match at a short distance.
+        m_pos = op - 1;
+        m_pos -= t >> 2;
+        m_pos -= *ip++ << 2;
+        TEST_LB(m_pos);
+        NEED_OP(2);
+        op[0] = m_pos[0];
+        op[1] = m_pos[1];
+        op += 2;
+        goto match_done;
+      }
+
+      // M3 and M4 matches are t + 2 bytes long.
+      TEST_LB(m_pos);
+      NEED_OP(t + 2);
+      CopyMatch(op, m_pos, t + 2, op_slack_end);
+
+match_done:
+      // The low two bits of the byte before last give the number of literals that
+      // follow the match. With none, the next token starts a literal run or a match.
+      t = ip[-2] & 3;
+      if (t == 0) break;
+
+match_next:
+      NEED_OP(t);
+      NEED_IP(t + 3);
+      if (LZO_LIKELY(op_slack_end - op >= 4 && ip_end - ip >= 4)) {
+        memcpy(op, ip, 4);
+        op += t;
+        ip += t;
+      } else {
+        do {
+          *op++ = *ip++;
+        } while (--t > 0);
+      }
+      PAUSE_POINT(RESUME_AFTER_MATCH_LITERALS);
+
+match_literals_done:
+      t = *ip++;
+    }
+  }
+
+eof_found:
+  result = ip == ip_end ? OK : (ip < ip_end ? INPUT_NOT_CONSUMED : INPUT_OVERRUN);
+  *out_len = op - out;
+  return result;
+
+input_overrun:
+  *out_len = op - out;
+  return INPUT_OVERRUN;
+
+output_overrun:
+  *out_len = op - out;
+  return OUTPUT_OVERRUN;
+
+lookbehind_overrun:
+  *out_len = op - out;
+  return LOOKBEHIND_OVERRUN;
+}
+
+}
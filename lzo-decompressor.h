@@ -0,0 +1,72 @@
+// Copyright (c) 2012 Cloudera, Inc. All rights reserved.
+
+#ifndef IMPALA_LZO_DECOMPRESSOR_H
+#define IMPALA_LZO_DECOMPRESSOR_H
+
+#include <stdint.h>
+
+namespace impala {
+
+// LZO1X decompressor, as an alternative to liblzo's lzo1x_decompress_safe(). The output
+// of a valid stream is the same, byte for byte, and like lzo1x_decompress_safe() it
+// never reads or writes outside of the buffers it is given, whatever the input.
+//
+// It is faster because literals and matches are copied 8 or 16 bytes at a time, which
+// may write past the end of the data being copied. Those copies are used wherever the
+// bytes written past the end are still within the output buffer, so callers that
+// allocate OUTPUT_SLACK bytes past the decompressed length get wide copies up to the
+// end of the block. Reads of the input never go past its end.
+class LzoDecompressor {
+ public:
+  // Return codes of Decompress(). These are the values of the LZO_E_* codes returned by
+  // liblzo for the same errors.
+  enum Result {
+    OK = 0,
+    ERROR = -1,
+    INPUT_OVERRUN = -4,
+    OUTPUT_OVERRUN = -5,
+    LOOKBEHIND_OVERRUN = -6,
+    EOF_NOT_FOUND = -7,
+    INPUT_NOT_CONSUMED = -8,
+    // Not an liblzo code. DecompressChunk() stopped before the end of the stream.
+    PAUSED = 1,
+  };
+
+  // Where DecompressChunk() resumes a paused decompression.
+  struct State {
+    int64_t in_pos = 0;
+    int64_t out_pos = 0;
+    // Which kind of instruction is next. 0 if decompression has not started.
+    int resume_point = 0;
+  };
+
+  // Bytes past the end of the output that, if allocated, let every copy be a wide
+  // copy.
+  static const int OUTPUT_SLACK = 16;
+
+  // Decompresses the 'in_len' bytes at 'in' into 'out'. At most 'max_out_len' bytes of
+  // output are produced; a stream that decompresses to more returns OUTPUT_OVERRUN.
+  // The 'slack' bytes after 'out' + 'max_out_len' may be overwritten with garbage.
+  // Sets *out_len to the number of bytes produced, also on error.
+  static Result Decompress(const uint8_t* in, int64_t in_len, uint8_t* out,
+      int64_t max_out_len, int64_t slack, int64_t* out_len);
+
+  // Decompresses like Decompress(), but returns PAUSED at the first instruction boundary
+  // with at least 'out_limit' bytes of output, so the output can be consumed while it
+  // is still in cache. *state records where the decompression stopped and must be
+  // passed, with the same 'in', 'out' and lengths and a larger 'out_limit', to the next
+  // call to continue. Matches may refer to all earlier output, so 'out' holds the whole
+  // decompressed stream. Sets state->out_pos to the number of bytes produced, also on
+  // error. Bytes after state->out_pos may be overwritten with garbage.
+  static Result DecompressChunk(const uint8_t* in, int64_t in_len, uint8_t* out,
+      int64_t max_out_len, int64_t slack, int64_t out_limit, State* state);
+
+ private:
+  template <bool CHUNKED>
+  static Result DecompressImpl(const uint8_t* in, int64_t in_len, uint8_t* out,
+      int64_t max_out_len, int64_t slack, int64_t out_limit, State* state,
+      int64_t* out_len);
+};
+
+}
+#endif
@@ -0,0 +1,56 @@
+// Copyright (c) 2012 Cloudera, Inc. All rights reserved.
+
+#ifndef IMPALA_LZO_FILE_HEADER_H
+#define IMPALA_LZO_FILE_HEADER_H
+
+#include <stdint.h>
+#include <memory>
+#include <vector>
+
+#include "lzo-block-offsets.h"
+#include "lzo-zone-map.h"
+
+namespace impala {
+
+// Checksums lzop can store for the compressed and uncompressed data of each block.
+enum LzoChecksum {
+  CHECK_NONE,
+  CHECK_CRC32,
+  CHECK_ADLER
+};
+
+// Header informatation, shared by all scanners on a file. Once the header and index
+// of a file have been read it is not modified, so it can also be shared by later
+// queries through LzoHeaderCache.
+struct LzoFileHeader {
+  LzoChecksum input_checksum_type_;
+  LzoChecksum output_checksum_type_;
+
+  uint32_t header_size_;
+
+  // Uncompressed length of the first block. lzop uses the same length for every
+  // block but the last. 0 if the first block header was not read with the header.
+  int32_t block_size_ = 0;
+
+  // Offsets to compressed blocks.
+  LzoBlockOffsets offsets;
+
+  // Uncompressed length and number of line delimiters of each block in 'offsets', if
+  // the file has a version 2 index. Empty if it has a hadoop-lzo index or none.
+  std::vector<int32_t> uncompressed_lens;
+  std::vector<int32_t> line_counts;
+
+  // The line delimiter counted in 'line_counts'.
+  char line_delim = '\n';
+
+  // Length of the file's hadoop-lzo index, if its offsets were left out of 'offsets'
+  // for each scanner to read the part its range needs, see --lzo_lazy_index_min_bytes.
+  // 0 otherwise.
+  int64_t lazy_index_len = 0;
+
+  // Zone map of the file, if --lzo_zone_maps is set and the file has a current one.
+  std::shared_ptr<const LzoZoneMap> zone_map;
+};
+
+}
+#endif
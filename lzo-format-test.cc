@@ -0,0 +1,395 @@
+// Copyright (c) 2012 Cloudera, Inc. All rights reserved.
+
+#include <stdlib.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include <gtest/gtest.h>
+
+#include "lzo-format.h"
+
+using namespace impala;
+using namespace std;
+
+namespace impala {
+
+static const uint8_t* Bytes(const string& data) {
+  return reinterpret_cast<const uint8_t*>(data.data());
+}
+
+static void PutInt32(uint32_t value, string* out) {
+  for (int i = 3; i >= 0; --i) out->push_back(static_cast<char>(value >> (8 * i)));
+}
+
+// Returns the header of a file with checksums of type 'checksum', followed by the
+// lengths of a first block of 'block_size' bytes if it is positive.
+static string MakeHeader(LzoChecksum checksum, int32_t block_size) {
+  string file;
+  LzoFormat::SerializeHeader(checksum, "data.csv", 1234567890, &file);
+  if (block_size > 0) {
+    PutInt32(block_size, &file);
+    PutInt32(block_size / 2, &file);
+  }
+  return file;
+}
+
+TEST(LzoFormatTest, ParseHeader) {
+  for (LzoChecksum checksum : { CHECK_NONE, CHECK_CRC32, CHECK_ADLER }) {
+    string file = MakeHeader(checksum, 256 * 1024);
+    LzoFileHeader header;
+    string error;
+    ASSERT_TRUE(LzoFormat::ParseHeader(Bytes(file), file.size(), &header, &error))
+        << error;
+    EXPECT_EQ(header.input_checksum_type_, checksum);
+    EXPECT_EQ(header.output_checksum_type_, checksum);
+    EXPECT_EQ(header.header_size_, file.size() - LzoFormat::BLOCK_LENGTHS_SIZE);
+    EXPECT_EQ(header.block_size_, 256 * 1024);
+  }
+
+  // The first block's length is only known if it was read with the header.
+  string file = MakeHeader(CHECK_ADLER, 0);
+  LzoFileHeader header;
+  string error;
+  ASSERT_TRUE(LzoFormat::ParseHeader(Bytes(file), file.size(), &header, &error))
+      << error;
+  EXPECT_EQ(header.header_size_, file.size());
+  EXPECT_EQ(header.block_size_, 0);
+}
+
+TEST(LzoFormatTest, ParseHeaderErrors) {
+  string valid = MakeHeader(CHECK_ADLER, 0);
+  LzoFileHeader header;
+  string error;
+
+  EXPECT_FALSE(LzoFormat::ParseHeader(Bytes(valid), LzoFormat::MIN_HEADER_SIZE - 1,
+      &header, &error));
+  EXPECT_NE(error.find("too short"), string::npos) << error;
+
+  string file = valid;
+  file[1] = 'X';
+  EXPECT_FALSE(LzoFormat::ParseHeader(Bytes(file), file.size(), &header, &error));
+  EXPECT_NE(error.find("LZOP_MAGIC"), string::npos) << error;
+
+  // A later lzop version.
+  file = valid;
+  file[sizeof(LzoFormat::MAGIC)] = 0x7f;
+  EXPECT_FALSE(LzoFormat::ParseHeader(Bytes(file), file.size(), &header, &error));
+  EXPECT_NE(error.find("later version"), string::npos) << error;
+
+  // A corrupt file name fails the header checksum.
+  file = valid;
+  file[file.size() - sizeof(int32_t) - 1] ^= 1;
+  EXPECT_FALSE(LzoFormat::ParseHeader(Bytes(file), file.size(), &header, &error));
+  EXPECT_NE(error.find("header checksum"), string::npos) << error;
+
+  // Cut off in the header checksum.
+  EXPECT_FALSE(LzoFormat::ParseHeader(Bytes(valid), valid.size() - 2, &header,
+      &error));
+}
+
+TEST(LzoFormatTest, ParseBlock) {
+  LzoFileHeader header;
+  header.input_checksum_type_ = CHECK_CRC32;
+  header.output_checksum_type_ = CHECK_CRC32;
+
+  // A compressed block has both checksums.
+  string data;
+  PutInt32(100, &data);
+  PutInt32(10, &data);
+  PutInt32(0x11111111, &data);
+  PutInt32(0x22222222, &data);
+  data.append(10, 'x');
+  PutInt32(0, &data);
+  LzoFormat::Block block;
+  string error;
+  ASSERT_TRUE(LzoFormat::ParseBlock(header, Bytes(data), data.size(), &block, &error))
+      << error;
+  EXPECT_EQ(block.uncompressed_len, 100);
+  EXPECT_EQ(block.compressed_len, 10);
+  EXPECT_EQ(block.out_checksum, 0x11111111);
+  EXPECT_EQ(block.in_checksum, 0x22222222);
+  EXPECT_EQ(block.header_len, 16);
+  EXPECT_EQ(block.data, Bytes(data) + 16);
+  EXPECT_FALSE(block.stored());
+
+  // Then the end of file marker.
+  int64_t next = block.header_len + block.compressed_len;
+  ASSERT_TRUE(LzoFormat::ParseBlock(header, Bytes(data) + next, data.size() - next,
+      &block, &error)) << error;
+  EXPECT_EQ(block.uncompressed_len, 0);
+
+  // A stored block has only the checksum of the uncompressed data.
+  data.clear();
+  PutInt32(10, &data);
+  PutInt32(10, &data);
+  PutInt32(0x33333333, &data);
+  data.append(10, 'y');
+  ASSERT_TRUE(LzoFormat::ParseBlock(header, Bytes(data), data.size(), &block, &error))
+      << error;
+  EXPECT_TRUE(block.stored());
+  EXPECT_EQ(block.header_len, 12);
+  EXPECT_EQ(block.in_checksum, 0x33333333);
+
+  // Without checksums, only the lengths precede the data.
+  LzoFileHeader no_checksums;
+  no_checksums.input_checksum_type_ = CHECK_NONE;
+  no_checksums.output_checksum_type_ = CHECK_NONE;
+  ASSERT_TRUE(LzoFormat::ParseBlock(no_checksums, Bytes(data), data.size(), &block,
+      &error)) << error;
+  EXPECT_EQ(block.header_len, static_cast<int>(LzoFormat::BLOCK_LENGTHS_SIZE));
+}
+
+TEST(LzoFormatTest, ParseBlockErrors) {
+  LzoFileHeader header;
+  header.input_checksum_type_ = CHECK_ADLER;
+  header.output_checksum_type_ = CHECK_ADLER;
+  LzoFormat::Block block;
+  string error;
+
+  string data;
+  PutInt32(100, &data);
+  EXPECT_FALSE(LzoFormat::ParseBlock(header, Bytes(data), data.size(), &block, &error));
+  EXPECT_NE(error.find("Truncated"), string::npos) << error;
+
+  // Compressed to more than the uncompressed length.
+  PutInt32(101, &data);
+  data.append(200, 'z');
+  EXPECT_FALSE(LzoFormat::ParseBlock(header, Bytes(data), data.size(), &block, &error));
+  EXPECT_NE(error.find("Invalid compressed length"), string::npos) << error;
+
+  data.clear();
+  PutInt32(LzoFormat::MAX_BLOCK_SIZE + 1, &data);
+  PutInt32(10, &data);
+  data.append(20, 'z');
+  EXPECT_FALSE(LzoFormat::ParseBlock(header, Bytes(data), data.size(), &block, &error));
+  EXPECT_NE(error.find("Invalid uncompressed length"), string::npos) << error;
+
+  // The data runs past the end of the buffer.
+  data.clear();
+  PutInt32(100, &data);
+  PutInt32(50, &data);
+  data.append(8 + 49, 'z');
+  EXPECT_FALSE(LzoFormat::ParseBlock(header, Bytes(data), data.size(), &block, &error));
+  EXPECT_NE(error.find("Truncated lzo block"), string::npos) << error;
+}
+
+TEST(LzoFormatTest, HadoopIndex) {
+  LzoBlockOffsets offsets;
+  for (int64_t offset : { 38LL, 100000LL, 200000LL, 5LL << 32 }) {
+    ASSERT_TRUE(offsets.Append(offset));
+  }
+  string index;
+  LzoFormat::SerializeHadoopIndex(offsets, &index);
+  ASSERT_EQ(index.size(), offsets.size() * sizeof(int64_t));
+  // A partial offset at the end, as left by an interrupted indexer, is ignored.
+  index.append(3, '\0');
+
+  LzoFileHeader header;
+  string error;
+  ASSERT_TRUE(LzoFormat::ParseIndex(Bytes(index), index.size(), &header, &error))
+      << error;
+  ASSERT_EQ(header.offsets.size(), offsets.size());
+  for (int64_t i = 0; i < offsets.size(); ++i) EXPECT_EQ(header.offsets[i], offsets[i]);
+  EXPECT_TRUE(header.uncompressed_lens.empty());
+  EXPECT_TRUE(header.line_counts.empty());
+
+  // Offsets that do not increase.
+  string bad = index.substr(0, 2 * sizeof(int64_t)) + index.substr(0, sizeof(int64_t));
+  EXPECT_FALSE(LzoFormat::ParseIndex(Bytes(bad), bad.size(), &header, &error));
+}
+
+// Returns a version 2 index of 'num_blocks' blocks.
+static string MakeV2Index(int num_blocks, LzoFileHeader* header) {
+  header->line_delim = '|';
+  for (int i = 0; i < num_blocks; ++i) {
+    header->offsets.Append(38 + i * 100000LL);
+    header->uncompressed_lens.push_back(256 * 1024 - i);
+    header->line_counts.push_back(1000 + i);
+  }
+  string index;
+  LzoFormat::SerializeIndex(*header, &index);
+  return index;
+}
+
+TEST(LzoFormatTest, V2Index) {
+  LzoFileHeader expected;
+  string index = MakeV2Index(100, &expected);
+  LzoFileHeader header;
+  string error;
+  ASSERT_TRUE(LzoFormat::ParseIndex(Bytes(index), index.size(), &header, &error))
+      << error;
+  EXPECT_EQ(header.line_delim, '|');
+  ASSERT_EQ(header.offsets.size(), 100);
+  for (int i = 0; i < 100; ++i) {
+    EXPECT_EQ(header.offsets[i], expected.offsets[i]);
+    EXPECT_EQ(header.uncompressed_lens[i], expected.uncompressed_lens[i]);
+    EXPECT_EQ(header.line_counts[i], expected.line_counts[i]);
+  }
+}
+
+TEST(LzoFormatTest, MalformedV2Index) {
+  LzoFileHeader expected;
+  string index = MakeV2Index(3, &expected);
+  string magic(reinterpret_cast<const char*>(LzoFormat::INDEX_V2_MAGIC),
+      sizeof(LzoFormat::INDEX_V2_MAGIC));
+  // The index's entries follow the magic, the delimiter and the count of 3.
+  string entries = index.substr(magic.size() + 2);
+  LzoFileHeader header;
+  string error;
+
+  EXPECT_FALSE(LzoFormat::ParseIndex(Bytes(magic), magic.size(), &header, &error));
+  EXPECT_EQ(error, "Truncated lzo index header");
+
+  // More blocks than the remaining bytes can hold.
+  string bad = magic + "\n" + "\x7f" + entries;
+  EXPECT_FALSE(LzoFormat::ParseIndex(Bytes(bad), bad.size(), &header, &error));
+  EXPECT_EQ(error, "Truncated lzo index header");
+
+  bad = index.substr(0, index.size() - 1);
+  EXPECT_FALSE(LzoFormat::ParseIndex(Bytes(bad), bad.size(), &header, &error));
+  EXPECT_EQ(error, "Truncated lzo index entry");
+
+  bad = index + "x";
+  EXPECT_FALSE(LzoFormat::ParseIndex(Bytes(bad), bad.size(), &header, &error));
+  EXPECT_EQ(error, "Unexpected data after the last lzo index entry");
+
+  // A second block at the same offset as the first.
+  bad = magic + "\n" + "\x02" + "\x26\x01\x01" + string("\x00\x01\x01", 3);
+  EXPECT_FALSE(LzoFormat::ParseIndex(Bytes(bad), bad.size(), &header, &error));
+  EXPECT_NE(error.find("Invalid lzo index entry 1"), string::npos) << error;
+
+  // More lines than bytes.
+  bad = magic + "\n" + "\x01" + "\x26\x01\x02";
+  EXPECT_FALSE(LzoFormat::ParseIndex(Bytes(bad), bad.size(), &header, &error));
+  EXPECT_NE(error.find("Invalid lzo index entry 0"), string::npos) << error;
+
+  // An empty block.
+  bad = magic + "\n" + "\x01" + string("\x26\x00\x00", 3);
+  EXPECT_FALSE(LzoFormat::ParseIndex(Bytes(bad), bad.size(), &header, &error));
+  EXPECT_NE(error.find("Invalid lzo index entry 0"), string::npos) << error;
+}
+
+TEST(LzoFormatTest, CountLines) {
+  srand(1);
+  vector<uint8_t> data(1000);
+  for (uint8_t& byte : data) byte = rand() % 4 == 0 ? '\n' : rand() % 4 == 0 ? 1 : 'a';
+  for (char delim : { '\n', '\1', 'a', 'z' }) {
+    for (int start = 0; start < 17; ++start) {
+      for (int len = 0; start + len <= data.size(); len += 1 + len / 8) {
+        int64_t expected = 0;
+        for (int i = start; i < start + len; ++i) expected += data[i] == delim;
+        ASSERT_EQ(LzoFormat::CountLines(data.data() + start, len, delim), expected)
+            << "start " << start << " len " << len;
+      }
+    }
+  }
+}
+
+TEST(LzoFormatTest, CanCountRowsByLines) {
+  EXPECT_TRUE(LzoFormat::CanCountRowsByLines(0, 0, '\0', 0));
+  EXPECT_FALSE(LzoFormat::CanCountRowsByLines(1, 0, '\0', 0));
+  EXPECT_FALSE(LzoFormat::CanCountRowsByLines(0, 1, '\0', 0));
+  EXPECT_FALSE(LzoFormat::CanCountRowsByLines(0, 0, '\\', 0));
+  // The header lines of a file are not rows, but would be counted as rows.
+  EXPECT_FALSE(LzoFormat::CanCountRowsByLines(0, 0, '\0', 1));
+}
+
+// Checks that 'range' has the blocks [first_block, end_block) in [offset, end).
+static void CheckRange(const LzoFormat::Range& range, int64_t first_block,
+    int64_t end_block, int64_t offset, int64_t end) {
+  EXPECT_EQ(range.first_block, first_block);
+  EXPECT_EQ(range.end_block, end_block);
+  EXPECT_EQ(range.offset, offset);
+  EXPECT_EQ(range.end, end);
+}
+
+TEST(LzoFormatTest, PlanRanges) {
+  // Ten blocks of 100 bytes after a 38 byte header, then the end of file marker.
+  LzoFileHeader header;
+  for (int i = 0; i < 10; ++i) ASSERT_TRUE(header.offsets.Append(38 + i * 100));
+  int64_t file_length = 38 + 1000 + 4;
+  vector<pair<int64_t, int64_t>> splits = { { 0, 400 }, { 400, 400 }, { 800, 400 } };
+  vector<LzoFormat::Range> ranges;
+
+  // Each split has the blocks that start in it, and the first one the file header.
+  LzoFormat::PlanRanges(header, file_length, splits, false, &ranges);
+  ASSERT_EQ(ranges.size(), 3);
+  CheckRange(ranges[0], 0, 4, 0, 438);
+  CheckRange(ranges[1], 4, 8, 438, 838);
+  CheckRange(ranges[2], 8, 10, 838, file_length);
+
+  // Without block lengths, balanced ranges have about as many blocks as their share of
+  // the file: 3.8 and 3.8 and the rest.
+  LzoFormat::PlanRanges(header, file_length, splits, true, &ranges);
+  ASSERT_EQ(ranges.size(), 3);
+  CheckRange(ranges[0], 0, 4, 0, 438);
+  CheckRange(ranges[1], 4, 8, 438, 838);
+  CheckRange(ranges[2], 8, 10, 838, file_length);
+
+  // With them, a first block with most of the data gets a range of its own, and a
+  // range is left without blocks.
+  header.uncompressed_lens = { 900, 10, 10, 10, 10, 10, 10, 10, 10, 10 };
+  LzoFormat::PlanRanges(header, file_length, splits, true, &ranges);
+  ASSERT_EQ(ranges.size(), 3);
+  CheckRange(ranges[0], 0, 1, 0, 138);
+  EXPECT_TRUE(ranges[1].empty());
+  CheckRange(ranges[2], 1, 10, 138, file_length);
+
+  // A split past the last block has none.
+  splits.emplace_back(1200, 400);
+  LzoFormat::PlanRanges(header, file_length, splits, false, &ranges);
+  ASSERT_EQ(ranges.size(), 4);
+  EXPECT_FALSE(ranges[2].empty());
+  EXPECT_TRUE(ranges[3].empty());
+}
+
+// The splits of a file are divided among the instances of a scan, and each plans only
+// its own. Together they read every block once, balanced or not.
+TEST(LzoFormatTest, PlanRangesOfSomeSplits) {
+  srand(1);
+  LzoFileHeader header;
+  vector<int32_t> lens;
+  int64_t offset = 38;
+  for (int i = 0; i < 100; ++i) {
+    ASSERT_TRUE(header.offsets.Append(offset));
+    offset += 1 + rand() % 1000;
+    lens.push_back(1 + rand() % 100000);
+  }
+  int64_t file_length = offset + 4;
+  for (bool has_lens : { false, true }) {
+    if (has_lens) header.uncompressed_lens = lens;
+    for (bool balance : { false, true }) {
+      for (int64_t split_size : { 100, 1000, 10000, 100000 }) {
+        // Two callers, one with the even splits and one with the odd ones.
+        vector<pair<int64_t, int64_t>> caller_splits[2];
+        for (int64_t i = 0; i * split_size < file_length; ++i) {
+          caller_splits[i % 2].emplace_back(i * split_size,
+              min(split_size, file_length - i * split_size));
+        }
+        vector<int> times_read(header.offsets.size());
+        for (const vector<pair<int64_t, int64_t>>& splits : caller_splits) {
+          vector<LzoFormat::Range> ranges;
+          LzoFormat::PlanRanges(header, file_length, splits, balance, &ranges);
+          ASSERT_EQ(ranges.size(), splits.size());
+          for (const LzoFormat::Range& range : ranges) {
+            if (range.empty()) continue;
+            for (int64_t block = range.first_block; block < range.end_block; ++block) {
+              ++times_read[block];
+            }
+          }
+        }
+        for (int block = 0; block < times_read.size(); ++block) {
+          ASSERT_EQ(times_read[block], 1) << "block " << block << " lens " << has_lens
+              << " balance " << balance << " split size " << split_size;
+        }
+      }
+    }
+  }
+}
+
+}
+
+int main(int argc, char** argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,528 @@
+// Copyright (c) 2012 Cloudera, Inc. All rights reserved.
+
+#include "lzo-format.h"
+
+#include <string.h>
+#include <algorithm>
+#include <iomanip>
+#include <sstream>
+
+#if defined(__x86_64__)
+#include <emmintrin.h>
+#define LZO_FORMAT_SSE2 1
+#endif
+
+#include "lzo-checksum.h"
+#include "lzo-decompressor.h"
+
+using namespace impala;
+using namespace std;
+
+// lzop versions and header flags. See lzo-header.h, which needs liblzo's headers.
+static const int MIN_LZO_VERSION = 0x0100;
+static const int LZOP_VERSION = 0x1030;
+static const uint32_t F_ADLER32_D = 0x00000001;
+static const uint32_t F_ADLER32_C = 0x00000002;
+static const uint32_t F_H_EXTRA_FIELD = 0x00000040;
+static const uint32_t F_CRC32_D = 0x00000100;
+static const uint32_t F_CRC32_C = 0x00000200;
+static const uint32_t F_MULTIPART = 0x00000400;
+static const uint32_t F_H_FILTER = 0x00000800;
+static const uint32_t F_H_CRC32 = 0x00001000;
+static const uint32_t F_RESERVED = 0x000fc000;
+
+static void PutInt(uint64_t value, int bytes, string* out) {
+  for (int i = bytes - 1; i >= 0; --i) {
+    out->push_back(static_cast<char>(value >> (8 * i)));
+  }
+}
+
+static void PutVarint(uint64_t value, string* out) {
+  while (value >= 0x80) {
+    out->push_back(static_cast<char>(value | 0x80));
+    value >>= 7;
+  }
+  out->push_back(static_cast<char>(value));
+}
+
+// Reads the varint at *ptr and moves *ptr past it. Returns false if it does not end
+// before 'end'.
+static bool GetVarint(const uint8_t** ptr, const uint8_t* end, uint64_t* value) {
+  *value = 0;
+  for (int shift = 0; shift < 64 && *ptr < end; shift += 7) {
+    uint8_t byte = *(*ptr)++;
+    *value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+    if ((byte & 0x80) == 0) return true;
+  }
+  return false;
+}
+
+namespace impala {
+
+const uint8_t LzoFormat::MAGIC[9] =
+    { 0x89, 0x4c, 0x5a, 0x4f, 0x00, 0x0d, 0x0a, 0x1a, 0x0a };
+
+const uint8_t LzoFormat::INDEX_V2_MAGIC[8] =
+    { 0x89, 'L', 'Z', 'O', 'I', 'D', 'X', '2' };
+
+bool LzoFormat::ParseHeader(const uint8_t* data, int64_t len, LzoFileHeader* header,
+    string* error) {
+  if (len < MIN_HEADER_SIZE) {
+    stringstream ss;
+    ss << "File is too short. File size: " << len;
+    *error = ss.str();
+    return false;
+  }
+
+  if (memcmp(data, MAGIC, sizeof(MAGIC)) != 0) {
+    stringstream ss;
+    ss << "Invalid LZOP_MAGIC: '" << hex << setfill('0');
+    for (int i = 0; i < sizeof(MAGIC); ++i) ss << setw(2) << static_cast<int>(data[i]);
+    ss << "'";
+    *error = ss.str();
+    return false;
+  }
+
+  const uint8_t* h_start = data + sizeof(MAGIC);
+  const uint8_t* h_ptr = h_start;
+  const uint8_t* end = data + len;
+
+  int version = GetInt16(h_ptr);
+  if (version > LZOP_VERSION) {
+    stringstream ss;
+    ss << "Compressed with later version of lzop: " << version
+       << " must be less than: " << LZOP_VERSION;
+    *error = ss.str();
+    return false;
+  }
+  h_ptr += sizeof(int16_t);
+
+  int libversion = GetInt16(h_ptr);
+  if (libversion < MIN_LZO_VERSION) {
+    stringstream ss;
+    ss << "Compressed with incompatible lzo version: " << libversion
+       << " must be at least: " << MIN_LZO_VERSION;
+    *error = ss.str();
+    return false;
+  }
+  h_ptr += sizeof(int16_t);
+
+  // The version of lzop needed to interpret this file.
+  int neededversion = GetInt16(h_ptr);
+  if (neededversion > LZOP_VERSION) {
+    stringstream ss;
+    ss << "Compressed with incompatible lzop version: " << neededversion
+       << " must be at no more than: " << LZOP_VERSION;
+    *error = ss.str();
+    return false;
+  }
+  h_ptr += sizeof(int16_t);
+
+  uint8_t method = *h_ptr++;
+  if (method < 1 || method > 3) {
+    stringstream ss;
+    ss << "Invalid compression method: " << static_cast<int>(method);
+    *error = ss.str();
+    return false;
+  }
+  // Skip the level.
+  ++h_ptr;
+
+  uint32_t flags = GetInt32(h_ptr);
+  if (flags & (F_RESERVED | F_MULTIPART | F_H_FILTER)) {
+    stringstream ss;
+    ss << "Unsupported flags: " << flags;
+    *error = ss.str();
+    return false;
+  }
+  LzoChecksum header_checksum = (flags & F_H_CRC32) ? CHECK_CRC32 : CHECK_ADLER;
+  header->output_checksum_type_ = (flags & F_CRC32_D) ? CHECK_CRC32 :
+      (flags & F_ADLER32_D) ? CHECK_ADLER : CHECK_NONE;
+  header->input_checksum_type_ = (flags & F_CRC32_C) ? CHECK_CRC32 :
+      (flags & F_ADLER32_C) ? CHECK_ADLER : CHECK_NONE;
+  h_ptr += sizeof(int32_t);
+
+  // Skip the mode and time fields, then the file name.
+  h_ptr += 3 * sizeof(int32_t);
+  if (h_ptr < end) h_ptr += *h_ptr + 1;
+  if (h_ptr >= end || h_ptr + sizeof(int32_t) > end) {
+    stringstream ss;
+    ss << "File is too short for the header file name. File size: " << len;
+    *error = ss.str();
+    return false;
+  }
+
+  // The header always has a checksum.
+  uint32_t expected_checksum = GetInt32(h_ptr);
+  uint32_t computed_checksum =
+      LzoChecksumUtil::Compute(header_checksum, h_start, h_ptr - h_start);
+  if (computed_checksum != expected_checksum) {
+    stringstream ss;
+    ss << "Invalid header checksum: " << computed_checksum
+       << " expected: " << expected_checksum;
+    *error = ss.str();
+    return false;
+  }
+  h_ptr += sizeof(int32_t);
+
+  // Skip the extra field if any.
+  if (flags & F_H_EXTRA_FIELD) {
+    if (h_ptr + sizeof(int32_t) > end) {
+      stringstream ss;
+      ss << "File is too short for the header extra field. File size: " << len;
+      *error = ss.str();
+      return false;
+    }
+    int32_t extra_len = GetInt32(h_ptr);
+    if (extra_len < 0) {
+      stringstream ss;
+      ss << "Invalid header extra field length: " << extra_len;
+      *error = ss.str();
+      return false;
+    }
+    // The length and the checksum that follows the field.
+    h_ptr += 2 * sizeof(int32_t) + extra_len;
+  }
+
+  header->header_size_ = h_ptr - data;
+  // Remember the length of the first block if its header was read along with the file
+  // header. It is used to recognize block headers in files without an index.
+  if (h_ptr + sizeof(int32_t) <= end) header->block_size_ = GetInt32(h_ptr);
+  return true;
+}
+
+void LzoFormat::SerializeHeader(LzoChecksum checksum, const string& name, int64_t mtime,
+    string* out) {
+  out->append(reinterpret_cast<const char*>(MAGIC), sizeof(MAGIC));
+  string header;
+  PutInt(LZOP_VERSION, sizeof(int16_t), &header);
+  // The liblzo version lzop 1.03 is built with, and the lzop version needed to
+  // extract a file without filters.
+  PutInt(0x20a0, sizeof(int16_t), &header);
+  PutInt(0x0940, sizeof(int16_t), &header);
+  // lzo1x_1 at lzop's default level.
+  header.push_back(1);
+  header.push_back(5);
+  uint32_t flags = checksum == CHECK_ADLER ? F_ADLER32_D | F_ADLER32_C :
+      checksum == CHECK_CRC32 ? F_CRC32_D | F_CRC32_C : 0;
+  PutInt(flags, sizeof(int32_t), &header);
+  PutInt(0100644, sizeof(int32_t), &header);
+  // The modification time in seconds, low half first.
+  PutInt(mtime & 0xffffffff, sizeof(int32_t), &header);
+  PutInt(mtime >> 32, sizeof(int32_t), &header);
+  string short_name = name.substr(0, 255);
+  header.push_back(static_cast<char>(short_name.size()));
+  header.append(short_name);
+  PutInt(LzoChecksumUtil::Compute(CHECK_ADLER,
+      reinterpret_cast<const uint8_t*>(header.data()), header.size()),
+      sizeof(int32_t), &header);
+  out->append(header);
+}
+
+int LzoFormat::BlockHeaderLength(const LzoFileHeader& header, int32_t uncompressed_len,
+    int32_t compressed_len) {
+  int len = BLOCK_LENGTHS_SIZE;
+  if (header.output_checksum_type_ != CHECK_NONE) len += sizeof(int32_t);
+  if (compressed_len < uncompressed_len && header.input_checksum_type_ != CHECK_NONE) {
+    len += sizeof(int32_t);
+  }
+  return len;
+}
+
+bool LzoFormat::CheckBlockLengths(int32_t uncompressed_len, int32_t compressed_len,
+    string* error) {
+  stringstream ss;
+  if (uncompressed_len <= 0 || uncompressed_len > MAX_BLOCK_SIZE) {
+    ss << "Invalid uncompressed length: " << uncompressed_len;
+  } else if (compressed_len <= 0 || compressed_len > uncompressed_len) {
+    // lzop stores a block uncompressed if compressing it does not make it smaller.
+    ss << "Invalid compressed length: " << compressed_len << " for uncompressed length: "
+       << uncompressed_len;
+  } else {
+    return true;
+  }
+  *error = ss.str();
+  return false;
+}
+
+bool LzoFormat::ParseBlock(const LzoFileHeader& header, const uint8_t* data,
+    int64_t len, Block* block, string* error) {
+  if (len < sizeof(int32_t)) {
+    *error = "Truncated lzo block header";
+    return false;
+  }
+  block->uncompressed_len = GetInt32(data);
+  if (block->uncompressed_len == 0) {
+    // The end of file marker.
+    block->compressed_len = 0;
+    block->header_len = sizeof(int32_t);
+    block->data = data + sizeof(int32_t);
+    return true;
+  }
+  if (len < BLOCK_LENGTHS_SIZE) {
+    *error = "Truncated lzo block header";
+    return false;
+  }
+  block->compressed_len = GetInt32(data + sizeof(int32_t));
+  if (!CheckBlockLengths(block->uncompressed_len, block->compressed_len, error)) {
+    return false;
+  }
+  block->header_len =
+      BlockHeaderLength(header, block->uncompressed_len, block->compressed_len);
+  if (len < block->header_len + block->compressed_len) {
+    stringstream ss;
+    ss << "Truncated lzo block. Expected block size: " << block->compressed_len
+       << " but only " << len - block->header_len << " bytes are left";
+    *error = ss.str();
+    return false;
+  }
+  const uint8_t* ptr = data + BLOCK_LENGTHS_SIZE;
+  if (header.output_checksum_type_ != CHECK_NONE) {
+    block->out_checksum = GetInt32(ptr);
+    ptr += sizeof(int32_t);
+  }
+  if (block->stored() || header.input_checksum_type_ == CHECK_NONE) {
+    block->in_checksum = block->out_checksum;
+  } else {
+    block->in_checksum = GetInt32(ptr);
+    ptr += sizeof(int32_t);
+  }
+  block->data = ptr;
+  return true;
+}
+
+// Verifies that the checksum of type 'type' of 'len' bytes at 'data' is 'expected'.
+// 'source' names the data for the error message.
+static bool VerifyChecksum(LzoChecksum type, const char* source, uint32_t expected,
+    const uint8_t* data, int64_t len, string* error) {
+  if (type == CHECK_NONE) return true;
+  uint32_t computed = LzoChecksumUtil::Compute(type, data, len);
+  if (computed == expected) return true;
+  stringstream ss;
+  ss << "Checksum of " << source << " block failed. Expected: " << expected
+     << " got: " << computed;
+  *error = ss.str();
+  return false;
+}
+
+bool LzoFormat::DecodeBlock(const LzoFileHeader& header, const Block& block,
+    bool verify_checksums, uint8_t* out, const uint8_t** result, string* error) {
+  if (block.stored()) {
+    if (verify_checksums && !VerifyChecksum(header.output_checksum_type_, "stored",
+            block.out_checksum, block.data, block.uncompressed_len, error)) {
+      return false;
+    }
+    *result = block.data;
+    return true;
+  }
+  if (verify_checksums && !VerifyChecksum(header.input_checksum_type_, "compressed",
+          block.in_checksum, block.data, block.compressed_len, error)) {
+    return false;
+  }
+  int64_t out_len;
+  LzoDecompressor::Result ret = LzoDecompressor::Decompress(block.data,
+      block.compressed_len, out, block.uncompressed_len, LzoDecompressor::OUTPUT_SLACK,
+      &out_len);
+  if (ret != LzoDecompressor::OK || out_len != block.uncompressed_len) {
+    stringstream ss;
+    ss << "Lzo decompression failed. Returned: " << ret << " output size: " << out_len
+       << " expected: " << block.uncompressed_len;
+    *error = ss.str();
+    return false;
+  }
+  if (verify_checksums && !VerifyChecksum(header.output_checksum_type_, "decompressed",
+          block.out_checksum, out, out_len, error)) {
+    return false;
+  }
+  *result = out;
+  return true;
+}
+
+bool LzoFormat::ParseIndex(const uint8_t* data, int64_t len, LzoBlockOffsets* offsets) {
+  const uint8_t* end = data + len - len % sizeof(uint64_t);
+  offsets->Reserve(offsets->size() + len / sizeof(uint64_t));
+  for (const uint8_t* ptr = data; ptr < end; ptr += sizeof(uint64_t)) {
+    int64_t offset = (static_cast<int64_t>(GetInt32(ptr)) << 32) | GetInt32(ptr + 4);
+    if (!offsets->Append(offset)) return false;
+  }
+  return true;
+}
+
+bool LzoFormat::ParseIndex(const uint8_t* data, int64_t len, LzoFileHeader* header,
+    string* error) {
+  header->offsets.clear();
+  header->uncompressed_lens.clear();
+  header->line_counts.clear();
+  if (len < sizeof(INDEX_V2_MAGIC) || memcmp(data, INDEX_V2_MAGIC,
+      sizeof(INDEX_V2_MAGIC)) != 0) {
+    if (!ParseIndex(data, len, &header->offsets)) {
+      *error = "Lzo index offsets do not increase";
+      return false;
+    }
+    return true;
+  }
+
+  const uint8_t* ptr = data + sizeof(INDEX_V2_MAGIC);
+  const uint8_t* end = data + len;
+  if (ptr == end) {
+    *error = "Truncated lzo index header";
+    return false;
+  }
+  header->line_delim = *ptr++;
+  // Each entry takes at least 3 bytes.
+  uint64_t num_blocks;
+  if (!GetVarint(&ptr, end, &num_blocks) || num_blocks > (end - ptr) / 3) {
+    *error = "Truncated lzo index header";
+    return false;
+  }
+  header->offsets.Reserve(num_blocks);
+  header->uncompressed_lens.reserve(num_blocks);
+  header->line_counts.reserve(num_blocks);
+  int64_t offset = 0;
+  for (uint64_t i = 0; i < num_blocks; ++i) {
+    uint64_t delta, uncompressed_len, line_count;
+    if (!GetVarint(&ptr, end, &delta) || !GetVarint(&ptr, end, &uncompressed_len)
+        || !GetVarint(&ptr, end, &line_count)) {
+      *error = "Truncated lzo index entry";
+      return false;
+    }
+    // No block, nor the file header before the first one, is longer than this.
+    if ((i > 0 && delta == 0) || delta > MAX_BLOCK_SIZE + MAX_HEADER_SIZE
+        || uncompressed_len == 0 || uncompressed_len > MAX_BLOCK_SIZE
+        || line_count > uncompressed_len) {
+      stringstream ss;
+      ss << "Invalid lzo index entry " << i << ": offset delta " << delta
+         << ", uncompressed length " << uncompressed_len << ", line count "
+         << line_count;
+      *error = ss.str();
+      return false;
+    }
+    offset += delta;
+    header->offsets.Append(offset);
+    header->uncompressed_lens.push_back(uncompressed_len);
+    header->line_counts.push_back(line_count);
+  }
+  if (ptr != end) {
+    *error = "Unexpected data after the last lzo index entry";
+    return false;
+  }
+  return true;
+}
+
+int64_t LzoFormat::CountLines(const uint8_t* data, int64_t len, char delim) {
+  int64_t count = 0;
+  const uint8_t* end = data + len;
+#ifdef LZO_FORMAT_SSE2
+  const __m128i delims = _mm_set1_epi8(delim);
+  for (; end - data >= 64; data += 64) {
+    // Gather the 64 comparisons into one mask, for one popcount.
+    uint64_t mask = 0;
+    for (int i = 0; i < 4; ++i) {
+      __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + 16 * i));
+      uint64_t bits = _mm_movemask_epi8(_mm_cmpeq_epi8(bytes, delims));
+      mask |= bits << (16 * i);
+    }
+    count += __builtin_popcountll(mask);
+  }
+#endif
+  for (; data < end; ++data) count += *data == static_cast<uint8_t>(delim);
+  return count;
+}
+
+void LzoFormat::SerializeHadoopIndex(const LzoBlockOffsets& offsets, string* out) {
+  for (int64_t i = 0; i < offsets.size(); ++i) {
+    PutInt(offsets[i], sizeof(int64_t), out);
+  }
+}
+
+void LzoFormat::SerializeIndex(const LzoFileHeader& header, string* out) {
+  out->append(reinterpret_cast<const char*>(INDEX_V2_MAGIC), sizeof(INDEX_V2_MAGIC));
+  out->push_back(header.line_delim);
+  PutVarint(header.offsets.size(), out);
+  int64_t previous = 0;
+  for (int64_t i = 0; i < header.offsets.size(); ++i) {
+    int64_t offset = header.offsets[i];
+    PutVarint(offset - previous, out);
+    PutVarint(header.uncompressed_lens[i], out);
+    PutVarint(header.line_counts[i], out);
+    previous = offset;
+  }
+}
+
+void LzoFormat::PlanRanges(const LzoFileHeader& header, int64_t file_length,
+    const vector<pair<int64_t, int64_t>>& splits, bool balance, vector<Range>* ranges) {
+  const LzoBlockOffsets& offsets = header.offsets;
+  // With 'balance', the offsets at which the splits start and end, sorted, and the
+  // blocks at which their ranges start and end.
+  vector<int64_t> bounds;
+  vector<int64_t> bound_blocks;
+  if (balance) {
+    for (const pair<int64_t, int64_t>& split : splits) {
+      bounds.push_back(split.first);
+      bounds.push_back(split.first + split.second);
+    }
+    sort(bounds.begin(), bounds.end());
+    bounds.erase(unique(bounds.begin(), bounds.end()), bounds.end());
+    GetBalancedBlocks(header, file_length, bounds, &bound_blocks);
+  }
+  ranges->resize(splits.size());
+  for (int i = 0; i < splits.size(); ++i) {
+    Range* range = &(*ranges)[i];
+    int64_t split_end = splits[i].first + splits[i].second;
+    if (balance) {
+      range->first_block = bound_blocks[
+          lower_bound(bounds.begin(), bounds.end(), splits[i].first) - bounds.begin()];
+      range->end_block = bound_blocks[
+          lower_bound(bounds.begin(), bounds.end(), split_end) - bounds.begin()];
+    } else {
+      // A split owns the blocks that start in [offset, offset + len).
+      range->first_block = offsets.LowerBound(splits[i].first);
+      range->end_block = offsets.LowerBound(split_end);
+    }
+    range->offset = range->first_block == offsets.size() ?
+        file_length : offsets[range->first_block];
+    if (range->first_block == 0) range->offset = 0;
+    range->end = range->end_block == offsets.size() ?
+        file_length : offsets[range->end_block];
+    range->end = min(range->end, file_length);
+  }
+}
+
+void LzoFormat::GetBalancedBlocks(const LzoFileHeader& header, int64_t file_length,
+    const vector<int64_t>& bounds, vector<int64_t>* blocks) {
+  // Without the lengths, weigh the blocks the same. lzop gives every block but the last
+  // the same uncompressed length, so for its files this evens out the data each
+  // scanner decompresses and parses, however well different parts of the file
+  // compress. Hadoop's LzopCodec ends blocks wherever its writer flushes, so for its
+  // files the ranges are only roughly balanced.
+  int64_t num_blocks = header.offsets.size();
+  bool has_lens = !header.uncompressed_lens.empty();
+  int64_t total_weight = num_blocks;
+  if (has_lens) {
+    total_weight = 0;
+    for (int32_t len : header.uncompressed_lens) total_weight += len;
+  }
+  blocks->resize(bounds.size());
+  int64_t block = 0;
+  int64_t weight_before_block = 0;
+  for (int i = 0; i < bounds.size(); ++i) {
+    if (bounds[i] <= 0) {
+      (*blocks)[i] = 0;
+      continue;
+    }
+    if (bounds[i] >= file_length) {
+      (*blocks)[i] = num_blocks;
+      continue;
+    }
+    // The bound's share of the file, in weight. Computed the same way by every caller,
+    // whichever splits it was given.
+    double target = static_cast<double>(total_weight) * bounds[i] / file_length;
+    while (block < num_blocks && weight_before_block < target) {
+      weight_before_block += has_lens ? header.uncompressed_lens[block] : 1;
+      ++block;
+    }
+    (*blocks)[i] = block;
+  }
+}
+
+}
@@ -0,0 +1,180 @@
+// Copyright (c) 2012 Cloudera, Inc. All rights reserved.
+
+#ifndef IMPALA_LZO_FORMAT_H
+#define IMPALA_LZO_FORMAT_H
+
+#include <stdint.h>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "lzo-file-header.h"
+
+namespace impala {
+
+// Parsing of lzop files and their hadoop-lzo .index files out of memory. This is the
+// part of HdfsLzoTextScanner that does not need Impala: the scanner feeds it bytes
+// from its ScannerContext stream, while the tools and lzo-benchmark feed it local
+// files. Together with LzoChecksumUtil and LzoDecompressor it forms the lzocore
+// library, which builds without IMPALA_HOME.
+//
+// Functions return false and set *error on malformed input, since Status is part of
+// Impala.
+class LzoFormat {
+ public:
+  // The magic byte sequence at the beginning of an lzop file.
+  static const uint8_t MAGIC[9];
+
+  // The header is at least this long, plus up to 255 bytes of file name and an
+  // optional extra field. MAX_HEADER_SIZE over estimates it.
+  static const int MIN_HEADER_SIZE = 32;
+  static const int MAX_HEADER_SIZE = 300;
+
+  // Largest uncompressed block lzop writes.
+  static const int32_t MAX_BLOCK_SIZE = 64 * 1024 * 1024;
+
+  // Size of the uncompressed and compressed lengths at the start of each block.
+  static const int BLOCK_LENGTHS_SIZE = 2 * sizeof(int32_t);
+
+  // A block in a buffer holding an lzop file, as framed by its header.
+  struct Block {
+    // 0 for the end of file marker.
+    int32_t uncompressed_len = 0;
+    int32_t compressed_len = 0;
+
+    // Checksums of the uncompressed and compressed data, if the file has them. The
+    // compressed checksum of a stored block is its uncompressed checksum.
+    uint32_t out_checksum = 0;
+    uint32_t in_checksum = 0;
+
+    // Length of the lengths and checksums before the data.
+    int header_len = 0;
+
+    // The compressed data, in the parsed buffer.
+    const uint8_t* data = nullptr;
+
+    // True if the data was stored because compressing it did not make it smaller.
+    bool stored() const { return compressed_len == uncompressed_len; }
+  };
+
+  // Parses the file header in the first 'len' bytes of the file at 'data' into the
+  // checksum types, header_size_ and, if the first block's lengths are among the
+  // 'len' bytes, block_size_ of *header. Supports the layout of lzop 0.9.4 and later.
+  static bool ParseHeader(const uint8_t* data, int64_t len, LzoFileHeader* header,
+      std::string* error);
+
+  // Appends the magic and a header as lzop writes it, for blocks compressed with
+  // lzo1x_1 that carry checksums of type 'checksum' of their uncompressed and
+  // compressed data, to 'out'. 'name' and 'mtime' are those of the original file.
+  static void SerializeHeader(LzoChecksum checksum, const std::string& name,
+      int64_t mtime, std::string* out);
+
+  // Returns the length of the lengths and checksums preceding the data of a block
+  // with the given lengths in a file with 'header'.
+  static int BlockHeaderLength(const LzoFileHeader& header, int32_t uncompressed_len,
+      int32_t compressed_len);
+
+  // Checks the lengths at the start of a block.
+  static bool CheckBlockLengths(int32_t uncompressed_len, int32_t compressed_len,
+      std::string* error);
+
+  // Parses the block, or end of file marker, at the start of the 'len' bytes at 'data'
+  // into *block. The block's data must be among the 'len' bytes. The next block
+  // starts block->header_len + block->compressed_len bytes past 'data'.
+  static bool ParseBlock(const LzoFileHeader& header, const uint8_t* data, int64_t len,
+      Block* block, std::string* error);
+
+  // Decompresses 'block' with LzoDecompressor into 'out', which must have room for
+  // block.uncompressed_len plus LzoDecompressor::OUTPUT_SLACK bytes, and sets *result
+  // to the uncompressed data. That is the block's own data if it is stored, which is
+  // not copied. If 'verify_checksums' is true, the checksums the file has are
+  // verified.
+  static bool DecodeBlock(const LzoFileHeader& header, const Block& block,
+      bool verify_checksums, uint8_t* out, const uint8_t** result, std::string* error);
+
+  // Identifies a version 2 index file, which holds the offset, uncompressed length and
+  // number of line delimiters of each block. The index files of hadoop-lzo hold only
+  // the big-endian 64-bit offsets, and so start with a 0 byte.
+  //
+  // After the magic come the line delimiter that was counted and the number of blocks,
+  // then for each block the difference between its offset and the previous block's,
+  // its uncompressed length and its line count. All numbers are unsigned LEB128
+  // varints, so an entry usually takes about as many bytes as the offset alone in a
+  // hadoop-lzo index.
+  static const uint8_t INDEX_V2_MAGIC[8];
+
+  // Appends the block offsets in the 'len' bytes of a hadoop-lzo .index file at 'data'
+  // to 'offsets'. A partial offset at the end is ignored. Returns false if the offsets
+  // do not increase.
+  static bool ParseIndex(const uint8_t* data, int64_t len, LzoBlockOffsets* offsets);
+
+  // Parses the index file in the 'len' bytes at 'data', in either format, into the
+  // offsets of *header and, for a version 2 index, its uncompressed_lens, line_counts
+  // and line_delim.
+  static bool ParseIndex(const uint8_t* data, int64_t len, LzoFileHeader* header,
+      std::string* error);
+
+  // Appends the version 2 index of the blocks of 'header' to 'out'. 'header' must have
+  // the uncompressed length and line count of each block.
+  static void SerializeIndex(const LzoFileHeader& header, std::string* out);
+
+  // Appends the hadoop-lzo index of blocks at 'offsets' to 'out'.
+  static void SerializeHadoopIndex(const LzoBlockOffsets& offsets, std::string* out);
+
+  // The scan range of an indexed file for one split: the blocks [first_block,
+  // end_block) of the index, in the file bytes [offset, end).
+  struct Range {
+    int64_t first_block = 0;
+    int64_t end_block = 0;
+    int64_t offset = 0;
+    int64_t end = 0;
+
+    // True if no block starts in the range, which then needs no scanner.
+    bool empty() const { return first_block == end_block || offset >= end; }
+  };
+
+  // Sets *ranges to the scan range of each of 'splits', given as their offset and
+  // length, of the file of 'file_length' bytes indexed by 'header'. With 'balance'
+  // each split has the blocks between the bounds GetBalancedBlocks() gives its start
+  // and end, so that splits of the same length get about the same uncompressed data,
+  // otherwise it has the blocks that start in it. Either way a range depends only on
+  // its own split, so callers that each pass some of a file's splits together cover
+  // every block exactly once. Each range starts and ends at a block boundary, except
+  // that the first one starts at 0 to include the file header. This is how
+  // HdfsLzoTextScanner cuts indexed files, and how lzo-inspect reports it.
+  static void PlanRanges(const LzoFileHeader& header, int64_t file_length,
+      const std::vector<std::pair<int64_t, int64_t>>& splits, bool balance,
+      std::vector<Range>* ranges);
+
+  // Sets 'blocks' to the block of 'header' at which a balanced range starts for each
+  // of 'bounds', sorted offsets into the file of 'file_length' bytes: the first block
+  // that has at least the bound's share of the file's uncompressed data before it.
+  // Without a version 2 index every block counts the same, which only balances files
+  // whose blocks have the same length, like lzop's.
+  static void GetBalancedBlocks(const LzoFileHeader& header, int64_t file_length,
+      const std::vector<int64_t>& bounds, std::vector<int64_t>* blocks);
+
+  // Returns the number of bytes equal to 'delim' among the 'len' bytes at 'data'. Uses
+  // SSE2 on x86-64, comparing 16 bytes at a time.
+  static int64_t CountLines(const uint8_t* data, int64_t len, char delim);
+
+  // Returns true if the rows of a text scan are its line delimiters, so they can be
+  // counted with CountLines() or a version 2 index instead of parsed: the scan
+  // materializes no columns, has no conjuncts, has no escape character, since escaped
+  // delimiters look the same, and skips no header lines at the start of each file.
+  static bool CanCountRowsByLines(int num_materialized_slots, int num_conjuncts,
+      char escape_char, int skip_header_line_count) {
+    return num_materialized_slots == 0 && num_conjuncts == 0 && escape_char == '\0'
+        && skip_header_line_count <= 0;
+  }
+
+  // Returns the big-endian unsigned integer at 'ptr'.
+  static uint32_t GetInt32(const uint8_t* ptr) {
+    return (static_cast<uint32_t>(ptr[0]) << 24) | (ptr[1] << 16) | (ptr[2] << 8)
+        | ptr[3];
+  }
+  static uint16_t GetInt16(const uint8_t* ptr) { return (ptr[0] << 8) | ptr[1]; }
+};
+
+}
+#endif
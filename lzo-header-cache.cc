@@ -0,0 +1,79 @@
+// Copyright (c) 2012 Cloudera, Inc. All rights reserved.
+
+#include "lzo-header-cache.h"
+
+#include <boost/thread/locks.hpp>
+
+#include "common/logging.h"
+
+using namespace impala;
+using namespace std;
+
+DEFINE_int64(lzo_header_cache_capacity, 64L * 1024L * 1024L,
+    "Maximum number of bytes of lzo file headers, block offsets and zone maps that "
+    "are cached across queries. If 0, every scan reads the header and index of each "
+    "file.");
+
+// Per-entry overhead of the list node, map node and shared_ptr control block.
+static const int64_t ENTRY_OVERHEAD = 128;
+
+namespace impala {
+
+bool LzoHeaderCache::IsEnabled() {
+  return FLAGS_lzo_header_cache_capacity > 0;
+}
+
+LzoHeaderCache* LzoHeaderCache::GetInstance() {
+  // Like the decompression pool, the cache lives until the process exits.
+  static LzoHeaderCache* cache = new LzoHeaderCache();
+  return cache;
+}
+
+shared_ptr<const LzoFileHeader> LzoHeaderCache::Lookup(
+    const string& filename, int64_t mtime, int64_t file_length) {
+  DCHECK(IsEnabled());
+  LzoHeaderCache* cache = GetInstance();
+  boost::lock_guard<boost::mutex> l(cache->lock_);
+  auto it = cache->index_.find(filename);
+  if (it == cache->index_.end()) return nullptr;
+  EntryList::iterator entry = it->second;
+  if (entry->mtime != mtime || entry->file_length != file_length) return nullptr;
+  cache->entries_.splice(cache->entries_.begin(), cache->entries_, entry);
+  return entry->header;
+}
+
+void LzoHeaderCache::Insert(const string& filename, int64_t mtime,
+    int64_t file_length, const shared_ptr<const LzoFileHeader>& header) {
+  DCHECK(IsEnabled());
+  if (header->offsets.empty() && header->lazy_index_len == 0) return;
+  int64_t size = sizeof(Entry) + sizeof(LzoFileHeader) + ENTRY_OVERHEAD
+      + 2 * filename.size() + header->offsets.MemoryUsage()
+      + header->uncompressed_lens.capacity() * sizeof(int32_t)
+      + header->line_counts.capacity() * sizeof(int32_t)
+      + (header->zone_map != nullptr ? header->zone_map->MemoryUsage() : 0);
+  if (size > FLAGS_lzo_header_cache_capacity) return;
+
+  LzoHeaderCache* cache = GetInstance();
+  boost::lock_guard<boost::mutex> l(cache->lock_);
+  auto it = cache->index_.find(filename);
+  if (it != cache->index_.end()) {
+    cache->size_ -= it->second->size;
+    cache->entries_.erase(it->second);
+    cache->index_.erase(it);
+  }
+  cache->EvictTo(FLAGS_lzo_header_cache_capacity - size);
+  cache->entries_.push_front(Entry{filename, mtime, file_length, header, size});
+  cache->index_[filename] = cache->entries_.begin();
+  cache->size_ += size;
+}
+
+void LzoHeaderCache::EvictTo(int64_t capacity) {
+  while (size_ > capacity && !entries_.empty()) {
+    const Entry& entry = entries_.back();
+    size_ -= entry.size;
+    index_.erase(entry.filename);
+    entries_.pop_back();
+  }
+}
+
+}
@@ -0,0 +1,75 @@
+// Copyright (c) 2012 Cloudera, Inc. All rights reserved.
+
+#ifndef IMPALA_LZO_HEADER_CACHE_H
+#define IMPALA_LZO_HEADER_CACHE_H
+
+#include <list>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <boost/thread/mutex.hpp>
+
+#include "lzo-file-header.h"
+
+namespace impala {
+
+// Daemon-wide LRU cache of parsed lzo file headers and their block offsets, so
+// repeated scans of the same files do not re-read each file's header and index.
+// Entries are keyed by file name, modification time and length, so a header is never
+// used for a file that has been rewritten. The total size of the cached headers is
+// bounded by --lzo_header_cache_capacity.
+//
+// Only headers of files with an index, read or left for the scanners to read, are
+// cached. An index may be created for a file at any time without changing the file
+// itself, and a cached header without offsets would keep queries from using it.
+class LzoHeaderCache {
+ public:
+  // Returns true if --lzo_header_cache_capacity is positive.
+  static bool IsEnabled();
+
+  // Returns the cached header of 'filename' for this 'mtime' and 'file_length', or
+  // nullptr if there is none.
+  static std::shared_ptr<const LzoFileHeader> Lookup(
+      const std::string& filename, int64_t mtime, int64_t file_length);
+
+  // Caches 'header' as the header of 'filename', evicting least recently used
+  // headers to stay within the capacity. Replaces any header cached for an earlier
+  // version of the file. Headers without offsets are not cached.
+  static void Insert(const std::string& filename, int64_t mtime, int64_t file_length,
+      const std::shared_ptr<const LzoFileHeader>& header);
+
+ private:
+  struct Entry {
+    std::string filename;
+    int64_t mtime;
+    int64_t file_length;
+    std::shared_ptr<const LzoFileHeader> header;
+
+    // Estimate of the memory used by this entry.
+    int64_t size;
+  };
+
+  // Entries in least recently used order, most recent first.
+  typedef std::list<Entry> EntryList;
+
+  // Returns the cache, creating it on first use.
+  static LzoHeaderCache* GetInstance();
+
+  // Removes least recently used entries until the cache is at most 'capacity' bytes.
+  // 'lock_' must be held.
+  void EvictTo(int64_t capacity);
+
+  // Protects all members below.
+  boost::mutex lock_;
+
+  EntryList entries_;
+
+  // Entries by file name. Only the current version of each file is cached.
+  std::unordered_map<std::string, EntryList::iterator> index_;
+
+  // Sum of the sizes of 'entries_'.
+  int64_t size_ = 0;
+};
+
+}
+#endif
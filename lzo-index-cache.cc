@@ -0,0 +1,202 @@
+// Copyright (c) 2012 Cloudera, Inc. All rights reserved.
+
+#include "lzo-index-cache.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <utime.h>
+#include <algorithm>
+#include <fstream>
+#include <functional>
+#include <sstream>
+#include <tuple>
+#include <boost/thread/thread.hpp>
+
+#include "util/error-util.h"
+
+using namespace impala;
+using namespace std;
+
+DEFINE_string(lzo_index_cache_dir, "",
+    "Local directory in which to persist block indexes that lzo scanners build while "
+    "reading files that have no index file. Later scans of those files are split using "
+    "the persisted index. If empty, no indexes are built.");
+DEFINE_int64(lzo_index_cache_capacity, 1024L * 1024L * 1024L,
+    "Maximum number of bytes of entries in --lzo_index_cache_dir. Once it holds more, "
+    "the entries used least recently are deleted.");
+
+// Suffix of the name of each entry file.
+static const char ENTRY_SUFFIX[] = ".index";
+
+// Identifies an entry file, followed by the version of its layout.
+static const char ENTRY_MAGIC[8] = { 'L', 'Z', 'O', 'I', 'D', 'X', 'C', '1' };
+
+// Big-endian encoding, to match the .index files written by hadoop-lzo.
+static void PutInt64(int64_t value, char* buf) {
+  for (int i = 7; i >= 0; --i) {
+    buf[i] = static_cast<char>(value & 0xff);
+    value >>= 8;
+  }
+}
+
+static int64_t GetInt64(const char* buf) {
+  uint64_t value = 0;
+  for (int i = 0; i < 8; ++i) value = (value << 8) | static_cast<uint8_t>(buf[i]);
+  return static_cast<int64_t>(value);
+}
+
+namespace impala {
+
+bool LzoIndexCache::IsEnabled() {
+  return !FLAGS_lzo_index_cache_dir.empty();
+}
+
+string LzoIndexCache::EntryPath(
+    const string& filename, int64_t mtime, int64_t file_length) {
+  // The name only needs to spread entries out. The full key is stored in the entry
+  // and checked on lookup, so hash collisions are harmless.
+  stringstream ss;
+  ss << FLAGS_lzo_index_cache_dir << "/" << hex << hash<string>()(filename) << dec
+     << "-" << mtime << "-" << file_length << ENTRY_SUFFIX;
+  return ss.str();
+}
+
+Status LzoIndexCache::Lookup(const string& filename, int64_t mtime,
+    int64_t file_length, LzoBlockOffsets* offsets, bool* found) {
+  DCHECK(IsEnabled());
+  *found = false;
+  string path = EntryPath(filename, mtime, file_length);
+  ifstream in(path.c_str(), ios::in | ios::binary);
+  if (!in.is_open()) return Status::OK();
+
+  // Check the key: magic, mtime, file length and file name.
+  char buf[sizeof(ENTRY_MAGIC) + 3 * sizeof(int64_t)];
+  if (!in.read(buf, sizeof(buf))) {
+    return Status("Truncated lzo index cache entry: " + path);
+  }
+  if (memcmp(buf, ENTRY_MAGIC, sizeof(ENTRY_MAGIC)) != 0) {
+    return Status("Invalid lzo index cache entry: " + path);
+  }
+  const char* key = buf + sizeof(ENTRY_MAGIC);
+  int64_t filename_len = GetInt64(key + 2 * sizeof(int64_t));
+  if (GetInt64(key) != mtime || GetInt64(key + sizeof(int64_t)) != file_length ||
+      filename_len != filename.size()) {
+    return Status::OK();
+  }
+  string entry_filename(filename_len, '\0');
+  if (!in.read(&entry_filename[0], filename_len)) {
+    return Status("Truncated lzo index cache entry: " + path);
+  }
+  if (entry_filename != filename) return Status::OK();
+
+  // The rest of the entry is the offsets.
+  int64_t offsets_start = in.tellg();
+  in.seekg(0, ios::end);
+  int64_t num_offsets = (static_cast<int64_t>(in.tellg()) - offsets_start)
+      / sizeof(int64_t);
+  in.seekg(offsets_start);
+  vector<char> data(num_offsets * sizeof(int64_t));
+  if (!in.read(data.data(), data.size())) {
+    return Status("Error reading lzo index cache entry: " + path);
+  }
+  offsets->Reserve(offsets->size() + num_offsets);
+  for (int64_t i = 0; i < num_offsets; ++i) {
+    if (!offsets->Append(GetInt64(data.data() + i * sizeof(int64_t)))) {
+      return Status("Invalid offsets in lzo index cache entry: " + path);
+    }
+  }
+  *found = true;
+  // Mark the entry as used, so it is evicted after those not used since.
+  utime(path.c_str(), nullptr);
+  return Status::OK();
+}
+
+Status LzoIndexCache::Insert(const string& filename, int64_t mtime,
+    int64_t file_length, const vector<int64_t>& offsets) {
+  DCHECK(IsEnabled());
+  if (mkdir(FLAGS_lzo_index_cache_dir.c_str(), 0755) != 0 && errno != EEXIST) {
+    stringstream ss;
+    ss << "Could not create lzo index cache directory " << FLAGS_lzo_index_cache_dir
+       << ": " << GetStrErrMsg();
+    return Status(ss.str());
+  }
+
+  string path = EntryPath(filename, mtime, file_length);
+  stringstream tmp_path;
+  tmp_path << path << ".tmp." << getpid() << "." << boost::this_thread::get_id();
+
+  vector<char> data(sizeof(ENTRY_MAGIC) + 3 * sizeof(int64_t) + filename.size()
+      + offsets.size() * sizeof(int64_t));
+  char* ptr = data.data();
+  memcpy(ptr, ENTRY_MAGIC, sizeof(ENTRY_MAGIC));
+  ptr += sizeof(ENTRY_MAGIC);
+  PutInt64(mtime, ptr);
+  ptr += sizeof(int64_t);
+  PutInt64(file_length, ptr);
+  ptr += sizeof(int64_t);
+  PutInt64(filename.size(), ptr);
+  ptr += sizeof(int64_t);
+  memcpy(ptr, filename.data(), filename.size());
+  ptr += filename.size();
+  for (int64_t offset : offsets) {
+    PutInt64(offset, ptr);
+    ptr += sizeof(int64_t);
+  }
+
+  {
+    ofstream out(tmp_path.str().c_str(), ios::out | ios::binary | ios::trunc);
+    if (!out.write(data.data(), data.size()) || !out.flush()) {
+      stringstream ss;
+      ss << "Error writing lzo index cache entry " << tmp_path.str() << ": "
+         << GetStrErrMsg();
+      unlink(tmp_path.str().c_str());
+      return Status(ss.str());
+    }
+  }
+  if (rename(tmp_path.str().c_str(), path.c_str()) != 0) {
+    stringstream ss;
+    ss << "Error renaming lzo index cache entry " << tmp_path.str() << " to " << path
+       << ": " << GetStrErrMsg();
+    unlink(tmp_path.str().c_str());
+    return Status(ss.str());
+  }
+  Evict();
+  return Status::OK();
+}
+
+void LzoIndexCache::Evict() {
+  DIR* dir = opendir(FLAGS_lzo_index_cache_dir.c_str());
+  if (dir == nullptr) return;
+  // The last modification time, size and path of each entry.
+  vector<tuple<time_t, int64_t, string>> entries;
+  int64_t total_size = 0;
+  int suffix_len = sizeof(ENTRY_SUFFIX) - 1;
+  while (struct dirent* dirent = readdir(dir)) {
+    string name = dirent->d_name;
+    if (name.size() <= suffix_len
+        || name.compare(name.size() - suffix_len, suffix_len, ENTRY_SUFFIX) != 0) {
+      continue;
+    }
+    string path = FLAGS_lzo_index_cache_dir + "/" + name;
+    struct stat entry_stat;
+    // The entry may have been evicted by another thread meanwhile.
+    if (stat(path.c_str(), &entry_stat) != 0) continue;
+    entries.emplace_back(entry_stat.st_mtime, entry_stat.st_size, path);
+    total_size += entry_stat.st_size;
+  }
+  closedir(dir);
+  if (total_size <= FLAGS_lzo_index_cache_capacity) return;
+  sort(entries.begin(), entries.end());
+  for (const tuple<time_t, int64_t, string>& entry : entries) {
+    if (total_size <= FLAGS_lzo_index_cache_capacity) break;
+    if (unlink(get<2>(entry).c_str()) == 0) {
+      VLOG_FILE << "Evicted lzo index cache entry " << get<2>(entry);
+    }
+    total_size -= get<1>(entry);
+  }
+}
+
+}
@@ -0,0 +1,51 @@
+// Copyright (c) 2012 Cloudera, Inc. All rights reserved.
+
+#ifndef IMPALA_LZO_INDEX_CACHE_H
+#define IMPALA_LZO_INDEX_CACHE_H
+
+#include <string>
+#include <vector>
+
+#include "lzo-block-offsets.h"
+#include "common/status.h"
+
+namespace impala {
+
+// Local, per-daemon store of block indexes for lzo files that have no index file.
+// The offsets are recorded by a scanner that reads the whole file anyway and are
+// persisted under --lzo_index_cache_dir, so later queries can split the file.
+//
+// Entries are keyed by file name, modification time and length, so an index is never
+// used for a file that has been rewritten. The directory is bounded by
+// --lzo_index_cache_capacity: each insert deletes the entries used least recently
+// once the entries are larger than that. Each entry is one file holding the key
+// followed by the block offsets in the format of the .index files written by
+// hadoop-lzo: big-endian 64-bit offsets to the start of each block.
+class LzoIndexCache {
+ public:
+  // Returns true if --lzo_index_cache_dir is set.
+  static bool IsEnabled();
+
+  // Looks up the index of 'filename'. If there is one for this 'mtime' and
+  // 'file_length', appends its offsets to 'offsets' and sets *found to true.
+  static Status Lookup(const std::string& filename, int64_t mtime, int64_t file_length,
+      LzoBlockOffsets* offsets, bool* found);
+
+  // Stores 'offsets' as the index of 'filename'. The entry is written to a temporary
+  // file and renamed into place, so concurrent lookups never see partial entries.
+  // Then evicts entries if the cache is over capacity.
+  static Status Insert(const std::string& filename, int64_t mtime, int64_t file_length,
+      const std::vector<int64_t>& offsets);
+
+ private:
+  // Deletes the entries whose modification time, which Lookup() updates, is oldest
+  // until the entries are within --lzo_index_cache_capacity.
+  static void Evict();
+
+  // Returns the path of the entry for the given key.
+  static std::string EntryPath(
+      const std::string& filename, int64_t mtime, int64_t file_length);
+};
+
+}
+#endif
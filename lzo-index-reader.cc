@@ -0,0 +1,322 @@
+// Copyright (c) 2012 Cloudera, Inc. All rights reserved.
+
+#include "lzo-index-reader.h"
+
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <memory>
+#include <sstream>
+#include <boost/thread/locks.hpp>
+#include <boost/thread/mutex.hpp>
+
+#include "lzo-format.h"
+#include "lzo-thread-pool.h"
+#include "exec/hdfs-text-scanner.h"
+#include "util/hdfs-util.h"
+#include "util/promise.h"
+
+using namespace impala;
+using namespace std;
+
+DECLARE_int32(lzo_index_read_threads);
+DECLARE_int64(lzo_lazy_index_min_bytes);
+
+// Size of each read from an index file. Large enough that most indexes are read with
+// one call, even on remote storage.
+static const int INDEX_READ_SIZE = 1024 * 1024;
+
+// Number of entries of a hadoop-lzo index read at once by ReadRange(). 32KB, the
+// entries of a range of about 3GB of lzop's default blocks.
+static const int64_t RANGE_READ_ENTRIES = 4096;
+
+// Bound on queued prefetches per thread of the pool.
+static const int MAX_QUEUED_PER_THREAD = 32;
+
+// Prefetches that were never collected, e.g. because their query was cancelled, are
+// dropped once they are this old.
+static const int64_t STALE_PREFETCH_MS = 10 * 60 * 1000;
+
+namespace {
+
+// A read of an index file started by LzoIndexReader::Prefetch().
+struct IndexPrefetch {
+  // Number of Read() calls expected to collect the result.
+  int waiters = 1;
+
+  // When the prefetch was started.
+  chrono::steady_clock::time_point start_time = chrono::steady_clock::now();
+
+  // Results of the read. Valid once 'done' is set. Only the index fields of 'index'
+  // are set.
+  Status status;
+  bool found = false;
+  LzoFileHeader index;
+  Promise<bool> done;
+  atomic<bool> finished{false};
+};
+
+// Prefetches in progress or waiting to be collected, keyed by file name and mtime.
+typedef map<pair<string, int64_t>, shared_ptr<IndexPrefetch>> PrefetchMap;
+
+boost::mutex prefetches_lock;
+PrefetchMap prefetches;
+
+// Number of prefetches that have not started yet. Prefetch() gives up rather than
+// block once the pool's queue is full.
+atomic<int> queued_prefetches{0};
+
+}
+
+namespace impala {
+
+void LzoIndexReader::Prefetch(hdfsFS fs, const string& filename, int64_t mtime) {
+  LzoThreadPool* pool;
+  Status status = LzoThreadPool::GetIndexReadPool(&pool);
+  if (!status.ok()) {
+    LOG(WARNING) << "Could not start lzo index read threads: " << status.GetDetail();
+    return;
+  }
+  if (queued_prefetches.load() >= FLAGS_lzo_index_read_threads * MAX_QUEUED_PER_THREAD) {
+    return;
+  }
+
+  shared_ptr<IndexPrefetch> prefetch;
+  {
+    boost::lock_guard<boost::mutex> l(prefetches_lock);
+    // Drop prefetches nobody collected.
+    chrono::steady_clock::time_point now = chrono::steady_clock::now();
+    for (PrefetchMap::iterator it = prefetches.begin(); it != prefetches.end();) {
+      if (it->second->finished && now - it->second->start_time >
+          chrono::milliseconds(STALE_PREFETCH_MS)) {
+        it = prefetches.erase(it);
+      } else {
+        ++it;
+      }
+    }
+    shared_ptr<IndexPrefetch>& entry = prefetches[make_pair(filename, mtime)];
+    if (entry != nullptr) {
+      // Another scan of the file already started reading the index.
+      ++entry->waiters;
+      return;
+    }
+    entry.reset(new IndexPrefetch());
+    prefetch = entry;
+  }
+
+  ++queued_prefetches;
+  string index_filename = filename + HdfsTextScanner::LZO_INDEX_SUFFIX;
+  bool offered = pool->Offer([fs, index_filename, prefetch]() {
+    --queued_prefetches;
+    prefetch->status = ReadIndexFile(
+        fs, index_filename, &prefetch->index, &prefetch->found);
+    prefetch->finished = true;
+    prefetch->done.Set(true);
+  });
+  if (!offered) {
+    --queued_prefetches;
+    prefetch->status = Status("Lzo index read thread pool has been shut down.");
+    prefetch->finished = true;
+    prefetch->done.Set(true);
+  }
+}
+
+Status LzoIndexReader::Read(hdfsFS fs, const string& filename, int64_t mtime,
+    LzoFileHeader* header, bool* found) {
+  shared_ptr<IndexPrefetch> prefetch;
+  {
+    boost::lock_guard<boost::mutex> l(prefetches_lock);
+    PrefetchMap::iterator it = prefetches.find(make_pair(filename, mtime));
+    if (it != prefetches.end()) {
+      prefetch = it->second;
+      if (--prefetch->waiters == 0) prefetches.erase(it);
+    }
+  }
+  if (prefetch != nullptr) {
+    prefetch->done.Get();
+    if (prefetch->status.ok()) {
+      *found = prefetch->found;
+      header->offsets = prefetch->index.offsets;
+      header->uncompressed_lens = prefetch->index.uncompressed_lens;
+      header->line_counts = prefetch->index.line_counts;
+      header->line_delim = prefetch->index.line_delim;
+      header->lazy_index_len = prefetch->index.lazy_index_len;
+      return Status::OK();
+    }
+    // Read the index again on this thread, which returns the error if it persists.
+    VLOG_FILE << "Lzo index prefetch failed for: " << filename << ": "
+              << prefetch->status.GetDetail();
+  }
+  return ReadIndexFile(fs, filename + HdfsTextScanner::LZO_INDEX_SUFFIX, header, found);
+}
+
+Status LzoIndexReader::ReadIndexFile(hdfsFS fs, const string& index_filename,
+    LzoFileHeader* header, bool* found) {
+  // If there is no index file we can read the file by starting at the beginning
+  // and reading through to the end.
+  if (hdfsExists(fs, index_filename.c_str()) != 0) {
+    *found = false;
+    return Status::OK();
+  }
+  *found = true;
+
+  int64_t index_len = -1;
+  if (FLAGS_lzo_lazy_index_min_bytes > 0) {
+    hdfsFileInfo* info = hdfsGetPathInfo(fs, index_filename.c_str());
+    if (info == nullptr) {
+      return Status(GetHdfsErrorMsg("Error while statting index file: ", index_filename));
+    }
+    index_len = info->mSize;
+    hdfsFreeFileInfo(info, 1);
+  }
+
+  hdfsFile index_file = hdfsOpenFile(fs, index_filename.c_str(), O_RDONLY, 0, 0, 0);
+  if (index_file == nullptr) {
+    return Status(GetHdfsErrorMsg("Error while opening index file: ", index_filename));
+  }
+
+  if (index_len >= FLAGS_lzo_lazy_index_min_bytes && index_len >= sizeof(int64_t)) {
+    // Leave a large hadoop-lzo index to the scanners, which each read the entries of
+    // their own range. A version 2 index has entries of varying length, so it can
+    // only be read whole.
+    uint8_t magic[sizeof(LzoFormat::INDEX_V2_MAGIC)];
+    tSize bytes_read = hdfsPread(fs, index_file, 0, magic, sizeof(magic));
+    if (bytes_read == sizeof(magic)
+        && memcmp(magic, LzoFormat::INDEX_V2_MAGIC, sizeof(magic)) != 0) {
+      header->offsets.clear();
+      header->uncompressed_lens.clear();
+      header->line_counts.clear();
+      header->lazy_index_len = index_len;
+      if (hdfsCloseFile(fs, index_file) == -1) {
+        return Status(
+            GetHdfsErrorMsg("Error while closing index file: ", index_filename));
+      }
+      return Status::OK();
+    }
+  }
+
+  // Read the whole file, which is parsed once its format is known.
+  vector<uint8_t> buffer;
+  int64_t len = 0;
+  tSize bytes_read;
+  do {
+    buffer.resize(len + INDEX_READ_SIZE);
+    bytes_read = hdfsRead(fs, index_file, buffer.data() + len, INDEX_READ_SIZE);
+    if (bytes_read > 0) len += bytes_read;
+  } while (bytes_read > 0);
+
+  int close_stat = hdfsCloseFile(fs, index_file);
+
+  if (bytes_read == -1) {
+    return Status(GetHdfsErrorMsg("Error while reading index file: ", index_filename));
+  }
+
+  if (close_stat == -1) {
+    return Status(GetHdfsErrorMsg("Error while closing index file: ", index_filename));
+  }
+
+  // A partial offset at the end of a hadoop-lzo index is deliberately ignored.
+  header->lazy_index_len = 0;
+  string error;
+  if (!LzoFormat::ParseIndex(buffer.data(), len, header, &error)) {
+    stringstream ss;
+    ss << "Invalid index file: " << index_filename << ": " << error;
+    return Status(ss.str());
+  }
+  return Status::OK();
+}
+
+Status LzoIndexReader::ReadEntries(hdfsFS fs, hdfsFile index_file,
+    const string& index_filename, int64_t first, int64_t count,
+    vector<int64_t>* entries) {
+  vector<uint8_t> buffer(count * sizeof(int64_t));
+  int64_t len = 0;
+  while (len < buffer.size()) {
+    tSize bytes_read = hdfsPread(fs, index_file, first * sizeof(int64_t) + len,
+        buffer.data() + len, buffer.size() - len);
+    if (bytes_read == -1) {
+      return Status(GetHdfsErrorMsg("Error while reading index file: ", index_filename));
+    }
+    if (bytes_read == 0) {
+      return Status("Unexpected end of index file: " + index_filename);
+    }
+    len += bytes_read;
+  }
+  entries->resize(count);
+  for (int64_t i = 0; i < count; ++i) {
+    const uint8_t* ptr = buffer.data() + i * sizeof(int64_t);
+    (*entries)[i] = (static_cast<int64_t>(LzoFormat::GetInt32(ptr)) << 32)
+        | LzoFormat::GetInt32(ptr + 4);
+  }
+  return Status::OK();
+}
+
+Status LzoIndexReader::ReadRange(hdfsFS fs, const string& filename,
+    int64_t file_length, int64_t index_len, int64_t range_start, int64_t range_end,
+    LzoBlockOffsets* offsets) {
+  offsets->clear();
+  string index_filename = filename + HdfsTextScanner::LZO_INDEX_SUFFIX;
+  int64_t num_entries = index_len / sizeof(int64_t);
+  hdfsFile index_file = hdfsOpenFile(fs, index_filename.c_str(), O_RDONLY, 0, 0, 0);
+  if (index_file == nullptr) {
+    return Status(GetHdfsErrorMsg("Error while opening index file: ", index_filename));
+  }
+
+  // Search for the first entry at or after 'range_start', which is in [low, high]. An
+  // entry of 'num_entries' means there is none. The entries read last are kept in
+  // 'entries', from entry 'entries_start' on.
+  vector<int64_t> entries;
+  int64_t entries_start = 0;
+  int64_t low = 0;
+  int64_t high = num_entries;
+  // Blocks of a file are about the same size, so the entry is usually close to the
+  // range's share of the index.
+  int64_t guess = file_length > 0 ?
+      static_cast<int64_t>(static_cast<double>(range_start) / file_length * num_entries)
+      : 0;
+  Status status;
+  while (low < high) {
+    int64_t start = max(low, min(guess - RANGE_READ_ENTRIES / 2,
+        high - RANGE_READ_ENTRIES));
+    int64_t count = min(RANGE_READ_ENTRIES, high - start);
+    status = ReadEntries(fs, index_file, index_filename, start, count, &entries);
+    if (!status.ok()) break;
+    entries_start = start;
+    if (entries.front() >= range_start) {
+      high = start;
+    } else if (entries.back() < range_start) {
+      low = start + count;
+    } else {
+      low = high = start + (lower_bound(entries.begin(), entries.end(), range_start)
+          - entries.begin());
+    }
+    guess = low + (high - low) / 2;
+  }
+
+  // Collect the entries from there to the first one at or after 'range_end'.
+  for (int64_t i = low; status.ok() && i < num_entries; ++i) {
+    if (i < entries_start || i >= entries_start + entries.size()) {
+      status = ReadEntries(fs, index_file, index_filename, i,
+          min(RANGE_READ_ENTRIES, num_entries - i), &entries);
+      if (!status.ok()) break;
+      entries_start = i;
+    }
+    int64_t offset = entries[i - entries_start];
+    if (!offsets->Append(offset)) {
+      status = Status("Invalid index file: " + index_filename
+          + ": Lzo index offsets do not increase");
+      break;
+    }
+    if (offset >= range_end) break;
+  }
+
+  if (hdfsCloseFile(fs, index_file) == -1 && status.ok()) {
+    status = Status(GetHdfsErrorMsg("Error while closing index file: ", index_filename));
+  }
+  if (!status.ok()) offsets->clear();
+  return status;
+}
+
+}
@@ -0,0 +1,64 @@
+// Copyright (c) 2012 Cloudera, Inc. All rights reserved.
+
+#ifndef IMPALA_LZO_INDEX_READER_H
+#define IMPALA_LZO_INDEX_READER_H
+
+#include <hdfs.h>
+#include <string>
+#include <vector>
+
+#include "lzo-file-header.h"
+#include "common/status.h"
+
+namespace impala {
+
+// Reads the .index files next to lzo files. The files written by hadoop-lzo hold the
+// big-endian 64-bit offset of each compressed block. Those written by lzo-indexer may
+// instead be in the version 2 format, see LzoFormat::INDEX_V2_MAGIC.
+//
+// Index reads can be started in the background with Prefetch() when a file's header
+// range is issued, so the index is read while the header range waits for and does
+// its I/O instead of after it. The header scanner then collects the result with
+// Read(), whichever of the two finishes first. Prefetches run on a daemon-wide pool
+// of --lzo_index_read_threads threads.
+class LzoIndexReader {
+ public:
+  // Starts reading the index of 'filename', at 'mtime', in the background. Does
+  // nothing if a read of the same index is already in progress, or if too many
+  // prefetches are queued, in which case Read() reads the index itself.
+  static void Prefetch(hdfsFS fs, const std::string& filename, int64_t mtime);
+
+  // Reads the index of 'filename' into the offsets and, for a version 2 index, the
+  // per-block lengths and line counts of 'header'. Waits for and uses the result of an
+  // earlier Prefetch() if there is one, otherwise reads the index on the calling
+  // thread. Sets *found to false if the file has no index.
+  //
+  // A hadoop-lzo index of at least --lzo_lazy_index_min_bytes is not read: only its
+  // length is set, in header->lazy_index_len, for ReadRange() to read from.
+  static Status Read(hdfsFS fs, const std::string& filename, int64_t mtime,
+      LzoFileHeader* header, bool* found);
+
+  // Reads from the 'index_len' bytes of the hadoop-lzo index of 'filename', which is
+  // 'file_length' bytes long, the offsets of the blocks that start in the range
+  // [range_start, range_end) and of the first block after it, into 'offsets'. The
+  // entries are found with a few positioned reads, starting where the range's share of
+  // the index would be if all blocks compressed alike.
+  static Status ReadRange(hdfsFS fs, const std::string& filename, int64_t file_length,
+      int64_t index_len, int64_t range_start, int64_t range_end,
+      LzoBlockOffsets* offsets);
+
+ private:
+  // Reads 'index_filename' into 'header', in large reads. Sets *found to false if the
+  // file does not exist.
+  static Status ReadIndexFile(hdfsFS fs, const std::string& index_filename,
+      LzoFileHeader* header, bool* found);
+
+  // Reads the 'count' 8-byte entries of the hadoop-lzo index 'index_file' from entry
+  // 'first' on into 'entries'.
+  static Status ReadEntries(hdfsFS fs, hdfsFile index_file,
+      const std::string& index_filename, int64_t first, int64_t count,
+      std::vector<int64_t>* entries);
+};
+
+}
+#endif
@@ -0,0 +1,154 @@
+// Copyright (c) 2012 Cloudera, Inc. All rights reserved.
+//
+// Writes the block index of local lzop compressed files, so they can be split. The
+// index is written next to each file as <file.lzo>.index and must be copied next to it
+// in HDFS, like the .index files of hadoop-lzo's indexer.
+//
+// Usage: lzo-indexer [options] <file.lzo> [<file.lzo> ...]
+// Options:
+//   --line_delim=<c>  line delimiter of the table, '\n' by default
+//   --v2              write the version 2 format instead of hadoop-lzo's
+//
+// By default the index is in hadoop-lzo's format, which has only the block offsets,
+// so the file can be split by MapReduce and Hive as well. With --v2 it is in the
+// version 2 format (see LzoFormat::INDEX_V2_MAGIC), which also has the uncompressed
+// length and number of line delimiters of each block. Those let the scanner balance
+// scan ranges by the exact amount of uncompressed data, but hadoop-lzo fails to read
+// them, so use --v2 only for files that are read by Impala alone.
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "lzo-decompressor.h"
+#include "lzo-format.h"
+
+using namespace impala;
+using namespace std;
+
+// Reads the blocks of the lzop file 'data' into the offsets of *header and, if
+// 'count_lines' is true, into its uncompressed_lens and line_counts. Returns false and
+// sets *error if the file is not a valid lzop file.
+static bool IndexBlocks(const string& data, bool count_lines, LzoFileHeader* header,
+    string* error) {
+  const uint8_t* start = reinterpret_cast<const uint8_t*>(data.data());
+  const uint8_t* end = start + data.size();
+  if (!LzoFormat::ParseHeader(start, data.size(), header, error)) return false;
+
+  vector<uint8_t> buffer;
+  for (const uint8_t* ptr = start + header->header_size_; ; ) {
+    int64_t offset = ptr - start;
+    LzoFormat::Block block;
+    if (!LzoFormat::ParseBlock(*header, ptr, end - ptr, &block, error)) return false;
+    if (block.uncompressed_len == 0) break;
+    header->offsets.Append(offset);
+    if (count_lines) {
+      buffer.resize(block.uncompressed_len + LzoDecompressor::OUTPUT_SLACK);
+      const uint8_t* uncompressed;
+      if (!LzoFormat::DecodeBlock(*header, block, true, buffer.data(), &uncompressed,
+              error)) {
+        stringstream ss;
+        ss << *error << " at offset " << offset;
+        *error = ss.str();
+        return false;
+      }
+      header->uncompressed_lens.push_back(block.uncompressed_len);
+      header->line_counts.push_back(LzoFormat::CountLines(
+          uncompressed, block.uncompressed_len, header->line_delim));
+    }
+    ptr += block.header_len + block.compressed_len;
+  }
+  return true;
+}
+
+// Parses the value of option 'name' out of 'arg', if 'arg' is that option.
+static bool GetOption(const string& arg, const string& name, string* value) {
+  string prefix = "--" + name + "=";
+  if (arg.compare(0, prefix.size(), prefix) != 0) return false;
+  *value = arg.substr(prefix.size());
+  return true;
+}
+
+// Returns the delimiter character written as 'value', which may be an escape such as
+// '\t' or '\001'.
+static bool ParseDelimiter(const string& value, char* delim) {
+  if (value.size() == 1) {
+    *delim = value[0];
+    return true;
+  }
+  if (value == "\\t") {
+    *delim = '\t';
+  } else if (value == "\\n") {
+    *delim = '\n';
+  } else if (value.size() == 4 && value[0] == '\\') {
+    *delim = static_cast<char>(strtol(value.c_str() + 1, nullptr, 8));
+  } else {
+    return false;
+  }
+  return true;
+}
+
+static int Usage() {
+  cerr << "Usage: lzo-indexer [--line_delim=<c>] [--v2] <file.lzo> [...]" << endl;
+  return 1;
+}
+
+int main(int argc, char** argv) {
+  char line_delim = '\n';
+  bool v2 = false;
+  vector<string> filenames;
+  for (int i = 1; i < argc; ++i) {
+    string arg = argv[i];
+    string value;
+    if (GetOption(arg, "line_delim", &value)) {
+      if (!ParseDelimiter(value, &line_delim)) return Usage();
+    } else if (arg == "--v2") {
+      v2 = true;
+    } else if (arg.compare(0, 2, "--") == 0) {
+      return Usage();
+    } else {
+      filenames.push_back(arg);
+    }
+  }
+  if (filenames.empty()) return Usage();
+
+  for (const string& filename : filenames) {
+    ifstream in(filename.c_str(), ios::in | ios::binary);
+    if (!in.is_open()) {
+      cerr << "Could not open " << filename << ": " << strerror(errno) << endl;
+      return 1;
+    }
+    stringstream contents;
+    contents << in.rdbuf();
+    string data = contents.str();
+
+    LzoFileHeader header;
+    header.line_delim = line_delim;
+    string error;
+    if (!IndexBlocks(data, v2, &header, &error)) {
+      cerr << filename << ": " << error << endl;
+      return 1;
+    }
+
+    string output;
+    if (v2) {
+      LzoFormat::SerializeIndex(header, &output);
+    } else {
+      LzoFormat::SerializeHadoopIndex(header.offsets, &output);
+    }
+    string output_filename = filename + ".index";
+    ofstream out(output_filename.c_str(), ios::out | ios::binary | ios::trunc);
+    if (!out.write(output.data(), output.size()) || !out.flush()) {
+      cerr << "Could not write " << output_filename << ": " << strerror(errno) << endl;
+      return 1;
+    }
+    cout << "Wrote index of " << header.offsets.size() << " blocks to "
+         << output_filename << endl;
+  }
+  return 0;
+}
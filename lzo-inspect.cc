@@ -0,0 +1,450 @@
+// Copyright (c) 2012 Cloudera, Inc. All rights reserved.
+//
+// Reports how a local lzop file, and its .index if it has one, will scan, to explain
+// why one table scans slower than another and to catch badly written files before they
+// are loaded. The file is parsed and decoded with lzocore, as HdfsLzoTextScanner
+// does.
+//
+// Usage: lzo-inspect [options] <file.lzo> [<file.lzo> ...]
+// Options:
+//   --split_size=<bytes>  length of the file's splits, the HDFS block size, 128MB by
+//                         default
+//   --min_time=<seconds>  how long decoding is measured for, 1 second by default
+//   --no_balance          lay out the ranges as with --lzo_balance_splits=false, or
+//                         with an index read lazily (--lzo_lazy_index_min_bytes)
+//
+// For each file, prints:
+//   the checksums of its blocks and the distributions of their compressed and
+//   uncompressed lengths and compression ratios, and how many are stored;
+//   whether the index covers every block, matches the file and is newer than it;
+//   the MB/s of uncompressed data decoded on one core, with and without verifying the
+//   checksums (--disable_lzo_checksums);
+//   the scan ranges IssueFileRanges() issues for the file's splits, with the
+//   uncompressed data each scanner decodes.
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "lzo-decompressor.h"
+#include "lzo-format.h"
+
+using namespace impala;
+using namespace std;
+
+// Default length of the splits of a file, that of HDFS blocks.
+static const int64_t DEFAULT_SPLIT_SIZE = 128 * 1024 * 1024;
+
+static const double MB = 1024.0 * 1024.0;
+
+namespace {
+
+struct Options {
+  int64_t split_size = DEFAULT_SPLIT_SIZE;
+  double min_time = 1;
+  bool balance = true;
+};
+
+// A block of the file, at 'offset'.
+struct BlockInfo {
+  int64_t offset;
+  LzoFormat::Block block;
+};
+
+// The index of a file, and how well it matches the file's blocks.
+struct IndexInfo {
+  bool exists = false;
+  bool v2 = false;
+  LzoFileHeader header;
+
+  // True if the index was written before the file was last modified.
+  bool older_than_file = false;
+
+  // Blocks with an entry, blocks without one, and entries that are not at a block.
+  int64_t covered = 0;
+  int64_t missing = 0;
+  int64_t invalid = 0;
+
+  // Entries of a version 2 index whose uncompressed length or line count is wrong.
+  int64_t wrong_lengths = 0;
+  int64_t wrong_line_counts = 0;
+
+  // True if scans can use the index to split the file.
+  bool usable() const { return exists && invalid == 0 && !header.offsets.empty(); }
+};
+
+}
+
+static const char* ChecksumName(LzoChecksum checksum) {
+  switch (checksum) {
+    case CHECK_CRC32: return "crc32";
+    case CHECK_ADLER: return "adler32";
+    default: return "none";
+  }
+}
+
+// Returns the contents of the local file 'filename' in *data.
+static bool ReadFile(const string& filename, string* data) {
+  ifstream in(filename.c_str(), ios::in | ios::binary);
+  if (!in.is_open()) return false;
+  stringstream contents;
+  contents << in.rdbuf();
+  *data = contents.str();
+  return !in.bad();
+}
+
+// Parses the header and blocks of the lzop file 'data'.
+static bool ParseBlocks(const string& data, LzoFileHeader* header,
+    vector<BlockInfo>* blocks, string* error) {
+  const uint8_t* start = reinterpret_cast<const uint8_t*>(data.data());
+  const uint8_t* end = start + data.size();
+  if (!LzoFormat::ParseHeader(start, data.size(), header, error)) return false;
+  for (const uint8_t* ptr = start + header->header_size_; ; ) {
+    BlockInfo info;
+    info.offset = ptr - start;
+    if (!LzoFormat::ParseBlock(*header, ptr, end - ptr, &info.block, error)) {
+      stringstream ss;
+      ss << *error << " at offset " << info.offset;
+      *error = ss.str();
+      return false;
+    }
+    if (info.block.uncompressed_len == 0) break;
+    blocks->push_back(info);
+    ptr += info.block.header_len + info.block.compressed_len;
+  }
+  return true;
+}
+
+// Returns the index of the first block at or after 'offset', or blocks.size().
+static int64_t FindBlock(const vector<BlockInfo>& blocks, int64_t offset) {
+  return lower_bound(blocks.begin(), blocks.end(), offset,
+      [](const BlockInfo& info, int64_t offset) { return info.offset < offset; })
+      - blocks.begin();
+}
+
+// Reads <filename>.index, if it exists, and compares it with 'blocks'.
+static bool InspectIndex(const string& filename, const vector<BlockInfo>& blocks,
+    IndexInfo* index, string* error) {
+  string index_filename = filename + ".index";
+  struct stat index_stat;
+  if (stat(index_filename.c_str(), &index_stat) != 0) return true;
+  index->exists = true;
+  struct stat file_stat;
+  if (stat(filename.c_str(), &file_stat) == 0) {
+    index->older_than_file = index_stat.st_mtime < file_stat.st_mtime;
+  }
+  string data;
+  if (!ReadFile(index_filename, &data)) {
+    *error = "Could not read " + index_filename + ": " + strerror(errno);
+    return false;
+  }
+  index->v2 = data.size() >= sizeof(LzoFormat::INDEX_V2_MAGIC)
+      && memcmp(data.data(), LzoFormat::INDEX_V2_MAGIC,
+          sizeof(LzoFormat::INDEX_V2_MAGIC)) == 0;
+  if (!LzoFormat::ParseIndex(reinterpret_cast<const uint8_t*>(data.data()),
+          data.size(), &index->header, error)) {
+    *error = index_filename + ": " + *error;
+    return false;
+  }
+
+  const LzoBlockOffsets& offsets = index->header.offsets;
+  for (int64_t i = 0; i < offsets.size(); ++i) {
+    int64_t block = FindBlock(blocks, offsets[i]);
+    if (block == blocks.size() || blocks[block].offset != offsets[i]) {
+      ++index->invalid;
+      continue;
+    }
+    ++index->covered;
+    if (index->v2
+        && index->header.uncompressed_lens[i] != blocks[block].block.uncompressed_len) {
+      ++index->wrong_lengths;
+    }
+  }
+  index->missing = blocks.size() - index->covered;
+  return true;
+}
+
+// Decodes every block, verifying its checksums, and counts the version 2 index
+// entries whose line counts are wrong.
+static bool CheckBlocks(const LzoFileHeader& header, const vector<BlockInfo>& blocks,
+    IndexInfo* index, string* error) {
+  vector<uint8_t> out;
+  for (const BlockInfo& info : blocks) {
+    out.resize(info.block.uncompressed_len + LzoDecompressor::OUTPUT_SLACK);
+    const uint8_t* result;
+    if (!LzoFormat::DecodeBlock(header, info.block, true, out.data(), &result, error)) {
+      stringstream ss;
+      ss << *error << " at offset " << info.offset;
+      *error = ss.str();
+      return false;
+    }
+    if (!index->v2) continue;
+    int64_t i = index->header.offsets.LowerBound(info.offset);
+    if (i == index->header.offsets.size() || index->header.offsets[i] != info.offset) {
+      continue;
+    }
+    if (LzoFormat::CountLines(result, info.block.uncompressed_len,
+            index->header.line_delim) != index->header.line_counts[i]) {
+      ++index->wrong_line_counts;
+    }
+  }
+  return true;
+}
+
+// Prints the minimum, percentiles and maximum of 'values' after 'label'.
+static void PrintDistribution(const string& label, vector<double> values,
+    int precision) {
+  sort(values.begin(), values.end());
+  cout << "  " << left << setw(20) << label << right << fixed << setprecision(precision);
+  for (double p : { 0.0, 0.1, 0.5, 0.9, 1.0 }) {
+    cout << setw(12) << values[static_cast<int64_t>(p * (values.size() - 1))];
+  }
+  cout << endl;
+}
+
+static void PrintBlocks(const LzoFileHeader& header, const vector<BlockInfo>& blocks,
+    int64_t file_length) {
+  vector<double> compressed_lens;
+  vector<double> uncompressed_lens;
+  vector<double> ratios;
+  int64_t uncompressed_len = 0;
+  int64_t num_stored = 0;
+  int64_t stored_len = 0;
+  for (const BlockInfo& info : blocks) {
+    const LzoFormat::Block& block = info.block;
+    compressed_lens.push_back(block.compressed_len);
+    uncompressed_lens.push_back(block.uncompressed_len);
+    ratios.push_back(static_cast<double>(block.uncompressed_len) / block.compressed_len);
+    uncompressed_len += block.uncompressed_len;
+    if (block.stored()) {
+      ++num_stored;
+      stored_len += block.uncompressed_len;
+    }
+  }
+  cout << "  checksums: " << ChecksumName(header.output_checksum_type_)
+       << " of uncompressed data, " << ChecksumName(header.input_checksum_type_)
+       << " of compressed data" << endl;
+  cout << "  " << blocks.size() << " blocks, " << fixed << setprecision(1)
+       << file_length / MB << " MB compressed, " << uncompressed_len / MB
+       << " MB uncompressed, ratio " << setprecision(2)
+       << static_cast<double>(uncompressed_len) / file_length << endl;
+  if (blocks.empty()) return;
+  cout << "  stored blocks: " << num_stored << " (" << setprecision(1)
+       << 100.0 * num_stored / blocks.size() << "% of blocks, "
+       << 100.0 * stored_len / uncompressed_len << "% of data)" << endl;
+  cout << "  " << left << setw(20) << "" << right << setw(12) << "min" << setw(12)
+       << "p10" << setw(12) << "p50" << setw(12) << "p90" << setw(12) << "max" << endl;
+  PrintDistribution("compressed bytes", compressed_lens, 0);
+  PrintDistribution("uncompressed bytes", uncompressed_lens, 0);
+  PrintDistribution("ratio", ratios, 2);
+}
+
+static void PrintIndex(const IndexInfo& index, int64_t num_blocks) {
+  if (!index.exists) {
+    cout << "  index: none, so the file is read by one scanner" << endl;
+    return;
+  }
+  cout << "  index: " << (index.v2 ? "version 2" : "hadoop-lzo") << ", "
+       << index.header.offsets.size() << " entries, covers " << index.covered << " of "
+       << num_blocks << " blocks" << endl;
+  if (index.missing > 0) {
+    cout << "  WARNING: " << index.missing << " blocks have no entry, so splits are "
+         << "coarser" << endl;
+  }
+  if (index.invalid > 0) {
+    cout << "  ERROR: " << index.invalid << " entries are not at a block, so scans of "
+         << "the file fail. Rewrite the index." << endl;
+  }
+  if (index.wrong_lengths > 0 || index.wrong_line_counts > 0) {
+    cout << "  ERROR: " << index.wrong_lengths << " uncompressed lengths and "
+         << index.wrong_line_counts << " line counts are wrong. Rewrite the index."
+         << endl;
+  }
+  if (index.older_than_file) {
+    cout << "  WARNING: the index is older than the file" << endl;
+  }
+}
+
+// Runs 'fn', which processes 'len' bytes, for at least 'min_time' seconds and returns
+// the MB/s it processed.
+template <typename Fn>
+static double Measure(int64_t len, double min_time, const Fn& fn) {
+  typedef chrono::steady_clock Clock;
+  Clock::time_point start = Clock::now();
+  double elapsed;
+  int64_t iterations = 0;
+  do {
+    fn();
+    ++iterations;
+    elapsed = chrono::duration<double>(Clock::now() - start).count();
+  } while (elapsed < min_time);
+  return len * iterations / elapsed / MB;
+}
+
+// Prints and returns the MB/s of uncompressed data decoded with checksums verified if
+// 'verify_checksums' is true.
+static double MeasureDecode(const LzoFileHeader& header, const vector<BlockInfo>& blocks,
+    bool verify_checksums, double min_time) {
+  int64_t uncompressed_len = 0;
+  int32_t max_block_len = 0;
+  for (const BlockInfo& info : blocks) {
+    uncompressed_len += info.block.uncompressed_len;
+    max_block_len = max(max_block_len, info.block.uncompressed_len);
+  }
+  vector<uint8_t> out(max_block_len + LzoDecompressor::OUTPUT_SLACK);
+  string error;
+  // The blocks were checked by CheckBlocks(), so decoding does not fail.
+  return Measure(uncompressed_len, min_time, [&]() {
+    for (const BlockInfo& info : blocks) {
+      const uint8_t* result;
+      LzoFormat::DecodeBlock(header, info.block, verify_checksums, out.data(), &result,
+          &error);
+    }
+  });
+}
+
+// Prints the scan ranges issued for the splits of the file, as IssueFileRanges() and
+// LzoFormat::PlanRanges() cut them, and the uncompressed data each scanner decodes at
+// 'decode_rate' MB/s.
+static void PrintRanges(const vector<BlockInfo>& blocks, const IndexInfo& index,
+    int64_t file_length, const Options& options, double decode_rate) {
+  int num_splits = max<int64_t>(1,
+      (file_length + options.split_size - 1) / options.split_size);
+  // Each range is [offset, end) of the file.
+  vector<pair<int64_t, int64_t>> ranges;
+  if (!index.usable()) {
+    ranges.emplace_back(0, file_length);
+  } else {
+    // The file's whole grid of splits, as HDFS cuts it. The scan divides the splits
+    // among its instances, each of which plans only its own, but a range depends only
+    // on its split, so together they issue these ranges.
+    vector<pair<int64_t, int64_t>> splits;
+    for (int i = 0; i < num_splits; ++i) {
+      int64_t offset = i * options.split_size;
+      splits.emplace_back(offset, min(options.split_size, file_length - offset));
+    }
+    vector<LzoFormat::Range> plan;
+    LzoFormat::PlanRanges(index.header, file_length, splits, options.balance, &plan);
+    for (const LzoFormat::Range& range : plan) {
+      if (!range.empty()) ranges.emplace_back(range.offset, range.end);
+    }
+  }
+
+  cout << "  " << num_splits << " splits of " << options.split_size / MB << " MB, "
+       << ranges.size() << " scan ranges";
+  if (!index.usable()) cout << " (not split)";
+  cout << endl;
+  cout << "  " << setw(6) << "range" << setw(14) << "offset" << setw(12)
+       << "compressed" << setw(8) << "blocks" << setw(14) << "uncompressed" << setw(10)
+       << "decode s" << endl;
+  int64_t max_len = 0;
+  int64_t total_len = 0;
+  for (int i = 0; i < ranges.size(); ++i) {
+    // A scanner decodes the blocks that start in its range.
+    int64_t first = FindBlock(blocks, ranges[i].first);
+    int64_t last = FindBlock(blocks, ranges[i].second);
+    int64_t len = 0;
+    for (int64_t block = first; block < last; ++block) {
+      len += blocks[block].block.uncompressed_len;
+    }
+    max_len = max(max_len, len);
+    total_len += len;
+    cout << "  " << setw(6) << i << setw(14) << ranges[i].first << setw(12)
+         << fixed << setprecision(1) << (ranges[i].second - ranges[i].first) / MB
+         << setw(8) << last - first << setw(14) << len / MB << setw(10)
+         << setprecision(2) << len / MB / decode_rate << endl;
+  }
+  if (total_len > 0) {
+    cout << "  largest range has " << fixed << setprecision(2)
+         << static_cast<double>(max_len) * ranges.size() / total_len
+         << "x the average uncompressed data" << endl;
+  }
+}
+
+// Prints the report of 'filename'. Returns false if it is not a valid lzop file or its
+// index can't be read.
+static bool Inspect(const string& filename, const Options& options) {
+  string data;
+  if (!ReadFile(filename, &data)) {
+    cerr << "Could not read " << filename << ": " << strerror(errno) << endl;
+    return false;
+  }
+  LzoFileHeader header;
+  vector<BlockInfo> blocks;
+  IndexInfo index;
+  string error;
+  if (!ParseBlocks(data, &header, &blocks, &error)
+      || !InspectIndex(filename, blocks, &index, &error)
+      || !CheckBlocks(header, blocks, &index, &error)) {
+    cerr << filename << ": " << error << endl;
+    return false;
+  }
+
+  cout << filename << endl;
+  PrintBlocks(header, blocks, data.size());
+  PrintIndex(index, blocks.size());
+  if (blocks.empty()) return true;
+  double decode_rate = MeasureDecode(header, blocks, false, options.min_time);
+  cout << "  decode: " << fixed << setprecision(1) << decode_rate << " MB/s";
+  if (header.input_checksum_type_ != CHECK_NONE
+      || header.output_checksum_type_ != CHECK_NONE) {
+    cout << ", " << MeasureDecode(header, blocks, true, options.min_time)
+         << " MB/s verifying checksums";
+  }
+  cout << " on one core" << endl;
+  // Scans of a file with an invalid index fail, so they have no ranges to show.
+  if (index.invalid == 0) PrintRanges(blocks, index, data.size(), options, decode_rate);
+  return true;
+}
+
+// Parses the value of option 'name' out of 'arg', if 'arg' is that option.
+static bool GetOption(const string& arg, const string& name, string* value) {
+  string prefix = "--" + name + "=";
+  if (arg.compare(0, prefix.size(), prefix) != 0) return false;
+  *value = arg.substr(prefix.size());
+  return true;
+}
+
+static int Usage() {
+  cerr << "Usage: lzo-inspect [--split_size=<bytes>] [--min_time=<seconds>] "
+       << "[--no_balance] <file.lzo> [...]" << endl;
+  return 1;
+}
+
+int main(int argc, char** argv) {
+  Options options;
+  vector<string> filenames;
+  for (int i = 1; i < argc; ++i) {
+    string arg = argv[i];
+    string value;
+    if (GetOption(arg, "split_size", &value)) {
+      options.split_size = atoll(value.c_str());
+      if (options.split_size <= 0) return Usage();
+    } else if (GetOption(arg, "min_time", &value)) {
+      options.min_time = atof(value.c_str());
+      if (options.min_time <= 0) return Usage();
+    } else if (arg == "--no_balance") {
+      options.balance = false;
+    } else if (arg.compare(0, 2, "--") == 0) {
+      return Usage();
+    } else {
+      filenames.push_back(arg);
+    }
+  }
+  if (filenames.empty()) return Usage();
+
+  int ret = 0;
+  for (const string& filename : filenames) {
+    if (!Inspect(filename, options)) ret = 1;
+  }
+  return ret;
+}
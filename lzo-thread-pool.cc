@@ -0,0 +1,62 @@
+// Copyright (c) 2012 Cloudera, Inc. All rights reserved.
+
+#include "lzo-thread-pool.h"
+
+#include <memory>
+#include <boost/thread/locks.hpp>
+#include <boost/thread/mutex.hpp>
+
+#include "util/cpu-info.h"
+
+using namespace impala;
+using namespace std;
+
+DEFINE_int32(lzo_decompress_threads, 0,
+    "Number of threads in the daemon-wide pool that decompresses blocks read ahead by "
+    "lzo scanners (see --lzo_decompress_readahead_blocks). If 0, one thread per core "
+    "is started.");
+DEFINE_int32(lzo_index_read_threads, 16,
+    "Number of threads in the daemon-wide pool that reads lzo index files in the "
+    "background while the files' headers are read.");
+
+// Upper bound on queued tasks per thread. Scanners never have more than
+// --lzo_decompress_readahead_blocks tasks outstanding, so this is only reached with
+// very many concurrent scanners, in which case Offer() blocks the scanner thread.
+static const int QUEUE_SIZE_PER_THREAD = 64;
+
+namespace impala {
+
+LzoThreadPool::LzoThreadPool(const string& name, int num_threads)
+  : pool_(new ThreadPool<Task>("lzo", name, num_threads,
+        num_threads * QUEUE_SIZE_PER_THREAD,
+        [](int thread_id, const Task& task) { task(); })) {
+}
+
+Status LzoThreadPool::GetOrCreate(const string& name, int num_threads,
+    LzoThreadPool** pool_ptr, LzoThreadPool** pool) {
+  static boost::mutex lock;
+
+  boost::lock_guard<boost::mutex> l(lock);
+  if (*pool_ptr == nullptr) {
+    unique_ptr<LzoThreadPool> new_pool(new LzoThreadPool(name, num_threads));
+    RETURN_IF_ERROR(new_pool->Init());
+    *pool_ptr = new_pool.release();
+  }
+  *pool = *pool_ptr;
+  return Status::OK();
+}
+
+Status LzoThreadPool::GetDecompressionPool(LzoThreadPool** pool) {
+  static LzoThreadPool* decompression_pool = nullptr;
+  int num_threads = FLAGS_lzo_decompress_threads > 0 ?
+      FLAGS_lzo_decompress_threads : CpuInfo::num_cores();
+  return GetOrCreate("lzo-decompress", num_threads, &decompression_pool, pool);
+}
+
+Status LzoThreadPool::GetIndexReadPool(LzoThreadPool** pool) {
+  static LzoThreadPool* index_read_pool = nullptr;
+  return GetOrCreate("lzo-index-read", max(1, FLAGS_lzo_index_read_threads),
+      &index_read_pool, pool);
+}
+
+}
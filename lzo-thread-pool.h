@@ -0,0 +1,50 @@
+// Copyright (c) 2012 Cloudera, Inc. All rights reserved.
+
+#ifndef IMPALA_LZO_THREAD_POOL_H
+#define IMPALA_LZO_THREAD_POOL_H
+
+#include <functional>
+#include <boost/scoped_ptr.hpp>
+
+#include "common/status.h"
+#include "util/thread-pool.h"
+
+namespace impala {
+
+// Daemon-wide pool of threads that run work on behalf of lzo scanners. The pool is
+// created on first use and lives until the process exits, since this library is
+// loaded once per impalad and never unloaded.
+class LzoThreadPool {
+ public:
+  typedef std::function<void ()> Task;
+
+  // Returns in *pool the pool used to decompress blocks read ahead by the scanners,
+  // creating it if necessary. The number of threads is set by
+  // --lzo_decompress_threads.
+  static Status GetDecompressionPool(LzoThreadPool** pool);
+
+  // Returns in *pool the pool used to read lzo index files in the background,
+  // creating it if necessary. The number of threads is set by
+  // --lzo_index_read_threads.
+  static Status GetIndexReadPool(LzoThreadPool** pool);
+
+  // Queues 'task' to run on one of the pool's threads. Blocks if the queue is full.
+  // Returns false if the pool has been shut down, in which case 'task' is not run.
+  bool Offer(const Task& task) { return pool_->Offer(task); }
+
+ private:
+  LzoThreadPool(const std::string& name, int num_threads);
+
+  // Returns in *pool the pool stored in *pool_ptr, first creating it with 'name' and
+  // 'num_threads' threads if *pool_ptr is nullptr.
+  static Status GetOrCreate(const std::string& name, int num_threads,
+      LzoThreadPool** pool_ptr, LzoThreadPool** pool);
+
+  // Starts the pool's threads.
+  Status Init() { return pool_->Init(); }
+
+  boost::scoped_ptr<ThreadPool<Task>> pool_;
+};
+
+}
+#endif
@@ -0,0 +1,195 @@
+// Copyright (c) 2012 Cloudera, Inc. All rights reserved.
+
+#include "lzo-writer.h"
+
+#include <string.h>
+#include <lzo/lzoconf.h>
+#include <lzo/lzo1x.h>
+
+#include "lzo-checksum.h"
+#include "lzo-format.h"
+
+using namespace impala;
+using namespace std;
+
+// Blocks in flight per compression thread, so threads don't wait for the writer to
+// hand out the next block.
+static const int BLOCKS_PER_THREAD = 2;
+
+static void PutInt32(uint32_t value, string* out) {
+  for (int i = 3; i >= 0; --i) out->push_back(static_cast<char>(value >> (8 * i)));
+}
+
+namespace impala {
+
+LzoWriter::LzoWriter(const Options& options, ostream* out, ostream* index_out)
+  : options_(options),
+    out_(out),
+    index_out_(index_out) {
+  index_.line_delim = options_.line_delim;
+  if (options_.num_threads <= 1) {
+    work_mem_.resize(LZO1X_1_MEM_COMPRESS);
+  } else {
+    for (int i = 0; i < options_.num_threads; ++i) {
+      threads_.emplace_back(&LzoWriter::CompressThread, this);
+    }
+  }
+}
+
+LzoWriter::~LzoWriter() {
+  {
+    lock_guard<mutex> l(lock_);
+    shutdown_ = true;
+  }
+  queue_cv_.notify_all();
+  for (thread& t : threads_) t.join();
+}
+
+void LzoWriter::Compress(Job* job, vector<uint8_t>* work_mem) const {
+  const uint8_t* data = reinterpret_cast<const uint8_t*>(job->input.data());
+  int32_t len = job->input.size();
+  // lzo1x_1 may expand incompressible data by this much.
+  vector<uint8_t> compressed(len + len / 16 + 64 + 3);
+  lzo_uint compressed_len;
+  lzo1x_1_compress(data, len, compressed.data(), &compressed_len, work_mem->data());
+  // Like lzop, store the block if compressing it does not make it smaller.
+  bool stored = compressed_len >= len;
+  string& out = job->output;
+  out.reserve(LzoFormat::BLOCK_LENGTHS_SIZE + 2 * sizeof(int32_t)
+      + (stored ? len : compressed_len));
+  PutInt32(len, &out);
+  PutInt32(stored ? len : compressed_len, &out);
+  if (options_.checksum != CHECK_NONE) {
+    PutInt32(LzoChecksumUtil::Compute(options_.checksum, data, len), &out);
+    if (!stored) {
+      PutInt32(LzoChecksumUtil::Compute(options_.checksum, compressed.data(),
+          compressed_len), &out);
+    }
+  }
+  if (stored) {
+    out.append(job->input);
+  } else {
+    out.append(reinterpret_cast<const char*>(compressed.data()), compressed_len);
+  }
+  if (options_.v2_index) {
+    job->line_count = LzoFormat::CountLines(data, len, options_.line_delim);
+  }
+}
+
+void LzoWriter::CompressThread() {
+  vector<uint8_t> work_mem(LZO1X_1_MEM_COMPRESS);
+  unique_lock<mutex> l(lock_);
+  while (true) {
+    queue_cv_.wait(l, [this]() { return shutdown_ || !queue_.empty(); });
+    if (queue_.empty()) return;
+    Job* job = queue_.front();
+    queue_.pop_front();
+    l.unlock();
+    Compress(job, &work_mem);
+    l.lock();
+    job->done = true;
+    done_cv_.notify_all();
+  }
+}
+
+bool LzoWriter::AddBlock(string input, string* error) {
+  unique_ptr<Job> job(new Job());
+  job->input = move(input);
+  if (threads_.empty()) {
+    Compress(job.get(), &work_mem_);
+    job->done = true;
+    in_flight_.push_back(move(job));
+    return WriteFirstBlock(error);
+  }
+  while (in_flight_.size() >= BLOCKS_PER_THREAD * threads_.size()) {
+    if (!WriteFirstBlock(error)) return false;
+  }
+  {
+    lock_guard<mutex> l(lock_);
+    queue_.push_back(job.get());
+  }
+  queue_cv_.notify_one();
+  in_flight_.push_back(move(job));
+  return true;
+}
+
+bool LzoWriter::WriteFirstBlock(string* error) {
+  Job* job = in_flight_.front().get();
+  {
+    unique_lock<mutex> l(lock_);
+    done_cv_.wait(l, [job]() { return job->done; });
+  }
+  if (!out_->write(job->output.data(), job->output.size())) {
+    *error = "Could not write lzo block";
+    return false;
+  }
+  index_.offsets.Append(file_offset_);
+  index_.uncompressed_lens.push_back(job->input.size());
+  index_.line_counts.push_back(job->line_count);
+  file_offset_ += job->output.size();
+  in_flight_.pop_front();
+  return true;
+}
+
+bool LzoWriter::Write(const uint8_t* data, int64_t len, string* error) {
+  if (file_offset_ == 0) {
+    string header;
+    LzoFormat::SerializeHeader(options_.checksum, options_.name, options_.mtime, &header);
+    if (!out_->write(header.data(), header.size())) {
+      *error = "Could not write lzo header";
+      return false;
+    }
+    file_offset_ = header.size();
+  }
+  const char* ptr = reinterpret_cast<const char*>(data);
+  const char* end = ptr + len;
+  while (ptr < end) {
+    int64_t n = min<int64_t>(end - ptr, options_.block_size - pending_.size());
+    pending_.append(ptr, n);
+    ptr += n;
+    if (pending_.size() == options_.block_size) {
+      string block;
+      block.swap(pending_);
+      if (!AddBlock(move(block), error)) return false;
+    }
+  }
+  return true;
+}
+
+bool LzoWriter::Close(string* error) {
+  if (closed_) {
+    *error = "Lzo file is already closed";
+    return false;
+  }
+  closed_ = true;
+  // Write the header of an empty file.
+  if (file_offset_ == 0 && !Write(nullptr, 0, error)) return false;
+  if (!pending_.empty()) {
+    string block;
+    block.swap(pending_);
+    if (!AddBlock(move(block), error)) return false;
+  }
+  while (!in_flight_.empty()) {
+    if (!WriteFirstBlock(error)) return false;
+  }
+  string eof_marker;
+  PutInt32(0, &eof_marker);
+  if (!out_->write(eof_marker.data(), eof_marker.size()) || !out_->flush()) {
+    *error = "Could not write the end of the lzo file";
+    return false;
+  }
+  if (index_out_ == nullptr) return true;
+  string index;
+  if (options_.v2_index) {
+    LzoFormat::SerializeIndex(index_, &index);
+  } else {
+    LzoFormat::SerializeHadoopIndex(index_.offsets, &index);
+  }
+  if (!index_out_->write(index.data(), index.size()) || !index_out_->flush()) {
+    *error = "Could not write the lzo index";
+    return false;
+  }
+  return true;
+}
+
+}
@@ -0,0 +1,129 @@
+// Copyright (c) 2012 Cloudera, Inc. All rights reserved.
+
+#ifndef IMPALA_LZO_WRITER_H
+#define IMPALA_LZO_WRITER_H
+
+#include <stdint.h>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "lzo-file-header.h"
+
+namespace impala {
+
+// Writes lzop files, in the layout HdfsLzoTextScanner::ReadHeader() accepts, together
+// with their index, so the files can be split as soon as they are written. Blocks are
+// compressed with liblzo's lzo1x_1, as lzop does by default, on 'num_threads' threads,
+// while the caller's thread writes the compressed blocks in order.
+//
+// The index is written to a separate stream once the file is complete, in hadoop-lzo's
+// format or, with 'v2_index', in the version 2 format (see LzoFormat::INDEX_V2_MAGIC),
+// which hadoop-lzo can't read.
+//
+// Functions return false and set *error on failure. The writer can't be used after
+// that.
+class LzoWriter {
+ public:
+  struct Options {
+    // Uncompressed length of each block. lzop's default is 256KB.
+    int32_t block_size = 256 * 1024;
+
+    // Checksums of the uncompressed and compressed data of each block.
+    LzoChecksum checksum = CHECK_ADLER;
+
+    // Number of threads compressing blocks. If 1 or less, blocks are compressed by the
+    // caller's thread.
+    int num_threads = 1;
+
+    // Line delimiter counted in a version 2 index.
+    char line_delim = '\n';
+
+    // If true, the index is in the version 2 format instead of hadoop-lzo's.
+    bool v2_index = false;
+
+    // Name and modification time recorded in the header.
+    std::string name;
+    int64_t mtime = 0;
+  };
+
+  // Writes the file to 'out' and, if 'index_out' is not nullptr, its index to
+  // 'index_out'. Both must outlive the writer.
+  LzoWriter(const Options& options, std::ostream* out, std::ostream* index_out);
+
+  // Waits for the compression threads. Close() must have been called for the file
+  // to be complete.
+  ~LzoWriter();
+
+  // Appends 'len' bytes at 'data' to the file.
+  bool Write(const uint8_t* data, int64_t len, std::string* error);
+
+  // Writes the last block, the end of file marker and the index.
+  bool Close(std::string* error);
+
+  // Number of blocks written so far.
+  int64_t num_blocks() const { return index_.offsets.size(); }
+
+ private:
+  // A block being compressed.
+  struct Job {
+    std::string input;
+
+    // The block's lengths, checksums and data. Valid once 'done' is set.
+    std::string output;
+    int32_t line_count = 0;
+    bool done = false;
+  };
+
+  // Compresses 'job->input' into 'job->output' with 'work_mem' as liblzo's work memory.
+  void Compress(Job* job, std::vector<uint8_t>* work_mem) const;
+
+  // Compresses jobs from 'queue_' until 'shutdown_' is set.
+  void CompressThread();
+
+  // Queues 'input' to be compressed, first writing out blocks to bound the number in
+  // flight.
+  bool AddBlock(std::string input, std::string* error);
+
+  // Waits for the first block in 'in_flight_' and writes it out.
+  bool WriteFirstBlock(std::string* error);
+
+  const Options options_;
+  std::ostream* const out_;
+  std::ostream* const index_out_;
+
+  // Bytes written to 'out_' so far.
+  int64_t file_offset_ = 0;
+
+  // Data not yet filling a block.
+  std::string pending_;
+
+  // Blocks queued or being compressed, in file order.
+  std::deque<std::unique_ptr<Job>> in_flight_;
+
+  // Blocks waiting for a compression thread.
+  std::deque<Job*> queue_;
+
+  // Protects 'queue_', 'shutdown_' and the 'done' flag of each job.
+  std::mutex lock_;
+  std::condition_variable queue_cv_;
+  std::condition_variable done_cv_;
+  bool shutdown_ = false;
+  std::vector<std::thread> threads_;
+
+  // Work memory of the caller's thread if there are no compression threads.
+  std::vector<uint8_t> work_mem_;
+
+  // The offsets, uncompressed lengths and line counts of the blocks written.
+  LzoFileHeader index_;
+
+  bool closed_ = false;
+};
+
+}
+#endif
@@ -0,0 +1,167 @@
+// Copyright (c) 2012 Cloudera, Inc. All rights reserved.
+
+#include <string>
+#include <vector>
+#include <gtest/gtest.h>
+
+#include "lzo-zone-map.h"
+
+using namespace impala;
+using namespace std;
+
+namespace impala {
+
+typedef LzoZoneMap::Predicate Predicate;
+
+// A zone map of an int, a double and a string column, with one block in which the
+// values of each are between the bounds below.
+class LzoZoneMapTest : public testing::Test {
+ protected:
+  LzoZoneMapTest()
+    : zone_map_(1000, '\n', ',', { { 0, LzoZoneMap::INT }, { 2, LzoZoneMap::DOUBLE },
+          { 5, LzoZoneMap::STRING } }) {
+    LzoZoneMap::Range* ranges = zone_map_.AddBlock(38, true);
+    ranges[0].has_values = true;
+    ranges[0].min_int = 10;
+    ranges[0].max_int = 20;
+    ranges[1].has_values = true;
+    ranges[1].min_double = -1.5;
+    ranges[1].max_double = 2.5;
+    ranges[2].has_values = true;
+    ranges[2].min_string = "bravo";
+    ranges[2].max_string = "delta";
+  }
+
+  // Returns whether block 0 can be skipped for 'column' 'op' 'value'.
+  bool CanSkip(int column, Predicate::Op op, int64_t value) {
+    Predicate predicate;
+    predicate.column = column;
+    predicate.op = op;
+    predicate.int_value = value;
+    return zone_map_.CanSkip(0, { predicate });
+  }
+
+  bool CanSkipDouble(Predicate::Op op, double value) {
+    Predicate predicate;
+    predicate.column = 1;
+    predicate.op = op;
+    predicate.double_value = value;
+    return zone_map_.CanSkip(0, { predicate });
+  }
+
+  bool CanSkipString(Predicate::Op op, const string& value) {
+    Predicate predicate;
+    predicate.column = 2;
+    predicate.op = op;
+    predicate.string_value = value;
+    return zone_map_.CanSkip(0, { predicate });
+  }
+
+  LzoZoneMap zone_map_;
+};
+
+TEST_F(LzoZoneMapTest, IntPredicates) {
+  EXPECT_TRUE(CanSkip(0, Predicate::LT, 10));
+  EXPECT_FALSE(CanSkip(0, Predicate::LT, 11));
+  EXPECT_TRUE(CanSkip(0, Predicate::LE, 9));
+  EXPECT_FALSE(CanSkip(0, Predicate::LE, 10));
+  EXPECT_TRUE(CanSkip(0, Predicate::EQ, 9));
+  EXPECT_FALSE(CanSkip(0, Predicate::EQ, 10));
+  EXPECT_FALSE(CanSkip(0, Predicate::EQ, 15));
+  EXPECT_FALSE(CanSkip(0, Predicate::EQ, 20));
+  EXPECT_TRUE(CanSkip(0, Predicate::EQ, 21));
+  EXPECT_FALSE(CanSkip(0, Predicate::GE, 20));
+  EXPECT_TRUE(CanSkip(0, Predicate::GE, 21));
+  EXPECT_FALSE(CanSkip(0, Predicate::GT, 19));
+  EXPECT_TRUE(CanSkip(0, Predicate::GT, 20));
+}
+
+TEST_F(LzoZoneMapTest, DoublePredicates) {
+  EXPECT_TRUE(CanSkipDouble(Predicate::LT, -1.5));
+  EXPECT_FALSE(CanSkipDouble(Predicate::LE, -1.5));
+  EXPECT_TRUE(CanSkipDouble(Predicate::EQ, 2.6));
+  EXPECT_FALSE(CanSkipDouble(Predicate::EQ, 0));
+  EXPECT_TRUE(CanSkipDouble(Predicate::GT, 2.5));
+  EXPECT_FALSE(CanSkipDouble(Predicate::GE, 2.5));
+}
+
+TEST_F(LzoZoneMapTest, StringPredicates) {
+  EXPECT_TRUE(CanSkipString(Predicate::LT, "bravo"));
+  EXPECT_FALSE(CanSkipString(Predicate::LT, "bravoo"));
+  EXPECT_TRUE(CanSkipString(Predicate::EQ, "alpha"));
+  EXPECT_FALSE(CanSkipString(Predicate::EQ, "charlie"));
+  EXPECT_TRUE(CanSkipString(Predicate::EQ, "echo"));
+  EXPECT_FALSE(CanSkipString(Predicate::GE, "delta"));
+  EXPECT_TRUE(CanSkipString(Predicate::GT, "delta"));
+}
+
+// Blocks without values, or with values that did not parse, are handled specially.
+TEST_F(LzoZoneMapTest, NullsAndUnparsableValues) {
+  // Only NULLs, which satisfy no comparison.
+  zone_map_.MutableRange(0, 0)->has_values = false;
+  EXPECT_TRUE(CanSkip(0, Predicate::EQ, 15));
+  EXPECT_TRUE(CanSkip(0, Predicate::GE, 0));
+
+  // Nothing is known about the values.
+  zone_map_.MutableRange(0, 0)->bounded = false;
+  EXPECT_FALSE(CanSkip(0, Predicate::EQ, 15));
+  EXPECT_FALSE(CanSkip(0, Predicate::GT, 1000));
+}
+
+// A block is skipped if any one predicate excludes it.
+TEST_F(LzoZoneMapTest, Conjunction) {
+  Predicate in_range;
+  in_range.column = 0;
+  in_range.op = Predicate::EQ;
+  in_range.int_value = 15;
+  Predicate out_of_range;
+  out_of_range.column = 2;
+  out_of_range.op = Predicate::EQ;
+  out_of_range.string_value = "zulu";
+  EXPECT_FALSE(zone_map_.CanSkip(0, { in_range }));
+  EXPECT_TRUE(zone_map_.CanSkip(0, { in_range, out_of_range }));
+  EXPECT_FALSE(zone_map_.CanSkip(0, {}));
+}
+
+TEST_F(LzoZoneMapTest, SerializeRoundTrip) {
+  LzoZoneMap::Range* ranges = zone_map_.AddBlock(500, false);
+  ranges[0].bounded = false;
+  ranges[2].has_values = true;
+  ranges[2].min_string = "";
+  ranges[2].max_string = string("a\0b", 3);
+  string data;
+  zone_map_.Serialize(&data);
+
+  LzoZoneMap read;
+  string error;
+  ASSERT_TRUE(read.Deserialize(reinterpret_cast<const uint8_t*>(data.data()),
+      data.size(), &error)) << error;
+  EXPECT_EQ(read.file_length(), 1000);
+  EXPECT_EQ(read.field_delim(), ',');
+  ASSERT_EQ(read.columns().size(), 3);
+  EXPECT_EQ(read.FindColumn(5), 2);
+  EXPECT_EQ(read.FindColumn(1), -1);
+  ASSERT_EQ(read.num_blocks(), 2);
+  EXPECT_EQ(read.FindBlock(500), 1);
+  EXPECT_EQ(read.FindBlock(501), -1);
+  EXPECT_TRUE(read.HasRowEnd(0));
+  EXPECT_FALSE(read.HasRowEnd(1));
+  EXPECT_EQ(read.GetRange(0, 0).min_int, 10);
+  EXPECT_EQ(read.GetRange(0, 1).max_double, 2.5);
+  EXPECT_FALSE(read.GetRange(1, 0).bounded);
+  EXPECT_EQ(read.GetRange(1, 2).max_string, string("a\0b", 3));
+
+  // Every truncation of the sidecar is rejected.
+  for (int len = 0; len < data.size(); ++len) {
+    LzoZoneMap truncated;
+    EXPECT_FALSE(truncated.Deserialize(reinterpret_cast<const uint8_t*>(data.data()),
+        len, &error)) << "length " << len;
+  }
+}
+
+}
+
+int main(int argc, char** argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
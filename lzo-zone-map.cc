@@ -0,0 +1,313 @@
+// Copyright (c) 2012 Cloudera, Inc. All rights reserved.
+
+#include "lzo-zone-map.h"
+
+#include <string.h>
+#include <algorithm>
+#include <sstream>
+
+using namespace impala;
+using namespace std;
+
+// Identifies a zone map, followed by the version of its layout.
+static const char ZONE_MAP_MAGIC[8] = { 'L', 'Z', 'O', 'Z', 'M', 'A', 'P', '1' };
+
+// Bits of the flags byte of a Range.
+static const uint8_t RANGE_BOUNDED = 1;
+static const uint8_t RANGE_HAS_VALUES = 2;
+
+static void PutInt(uint64_t value, int bytes, string* out) {
+  for (int i = bytes - 1; i >= 0; --i) {
+    out->push_back(static_cast<char>(value >> (8 * i)));
+  }
+}
+
+static void PutDouble(double value, string* out) {
+  uint64_t bits;
+  memcpy(&bits, &value, sizeof(bits));
+  PutInt(bits, sizeof(bits), out);
+}
+
+static void PutString(const string& value, string* out) {
+  PutInt(value.size(), sizeof(int32_t), out);
+  out->append(value);
+}
+
+namespace {
+
+// Reads the big-endian fields of a zone map, failing once the data runs out.
+class Reader {
+ public:
+  Reader(const uint8_t* data, int64_t len) : ptr_(data), end_(data + len) {}
+
+  bool GetInt(int bytes, uint64_t* value) {
+    if (end_ - ptr_ < bytes) return false;
+    *value = 0;
+    for (int i = 0; i < bytes; ++i) *value = (*value << 8) | *ptr_++;
+    return true;
+  }
+
+  template <typename T>
+  bool Get(T* value) {
+    uint64_t v;
+    if (!GetInt(sizeof(T), &v)) return false;
+    *value = static_cast<T>(v);
+    return true;
+  }
+
+  bool GetDouble(double* value) {
+    uint64_t bits;
+    if (!GetInt(sizeof(bits), &bits)) return false;
+    memcpy(value, &bits, sizeof(bits));
+    return true;
+  }
+
+  bool GetString(string* value) {
+    int32_t len;
+    if (!Get(&len) || len < 0 || end_ - ptr_ < len) return false;
+    value->assign(reinterpret_cast<const char*>(ptr_), len);
+    ptr_ += len;
+    return true;
+  }
+
+  bool GetBytes(void* buf, int len) {
+    if (end_ - ptr_ < len) return false;
+    memcpy(buf, ptr_, len);
+    ptr_ += len;
+    return true;
+  }
+
+  int64_t remaining() const { return end_ - ptr_; }
+
+ private:
+  const uint8_t* ptr_;
+  const uint8_t* const end_;
+};
+
+}
+
+namespace impala {
+
+const char* const LzoZoneMap::SUFFIX = ".zonemap";
+
+LzoZoneMap::LzoZoneMap(int64_t file_length, char line_delim, char field_delim,
+    const vector<Column>& columns)
+  : file_length_(file_length),
+    line_delim_(line_delim),
+    field_delim_(field_delim),
+    columns_(columns) {
+}
+
+int LzoZoneMap::FindColumn(int32_t index) const {
+  for (int i = 0; i < columns_.size(); ++i) {
+    if (columns_[i].index == index) return i;
+  }
+  return -1;
+}
+
+int64_t LzoZoneMap::FindBlock(int64_t offset) const {
+  vector<int64_t>::const_iterator it =
+      lower_bound(block_offsets_.begin(), block_offsets_.end(), offset);
+  if (it == block_offsets_.end() || *it != offset) return -1;
+  return it - block_offsets_.begin();
+}
+
+bool LzoZoneMap::Excludes(
+    ColumnType type, const Range& range, const Predicate& predicate) {
+  if (!range.bounded) return false;
+  if (!range.has_values) return true;
+  // Compares the constant with the minimum and maximum.
+  int cmp_min, cmp_max;
+  switch (type) {
+    case INT:
+      cmp_min = predicate.int_value < range.min_int ? -1 :
+          predicate.int_value > range.min_int;
+      cmp_max = predicate.int_value < range.max_int ? -1 :
+          predicate.int_value > range.max_int;
+      break;
+    case DOUBLE:
+      cmp_min = predicate.double_value < range.min_double ? -1 :
+          predicate.double_value > range.min_double;
+      cmp_max = predicate.double_value < range.max_double ? -1 :
+          predicate.double_value > range.max_double;
+      break;
+    case STRING:
+      cmp_min = predicate.string_value.compare(range.min_string);
+      cmp_max = predicate.string_value.compare(range.max_string);
+      break;
+    default:
+      return false;
+  }
+  switch (predicate.op) {
+    case Predicate::LT: return cmp_min <= 0;
+    case Predicate::LE: return cmp_min < 0;
+    case Predicate::EQ: return cmp_min < 0 || cmp_max > 0;
+    case Predicate::GE: return cmp_max > 0;
+    case Predicate::GT: return cmp_max >= 0;
+  }
+  return false;
+}
+
+bool LzoZoneMap::CanSkip(int64_t block, const vector<Predicate>& predicates) const {
+  for (const Predicate& predicate : predicates) {
+    if (Excludes(columns_[predicate.column].type, GetRange(block, predicate.column),
+            predicate)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+LzoZoneMap::Range* LzoZoneMap::AddBlock(int64_t offset, bool has_row_end) {
+  block_offsets_.push_back(offset);
+  row_ends_.push_back(has_row_end);
+  ranges_.resize(ranges_.size() + columns_.size());
+  return &ranges_[ranges_.size() - columns_.size()];
+}
+
+bool LzoZoneMap::Deserialize(const uint8_t* data, int64_t len, string* error) {
+  Reader reader(data, len);
+  char magic[sizeof(ZONE_MAP_MAGIC)];
+  if (!reader.GetBytes(magic, sizeof(magic))
+      || memcmp(magic, ZONE_MAP_MAGIC, sizeof(magic)) != 0) {
+    *error = "Invalid zone map magic";
+    return false;
+  }
+  int32_t num_columns;
+  if (!reader.Get(&file_length_) || !reader.GetBytes(&line_delim_, 1)
+      || !reader.GetBytes(&field_delim_, 1) || !reader.Get(&num_columns)
+      || num_columns < 0 || num_columns > reader.remaining()) {
+    *error = "Truncated zone map header";
+    return false;
+  }
+  columns_.resize(num_columns);
+  for (Column& column : columns_) {
+    uint8_t type;
+    if (!reader.Get(&column.index) || !reader.Get(&type)) {
+      *error = "Truncated zone map header";
+      return false;
+    }
+    if (column.index < 0 || type > STRING) {
+      stringstream ss;
+      ss << "Invalid zone map column " << column.index << " of type "
+         << static_cast<int>(type);
+      *error = ss.str();
+      return false;
+    }
+    column.type = static_cast<ColumnType>(type);
+  }
+
+  int64_t num_blocks;
+  if (!reader.Get(&num_blocks) || num_blocks < 0
+      || num_blocks > reader.remaining() / sizeof(int64_t)) {
+    *error = "Truncated zone map header";
+    return false;
+  }
+  block_offsets_.clear();
+  row_ends_.clear();
+  ranges_.clear();
+  block_offsets_.reserve(num_blocks);
+  row_ends_.reserve(num_blocks);
+  ranges_.reserve(num_blocks * num_columns);
+  for (int64_t i = 0; i < num_blocks; ++i) {
+    int64_t offset;
+    uint8_t has_row_end;
+    if (!reader.Get(&offset) || !reader.Get(&has_row_end)) {
+      *error = "Truncated zone map block";
+      return false;
+    }
+    if (!block_offsets_.empty() && offset <= block_offsets_.back()) {
+      stringstream ss;
+      ss << "Zone map block offset " << offset << " is not after "
+         << block_offsets_.back();
+      *error = ss.str();
+      return false;
+    }
+    Range* ranges = AddBlock(offset, has_row_end != 0);
+    for (int j = 0; j < num_columns; ++j) {
+      Range* range = &ranges[j];
+      uint8_t flags;
+      if (!reader.Get(&flags)) {
+        *error = "Truncated zone map block";
+        return false;
+      }
+      range->bounded = (flags & RANGE_BOUNDED) != 0;
+      range->has_values = (flags & RANGE_HAS_VALUES) != 0;
+      if (!range->bounded || !range->has_values) continue;
+      bool valid;
+      switch (columns_[j].type) {
+        case INT:
+          valid = reader.Get(&range->min_int) && reader.Get(&range->max_int);
+          break;
+        case DOUBLE:
+          valid = reader.GetDouble(&range->min_double)
+              && reader.GetDouble(&range->max_double);
+          break;
+        case STRING:
+          valid = reader.GetString(&range->min_string)
+              && reader.GetString(&range->max_string);
+          break;
+        default:
+          valid = false;
+      }
+      if (!valid) {
+        *error = "Truncated zone map block";
+        return false;
+      }
+    }
+  }
+  if (reader.remaining() != 0) {
+    *error = "Unexpected data after the last zone map block";
+    return false;
+  }
+  return true;
+}
+
+void LzoZoneMap::Serialize(string* out) const {
+  out->append(ZONE_MAP_MAGIC, sizeof(ZONE_MAP_MAGIC));
+  PutInt(file_length_, sizeof(int64_t), out);
+  out->push_back(line_delim_);
+  out->push_back(field_delim_);
+  PutInt(columns_.size(), sizeof(int32_t), out);
+  for (const Column& column : columns_) {
+    PutInt(column.index, sizeof(int32_t), out);
+    PutInt(column.type, 1, out);
+  }
+  PutInt(block_offsets_.size(), sizeof(int64_t), out);
+  for (int64_t i = 0; i < block_offsets_.size(); ++i) {
+    PutInt(block_offsets_[i], sizeof(int64_t), out);
+    PutInt(row_ends_[i], 1, out);
+    for (int j = 0; j < columns_.size(); ++j) {
+      const Range& range = GetRange(i, j);
+      PutInt((range.bounded ? RANGE_BOUNDED : 0)
+          | (range.has_values ? RANGE_HAS_VALUES : 0), 1, out);
+      if (!range.bounded || !range.has_values) continue;
+      switch (columns_[j].type) {
+        case INT:
+          PutInt(range.min_int, sizeof(int64_t), out);
+          PutInt(range.max_int, sizeof(int64_t), out);
+          break;
+        case DOUBLE:
+          PutDouble(range.min_double, out);
+          PutDouble(range.max_double, out);
+          break;
+        case STRING:
+          PutString(range.min_string, out);
+          PutString(range.max_string, out);
+          break;
+      }
+    }
+  }
+}
+
+int64_t LzoZoneMap::MemoryUsage() const {
+  int64_t size = sizeof(*this) + columns_.capacity() * sizeof(Column)
+      + block_offsets_.capacity() * sizeof(int64_t) + row_ends_.capacity() / 8
+      + ranges_.capacity() * sizeof(Range);
+  for (const Range& range : ranges_) {
+    size += range.min_string.capacity() + range.max_string.capacity();
+  }
+  return size;
+}
+
+}
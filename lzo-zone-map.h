@@ -0,0 +1,153 @@
+// Copyright (c) 2012 Cloudera, Inc. All rights reserved.
+
+#ifndef IMPALA_LZO_ZONE_MAP_H
+#define IMPALA_LZO_ZONE_MAP_H
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+namespace impala {
+
+// Per-block minimum and maximum values of selected columns of a delimited text lzo
+// file. Zone maps are written by lzo-zonemap-writer to a sidecar next to the file,
+// named like the file with the ".zonemap" suffix, and let scanners skip blocks in
+// which no row can satisfy the query's predicates.
+//
+// The values of a block are those of every row that overlaps the block, including
+// rows that start in an earlier block or end in a later one, so a block that can be
+// skipped can be skipped together with the parts of the rows it shares with its
+// neighbours. NULLs are ignored, since no comparison with them is true.
+//
+// The sidecar holds, big-endian like the .index files of hadoop-lzo:
+//   "LZOZMAP1", the lzo file length (int64), the line and field delimiters (2 bytes),
+//   the number of columns (int32), and for each column its index in the row (int32)
+//   and ColumnType (1 byte).
+//   The number of blocks (int64), and for each block its file offset (int64), whether
+//   a row ends in it (1 byte) and for each column a Range: its flags (1 byte), then,
+//   if it is bounded and has values, the minimum and maximum. Integers and doubles
+//   are 8 bytes, strings an int32 length followed by the bytes.
+//
+// This class does not depend on Impala, so it can be used by the writer.
+class LzoZoneMap {
+ public:
+  // How a column's values are parsed and compared.
+  enum ColumnType {
+    INT = 0,
+    DOUBLE = 1,
+    STRING = 2,
+  };
+
+  // Suffix of the sidecar file name.
+  static const char* const SUFFIX;
+
+  struct Column {
+    // Index of the field in each row, counting from 0.
+    int32_t index;
+    ColumnType type;
+  };
+
+  // Values of one column in one block.
+  struct Range {
+    // False if some value was neither NULL nor parsable as the column's type, in which
+    // case nothing is known about the block's values.
+    bool bounded = true;
+
+    // False if all values were NULL.
+    bool has_values = false;
+
+    // The minimum and maximum, of the member matching the column's type.
+    int64_t min_int = 0;
+    int64_t max_int = 0;
+    double min_double = 0;
+    double max_double = 0;
+    std::string min_string;
+    std::string max_string;
+  };
+
+  // A comparison of a column with a constant, as found in a query's conjuncts.
+  struct Predicate {
+    enum Op { LT, LE, EQ, GE, GT };
+
+    // Index in columns() of the column compared.
+    int column;
+    Op op;
+
+    // The constant, in the member matching the column's type.
+    int64_t int_value = 0;
+    double double_value = 0;
+    std::string string_value;
+  };
+
+  LzoZoneMap() {}
+  LzoZoneMap(int64_t file_length, char line_delim, char field_delim,
+      const std::vector<Column>& columns);
+
+  int64_t file_length() const { return file_length_; }
+  char line_delim() const { return line_delim_; }
+  char field_delim() const { return field_delim_; }
+  const std::vector<Column>& columns() const { return columns_; }
+  int64_t num_blocks() const { return block_offsets_.size(); }
+
+  // Returns the index in columns() of the column of field 'index', or -1 if the
+  // zone map has no values for it.
+  int FindColumn(int32_t index) const;
+
+  // Returns the number of the block at file offset 'offset', or -1 if no block starts
+  // there.
+  int64_t FindBlock(int64_t offset) const;
+
+  // Returns true if a row ends in block 'block'.
+  bool HasRowEnd(int64_t block) const { return row_ends_[block]; }
+
+  // Returns the values of column 'column' in block 'block'.
+  const Range& GetRange(int64_t block, int column) const {
+    return ranges_[block * columns_.size() + column];
+  }
+
+  // Returns true if no row in block 'block' can satisfy all of 'predicates'.
+  bool CanSkip(int64_t block, const std::vector<Predicate>& predicates) const;
+
+  // Appends a block at file offset 'offset', which must be after that of the previous
+  // block, and returns the Ranges of its columns to be filled in.
+  Range* AddBlock(int64_t offset, bool has_row_end);
+
+  // Marks block 'block' as containing the end of a row.
+  void SetRowEnd(int64_t block) { row_ends_[block] = true; }
+
+  // Returns the Range of column 'column' of block 'block' for modification.
+  Range* MutableRange(int64_t block, int column) {
+    return &ranges_[block * columns_.size() + column];
+  }
+
+  // Parses the sidecar contents in the 'len' bytes at 'data' into this zone map.
+  // Returns false and sets *error if they are not a valid zone map.
+  bool Deserialize(const uint8_t* data, int64_t len, std::string* error);
+
+  // Appends the sidecar contents of this zone map to 'out'.
+  void Serialize(std::string* out) const;
+
+  // Returns an estimate of the memory used by this zone map.
+  int64_t MemoryUsage() const;
+
+ private:
+  // Returns true if 'range' of a column of type 'type' holds no value that satisfies
+  // 'predicate'.
+  static bool Excludes(
+      ColumnType type, const Range& range, const Predicate& predicate);
+
+  int64_t file_length_ = 0;
+  char line_delim_ = '\n';
+  char field_delim_ = ',';
+  std::vector<Column> columns_;
+
+  // File offset of each block, in increasing order, and whether a row ends in it.
+  std::vector<int64_t> block_offsets_;
+  std::vector<bool> row_ends_;
+
+  // The Range of each column of each block, by block and then column.
+  std::vector<Range> ranges_;
+};
+
+}
+#endif
@@ -0,0 +1,376 @@
+// Copyright (c) 2012 Cloudera, Inc. All rights reserved.
+//
+// Writes the zone map sidecar (see lzo-zone-map.h) of a local lzop compressed,
+// delimited text file. The sidecar is written next to the file and must be copied
+// next to it in HDFS, like the .index files of hadoop-lzo.
+//
+// Usage: lzo-zonemap-writer [options] <file.lzo> <column>:<type>[,<column>:<type>...]
+//   <column> is the index of a field in each row, counting from 0, and <type> is
+//   'int' for TINYINT to BIGINT columns, 'double' for DOUBLE columns or 'string' for
+//   STRING columns.
+// Options:
+//   --field_delim=<c>  field delimiter of the table, ',' by default
+//   --line_delim=<c>   line delimiter of the table, '\n' by default
+//   --null_string=<s>  NULL value of the table, '\N' by default
+//   --max_string=<n>   strings are truncated to this many bytes, 64 by default
+//
+// Values are parsed more strictly than Impala does, so a value that is not NULL and
+// fails to parse leaves the block's range of the column unbounded, rather than risk
+// skipping a block Impala finds a match in.
+
+#include <errno.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "lzo-decompressor.h"
+#include "lzo-format.h"
+#include "lzo-zone-map.h"
+
+using namespace impala;
+using namespace std;
+
+static bool IsWhitespace(char c) {
+  return c == ' ' || c == '\t' || c == '\n' || c == '\v' || c == '\f' || c == '\r';
+}
+
+// Parses 'value', with optional surrounding whitespace, as a decimal integer. Returns
+// false if it is anything else.
+static bool ParseInt(string value, int64_t* result) {
+  while (!value.empty() && IsWhitespace(value.back())) value.pop_back();
+  size_t start = 0;
+  while (start < value.size() && IsWhitespace(value[start])) ++start;
+  value = value.substr(start);
+  if (value.empty()) return false;
+  size_t digits = value[0] == '-' || value[0] == '+' ? 1 : 0;
+  if (digits == value.size()) return false;
+  for (size_t i = digits; i < value.size(); ++i) {
+    if (value[i] < '0' || value[i] > '9') return false;
+  }
+  errno = 0;
+  *result = strtoll(value.c_str(), nullptr, 10);
+  return errno == 0;
+}
+
+// Parses 'value', with optional surrounding whitespace, as a decimal floating point
+// number without hex digits, infinities or NaNs. Returns false if it is anything else.
+static bool ParseDouble(string value, double* result) {
+  while (!value.empty() && IsWhitespace(value.back())) value.pop_back();
+  size_t start = 0;
+  while (start < value.size() && IsWhitespace(value[start])) ++start;
+  value = value.substr(start);
+  if (value.empty()) return false;
+  for (char c : value) {
+    if (!(c >= '0' && c <= '9') && c != '.' && c != '-' && c != '+' && c != 'e'
+        && c != 'E') {
+      return false;
+    }
+  }
+  char* end;
+  *result = strtod(value.c_str(), &end);
+  return *end == '\0' && !isinf(*result) && !isnan(*result);
+}
+
+// Returns the smallest string of at most 'max_len' bytes that is greater than or
+// equal to every string 'value' is a prefix of, or false if there is none.
+static bool TruncateUpperBound(const string& value, int max_len, string* result) {
+  *result = value.substr(0, max_len);
+  if (value.size() <= max_len) return true;
+  while (!result->empty()) {
+    unsigned char last = result->back();
+    if (last != 0xff) {
+      result->back() = static_cast<char>(last + 1);
+      return true;
+    }
+    result->pop_back();
+  }
+  return false;
+}
+
+namespace {
+
+// Builds the zone map of a file from its decompressed blocks.
+class ZoneMapBuilder {
+ public:
+  ZoneMapBuilder(LzoZoneMap* zone_map, const string& null_string, int max_string)
+    : zone_map_(zone_map), null_string_(null_string), max_string_(max_string) {
+  }
+
+  // Adds the 'len' decompressed bytes at 'data' of the block at file offset 'offset'.
+  void AddBlock(int64_t offset, const uint8_t* data, int64_t len) {
+    int64_t block = zone_map_->num_blocks();
+    zone_map_->AddBlock(offset, false);
+    const char* ptr = reinterpret_cast<const char*>(data);
+    const char* end = ptr + len;
+    while (ptr < end) {
+      if (!row_open_) {
+        row_first_block_ = block;
+        row_open_ = true;
+      }
+      const char* row_end = static_cast<const char*>(
+          memchr(ptr, zone_map_->line_delim(), end - ptr));
+      if (row_end == nullptr) {
+        row_.append(ptr, end - ptr);
+        break;
+      }
+      row_.append(ptr, row_end - ptr);
+      zone_map_->SetRowEnd(block);
+      EndRow(block);
+      row_open_ = false;
+      ptr = row_end + 1;
+    }
+  }
+
+  // Adds the last row if the file does not end with a line delimiter.
+  void Finish() {
+    if (row_open_) EndRow(zone_map_->num_blocks() - 1);
+  }
+
+ private:
+  // Adds the values of 'row_' to the blocks from 'row_first_block_' to 'last_block'.
+  void EndRow(int64_t last_block) {
+    AddRow(row_, last_block);
+    // Impala also ends rows at "\r\n" if the line delimiter is '\n'. Add the values
+    // of both readings of the row.
+    if (zone_map_->line_delim() == '\n' && !row_.empty() && row_.back() == '\r') {
+      row_.pop_back();
+      AddRow(row_, last_block);
+    }
+    row_.clear();
+  }
+
+  // Adds the values of the fields of 'row' to the blocks from 'row_first_block_' to
+  // 'last_block'.
+  void AddRow(const string& row, int64_t last_block) {
+    const vector<LzoZoneMap::Column>& columns = zone_map_->columns();
+    fields_.clear();
+    size_t start = 0;
+    while (true) {
+      size_t pos = row.find(zone_map_->field_delim(), start);
+      fields_.push_back(row.substr(start, pos == string::npos ? pos : pos - start));
+      if (pos == string::npos) break;
+      start = pos + 1;
+    }
+    for (int i = 0; i < columns.size(); ++i) {
+      // Missing fields are NULL.
+      if (columns[i].index >= fields_.size()) continue;
+      for (int64_t block = row_first_block_; block <= last_block; ++block) {
+        AddValue(columns[i].type, fields_[columns[i].index],
+            zone_map_->MutableRange(block, i));
+      }
+    }
+  }
+
+  // Widens 'range' to include 'value'.
+  void AddValue(LzoZoneMap::ColumnType type, const string& value,
+      LzoZoneMap::Range* range) {
+    if (!range->bounded) return;
+    if (value == null_string_) return;
+    switch (type) {
+      case LzoZoneMap::INT: {
+        // Empty values of non-string columns are NULL.
+        if (value.empty()) return;
+        int64_t v;
+        if (!ParseInt(value, &v)) {
+          range->bounded = false;
+          return;
+        }
+        if (!range->has_values || v < range->min_int) range->min_int = v;
+        if (!range->has_values || v > range->max_int) range->max_int = v;
+        break;
+      }
+      case LzoZoneMap::DOUBLE: {
+        if (value.empty()) return;
+        double v;
+        if (!ParseDouble(value, &v)) {
+          range->bounded = false;
+          return;
+        }
+        // Impala's parser may round differently in the last place. Widen by two units
+        // so the range contains its result.
+        double low = nextafter(nextafter(v, -INFINITY), -INFINITY);
+        double high = nextafter(nextafter(v, INFINITY), INFINITY);
+        if (!range->has_values || low < range->min_double) range->min_double = low;
+        if (!range->has_values || high > range->max_double) range->max_double = high;
+        break;
+      }
+      case LzoZoneMap::STRING: {
+        // A prefix is a lower bound of the string.
+        string low = value.substr(0, max_string_);
+        string high;
+        if (!TruncateUpperBound(value, max_string_, &high)) {
+          range->bounded = false;
+          return;
+        }
+        if (!range->has_values || low < range->min_string) range->min_string = low;
+        if (!range->has_values || high > range->max_string) range->max_string = high;
+        break;
+      }
+    }
+    range->has_values = true;
+  }
+
+  LzoZoneMap* zone_map_;
+  const string null_string_;
+  const int max_string_;
+
+  // The bytes of the current row read so far and the first block it overlaps. The
+  // row is open once its first byte, which may be its delimiter, has been read.
+  string row_;
+  int64_t row_first_block_ = 0;
+  bool row_open_ = false;
+
+  // The fields of the row being added.
+  vector<string> fields_;
+};
+
+}
+
+// Reads the lzop file 'data' and adds each block to 'builder'. Returns false and sets
+// *error if the file is not a valid lzop file.
+static bool ReadBlocks(const string& data, ZoneMapBuilder* builder, string* error) {
+  const uint8_t* start = reinterpret_cast<const uint8_t*>(data.data());
+  const uint8_t* end = start + data.size();
+  LzoFileHeader header;
+  if (!LzoFormat::ParseHeader(start, data.size(), &header, error)) return false;
+
+  vector<uint8_t> buffer;
+  for (const uint8_t* ptr = start + header.header_size_; ; ) {
+    int64_t offset = ptr - start;
+    LzoFormat::Block block;
+    if (!LzoFormat::ParseBlock(header, ptr, end - ptr, &block, error)) return false;
+    if (block.uncompressed_len == 0) break;
+    buffer.resize(block.uncompressed_len + LzoDecompressor::OUTPUT_SLACK);
+    const uint8_t* uncompressed;
+    if (!LzoFormat::DecodeBlock(header, block, true, buffer.data(), &uncompressed,
+            error)) {
+      stringstream ss;
+      ss << *error << " at offset " << offset;
+      *error = ss.str();
+      return false;
+    }
+    builder->AddBlock(offset, uncompressed, block.uncompressed_len);
+    ptr += block.header_len + block.compressed_len;
+  }
+  builder->Finish();
+  return true;
+}
+
+// Parses the value of option 'name' out of 'arg', if 'arg' is that option.
+static bool GetOption(const string& arg, const string& name, string* value) {
+  string prefix = "--" + name + "=";
+  if (arg.compare(0, prefix.size(), prefix) != 0) return false;
+  *value = arg.substr(prefix.size());
+  return true;
+}
+
+// Returns the delimiter character written as 'value', which may be an escape such as
+// '\t' or '\001'.
+static bool ParseDelimiter(const string& value, char* delim) {
+  if (value.size() == 1) {
+    *delim = value[0];
+    return true;
+  }
+  if (value == "\\t") {
+    *delim = '\t';
+  } else if (value == "\\n") {
+    *delim = '\n';
+  } else if (value.size() == 4 && value[0] == '\\') {
+    *delim = static_cast<char>(strtol(value.c_str() + 1, nullptr, 8));
+  } else {
+    return false;
+  }
+  return true;
+}
+
+static int Usage() {
+  cerr << "Usage: lzo-zonemap-writer [--field_delim=<c>] [--line_delim=<c>] "
+       << "[--null_string=<s>] [--max_string=<n>] <file.lzo> "
+       << "<column>:<int|double|string>[,...]" << endl;
+  return 1;
+}
+
+int main(int argc, char** argv) {
+  char field_delim = ',';
+  char line_delim = '\n';
+  string null_string = "\\N";
+  int max_string = 64;
+  vector<string> args;
+  for (int i = 1; i < argc; ++i) {
+    string arg = argv[i];
+    string value;
+    if (GetOption(arg, "field_delim", &value)) {
+      if (!ParseDelimiter(value, &field_delim)) return Usage();
+    } else if (GetOption(arg, "line_delim", &value)) {
+      if (!ParseDelimiter(value, &line_delim)) return Usage();
+    } else if (GetOption(arg, "null_string", &value)) {
+      null_string = value;
+    } else if (GetOption(arg, "max_string", &value)) {
+      max_string = atoi(value.c_str());
+      if (max_string <= 0) return Usage();
+    } else if (arg.compare(0, 2, "--") == 0) {
+      return Usage();
+    } else {
+      args.push_back(arg);
+    }
+  }
+  if (args.size() != 2) return Usage();
+
+  vector<LzoZoneMap::Column> columns;
+  stringstream column_specs(args[1]);
+  string spec;
+  while (getline(column_specs, spec, ',')) {
+    size_t colon = spec.find(':');
+    if (colon == string::npos) return Usage();
+    LzoZoneMap::Column column;
+    column.index = atoi(spec.substr(0, colon).c_str());
+    string type = spec.substr(colon + 1);
+    if (type == "int") {
+      column.type = LzoZoneMap::INT;
+    } else if (type == "double") {
+      column.type = LzoZoneMap::DOUBLE;
+    } else if (type == "string") {
+      column.type = LzoZoneMap::STRING;
+    } else {
+      return Usage();
+    }
+    columns.push_back(column);
+  }
+  if (columns.empty()) return Usage();
+
+  const string& filename = args[0];
+  ifstream in(filename.c_str(), ios::in | ios::binary);
+  if (!in.is_open()) {
+    cerr << "Could not open " << filename << ": " << strerror(errno) << endl;
+    return 1;
+  }
+  stringstream contents;
+  contents << in.rdbuf();
+  string data = contents.str();
+
+  LzoZoneMap zone_map(data.size(), line_delim, field_delim, columns);
+  ZoneMapBuilder builder(&zone_map, null_string, max_string);
+  string error;
+  if (!ReadBlocks(data, &builder, &error)) {
+    cerr << filename << ": " << error << endl;
+    return 1;
+  }
+
+  string output;
+  zone_map.Serialize(&output);
+  string output_filename = filename + LzoZoneMap::SUFFIX;
+  ofstream out(output_filename.c_str(), ios::out | ios::binary | ios::trunc);
+  if (!out.write(output.data(), output.size()) || !out.flush()) {
+    cerr << "Could not write " << output_filename << ": " << strerror(errno) << endl;
+    return 1;
+  }
+  cout << "Wrote zone map of " << zone_map.num_blocks() << " blocks to "
+       << output_filename << endl;
+  return 0;
+}